@@ -2,6 +2,14 @@
 #define COMMON_DEFINES_H
 #include <stdint.h>
 #include <float.h>
+#include <string.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define BLIB_SSE2 1
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define BLIB_SSE2 1
+#endif
 #define u8 uint8_t
 #define u16 uint16_t
 #define u32 uint32_t
@@ -101,19 +109,87 @@ void* report_malloc(size_t size, char* file, u32 line)
 #endif
 
 /**
- *Dumb way of testing string equivalence, with a length specifier.
- *Unlikely to be optimal, must check whether sse instructions are being generated by compiler
+ *Tests string equivalence over exactly b_len bytes. Most unequal keys differ in their first
+ *8 bytes, so those are compared as one word before the SSE2/AVX2 loop, and the tail is an
+ *overlapping load of the last chunk rather than a byte loop. Never reads past b_len.
  */
+flocal inline u64 load_u64(const char *p)
+{
+    u64 ret;
+    memcpy(&ret, p, sizeof(ret));
+    return ret;
+}
+
 b32 streq(char *a, char *b, u32 b_len)
 {
-    LOOP(i, b_len)
+    if (b_len < 8)
     {
-        if (a[i] != b[i])
+        if (b_len >= 4)
+        {
+            u32 a_lo, b_lo, a_hi, b_hi;
+            memcpy(&a_lo, a, 4);
+            memcpy(&b_lo, b, 4);
+            memcpy(&a_hi, a + b_len - 4, 4);
+            memcpy(&b_hi, b + b_len - 4, 4);
+            return ((a_lo ^ b_lo) | (a_hi ^ b_hi)) == 0;
+        }
+        LOOP(i, b_len)
+        {
+            if (a[i] != b[i])
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+    if (load_u64(a) != load_u64(b))
+    {
+        return false;
+    }
+    if (b_len <= 16)
+    {
+        return load_u64(a + b_len - 8) == load_u64(b + b_len - 8);
+    }
+    u32 i = 8;
+#if defined(__AVX2__)
+    for (; i + 32 <= b_len; i += 32)
+    {
+        __m256i va = _mm256_loadu_si256((const __m256i *)(a + i));
+        __m256i vb = _mm256_loadu_si256((const __m256i *)(b + i));
+        if ((u32)_mm256_movemask_epi8(_mm256_cmpeq_epi8(va, vb)) != 0xFFFFFFFF)
         {
             return false;
         }
     }
-    return true;
+#endif
+#if defined(BLIB_SSE2)
+    for (; i + 16 <= b_len; i += 16)
+    {
+        __m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+        __m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) != 0xFFFF)
+        {
+            return false;
+        }
+    }
+    if (i == b_len)
+    {
+        return true;
+    }
+    // b_len > 16, so the last 16 bytes are in bounds and overlap what was already compared
+    __m128i va = _mm_loadu_si128((const __m128i *)(a + b_len - 16));
+    __m128i vb = _mm_loadu_si128((const __m128i *)(b + b_len - 16));
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) == 0xFFFF;
+#else
+    for (; i + 8 <= b_len; i += 8)
+    {
+        if (load_u64(a + i) != load_u64(b + i))
+        {
+            return false;
+        }
+    }
+    return i == b_len || load_u64(a + b_len - 8) == load_u64(b + b_len - 8);
+#endif
 }
 
 /**
@@ -1,6 +1,14 @@
 
 
 #include "include/hashmap.h"
+#include "include/hashmap_numa.h"
+#include "include/hashmap_wal.h"
+#include "include/hashmap_stream.h"
+#include "include/hashmap_engines.h"
+#include "include/hashmap_versioned.h"
+#include "include/hashmap_async.h"
+#include "include/hashmap_parallel.h"
+#include "include/hashmap_prefilter.h"
 #include "string.h"
 #include <chrono>
 #include "blib_utils.h"
@@ -8,6 +16,12 @@
 #include "stdlib.h"
 #include "debug_file_io.h"
 #include <unordered_map>
+#include <vector>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
 
 static inline std::chrono::steady_clock::time_point current_time()
 {
@@ -21,7 +35,29 @@ static inline std::chrono::microseconds microseconds_elapsed(std::chrono::steady
     return duration;
 }
 
-// HASH_FUNCTION(str_hash)
+// Raw timestamp counter: a couple of dozen cycles to read, against hundreds for a clock
+// call, so it can bracket every operation. Not serializing, so a single reading may be
+// off by a few instructions either way, which only matters far below the tail.
+static inline u64 read_ticks()
+{
+#if defined(_MSC_VER) || defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return (u64)std::chrono::steady_clock::now().time_since_epoch().count();
+#endif
+}
+
+static double nanoseconds_per_tick()
+{
+    auto start = current_time();
+    u64 start_ticks = read_ticks();
+    while (microseconds_elapsed(start, current_time()).count() < 50000)
+    {
+    }
+    u64 ticks = read_ticks() - start_ticks;
+    return (double)microseconds_elapsed(start, current_time()).count() * 1000.0 / (double)ticks;
+}
+
 // {
 //     len_string *str = (len_string *)to_hash;
 //     size_t hash = 5381;
@@ -65,6 +101,69 @@ HASH_EQUALS(u32_equals, u32)
 
 HASHMAP_INIT(u32_len_string, u32, len_string, u32_hash, u32_equals);
 
+HASHMAP_INIT_SMALL(u32_u32_small, u32, u32, u32_hash, u32_equals, 16);
+HASHMAP_INIT(u32_u32, u32, u32, u32_hash, u32_equals);
+HASHMAP_VERSIONED(u32_u32);
+HASHMAP_ASYNC_REHASH(u32_u32);
+HASHMAP_PARALLEL(u32_u32);
+HASHMAP_PREFILTER(u32_u32);
+HASHMAP_NUMA_REPLICAS(u32_u32);
+HASHMAP_WAL(u32_u32);
+HASHMAP_STREAM_LOADER(u32_u32);
+HASHMAP_CACHE_INIT(u32_u32_cache, u32, u32, u32_hash, u32_equals);
+HASHMAP_INIT_INT(u32_u32_int, u32, u32, u32_hash, 0xFFFFFFFF);
+HASHMAP_SWISS_INIT(u32_u32_swiss, u32, u32, u32_hash, u32_equals);
+HASHMAP_CUCKOO_INIT(u32_u32_cuckoo, u32, u32, u32_hash, u32_equals);
+HASHMAP_HOPSCOTCH_INIT(u32_u32_hopscotch, u32, u32, u32_hash, u32_equals);
+
+HASH_FUNCTION(len_string_hash, len_string)
+{
+    return l_string_hash(to_hash->str, to_hash->string_len);
+}
+
+HASH_EQUALS(len_string_equals, len_string)
+{
+    return *a == *b;
+}
+
+HASH_FUNCTION(len_string_view_hash, len_string_view)
+{
+    return l_string_hash(to_hash->str, to_hash->string_len);
+}
+
+HASH_VIEW_EQUALS(len_string_view_equals, len_string, len_string_view)
+{
+    return *key == *view;
+}
+
+HASHMAP_INIT(len_string_u32, len_string, u32, len_string_hash, len_string_equals);
+HASHMAP_VIEW_LOOKUP(len_string_u32, len_string_view, len_string_view_hash, len_string_view_equals);
+HASHMAP_INIT_STRING(compact_u32, u32, l_string_hash);
+
+struct value_8
+{
+    u8 bytes[8];
+};
+struct value_64
+{
+    u8 bytes[64];
+};
+struct value_256
+{
+    u8 bytes[256];
+};
+
+HASHMAP_INIT(u32_value_8, u32, value_8, u32_hash, u32_equals);
+HASHMAP_INIT(u32_value_64, u32, value_64, u32_hash, u32_equals);
+HASHMAP_INIT(u32_value_256, u32, value_256, u32_hash, u32_equals);
+HASHMAP_INIT_OUT_OF_LINE(u32_value_8_ool, u32, value_8, u32_hash, u32_equals);
+HASHMAP_INIT_OUT_OF_LINE(u32_value_64_ool, u32, value_64, u32_hash, u32_equals);
+HASHMAP_INIT_OUT_OF_LINE(u32_value_256_ool, u32, value_256, u32_hash, u32_equals);
+
+// Inverted index postings: one arena for every key's values vs a vector per key
+HASHMAP_MULTI_INIT(u32_postings, u32, u32, u32_hash, u32_equals);
+HASHMAP_INIT(u32_u32_vector, u32, std::vector<u32>, u32_hash, u32_equals);
+
 // // HASH_MAP_TYPE_INIT(string_int, char *, int, str_hash, str_equals);
 // HASHMAP_INSERT_FUNC(u32_len_string, u32, len_string);
 
@@ -129,80 +228,1592 @@ static void run_unordered_map_tests(u32 *keys, len_string *vals, u32 count)
     // fflush(stderr);
 }
 
-// len_string print_bucket(const h_map &map, const bucket &bucket)
-// {
-//     len_string l = l_string("");
-//     char buf[256];
-//     sprintf(buf, "h_bool full = %d\n h_u32 psl = %ld\n void* key = %lld\n void* val = %lld\n", bucket.full, bucket.psl, (h_u64)bucket.key, (h_u64)bucket.val);
-//     append_to_len_string(&l, buf);
+// Same insert-then-lookup workload as the main loop, for any map generated by HASHMAP_INIT*
+template <typename map_type, typename val_type>
+static float time_value_workload(map_type (*init)(h_u32),
+                                 h_result (*put)(map_type *, u32, val_type),
+                                 h_result (*retrieve)(map_type *, u32, val_type *),
+                                 h_bool (*free_map)(map_type *),
+                                 u32 *keys, u32 count, u32 num_test_iter)
+{
+    val_type val = {};
+    auto start = current_time();
+    for (u32 iter = 0; iter < num_test_iter; iter++)
+    {
+        map_type h = init(HASHMAP_INITIAL_CAPACITY);
+        for (u32 i = 0; i < count; i++)
+        {
+            val.bytes[0] = (u8)i;
+            put(&h, keys[i], val);
+        }
+        for (u32 i = 0; i < count; i++)
+        {
+            retrieve(&h, keys[i], &val);
+        }
+        free_map(&h);
+    }
+    auto us_elapsed = microseconds_elapsed(start, current_time());
+    return (float)us_elapsed.count() / 1000000.0f;
+}
 
-//     return l;
-// }
+static void run_value_size_benchmarks(u32 *keys, u32 count, u32 num_test_iter)
+{
+    float inline_8 = time_value_workload(h_init_u32_value_8, h_put_u32_value_8,
+                                         h_retrieve_u32_value_8, h_free_u32_value_8,
+                                         keys, count, num_test_iter);
+    float ool_8 = time_value_workload(h_init_u32_value_8_ool, h_put_u32_value_8_ool,
+                                      h_retrieve_u32_value_8_ool, h_free_u32_value_8_ool,
+                                      keys, count, num_test_iter);
+    fprintf(stdout, "8 byte values:   inline %.3fs, out of line %.3fs\n", inline_8, ool_8);
 
-// static void run_occupancy_benchmark(h_u32 tests_x, h_u32 tests_y)
-// {
-//     len_string occupancy_vals = l_string("");
-//     for (int i = 0; i < tests_x; i++)
-//     {
-//         h_map h = hashmap(sizeof(u32), sizeof(len_string), u32_hash, u32_equals, tests_y);
-//         auto t = current_time();
+    float inline_64 = time_value_workload(h_init_u32_value_64, h_put_u32_value_64,
+                                          h_retrieve_u32_value_64, h_free_u32_value_64,
+                                          keys, count, num_test_iter);
+    float ool_64 = time_value_workload(h_init_u32_value_64_ool, h_put_u32_value_64_ool,
+                                       h_retrieve_u32_value_64_ool, h_free_u32_value_64_ool,
+                                       keys, count, num_test_iter);
+    fprintf(stdout, "64 byte values:  inline %.3fs, out of line %.3fs\n", inline_64, ool_64);
 
-//         srand(t.time_since_epoch().count());
-//         for (int j = 0; j < tests_y; j++)
-//         {
-//             u32 key = (u32)rand();
-//             char buf[64];
-//             itoa(j, buf, 10);
-//             len_string val = l_string(buf);
-//             h_result result = hashmap_insert_u32_len_string(&h, &key, &val);
-//             if (result != NO_ERROR)
-//             {
-//                 break;
-//             }
-//         }
-//         char buf[32];
-//         sprintf(buf, "%.5f", ((float)h.buckets_used / (float)h.n_buckets));
-//         append_to_len_string(&occupancy_vals, buf);
-//         append_to_len_string(&occupancy_vals, ",");
+    float inline_256 = time_value_workload(h_init_u32_value_256, h_put_u32_value_256,
+                                           h_retrieve_u32_value_256, h_free_u32_value_256,
+                                           keys, count, num_test_iter);
+    float ool_256 = time_value_workload(h_init_u32_value_256_ool, h_put_u32_value_256_ool,
+                                        h_retrieve_u32_value_256_ool, h_free_u32_value_256_ool,
+                                        keys, count, num_test_iter);
+    fprintf(stdout, "256 byte values: inline %.3fs, out of line %.3fs\n", inline_256, ool_256);
+}
 
-//         // fprintf(stderr, "Occupancy: %.2f % (%d / %d)\n\n", 100.0f * ((float)h.buckets_used / (float)h.n_buckets), h.buckets_used, h.n_buckets);
-//         // for (int i = 0; i < h.n_buckets; i++)
-//         // {
-//         //     len_string l = print_bucket(h, h.buckets[i]);
-//         //     fprintf(stderr, l.str);
-//         //     fprintf(stderr, "\n");
-//         //     free_l_string(&l);
-//         // }
-//     }
-//     char file_name[64];
-//     sprintf(file_name, "W:\\blib_hashmap\\results\\occupancy_%d.txt", tests_y);
-//     FILE *f = fopen(file_name, "wb");
-//     fwrite(occupancy_vals.str, sizeof(u8), occupancy_vals.string_len, f);
-//     fclose(f);
-// }
+// Builds, probes and frees one short-lived map per group of 8 keys, as request handlers do
+template <typename map_type>
+static float time_tiny_maps(map_type (*init)(h_u32),
+                            h_result (*put)(map_type *, u32, u32),
+                            h_result (*retrieve)(map_type *, u32, u32 *),
+                            h_bool (*free_map)(map_type *),
+                            u32 *keys, u32 count, u32 num_test_iter)
+{
+    u64 found = 0;
+    auto start = current_time();
+    for (u32 iter = 0; iter < num_test_iter; iter++)
+    {
+        for (u32 group = 0; group + 8 <= count; group += 8)
+        {
+            map_type h = init(HASHMAP_INITIAL_CAPACITY);
+            for (u32 i = group; i < group + 8; i++)
+            {
+                put(&h, keys[i], i);
+            }
+            for (u32 i = group; i < group + 8; i++)
+            {
+                u32 val = 0;
+                found += retrieve(&h, keys[i], &val) == NO_ERROR;
+            }
+            free_map(&h);
+        }
+    }
+    auto us_elapsed = microseconds_elapsed(start, current_time());
+    return (float)us_elapsed.count() / 1000000.0f;
+}
 
-int main(int argc, char **argv)
+// Same workload, but one map is cleared between groups instead of being rebuilt, as a
+// request handler reusing its scratch map would
+template <typename map_type>
+static float time_reused_tiny_maps(map_type (*init)(h_u32),
+                                   h_result (*put)(map_type *, u32, u32),
+                                   h_result (*retrieve)(map_type *, u32, u32 *),
+                                   void (*clear)(map_type *),
+                                   h_bool (*free_map)(map_type *),
+                                   u32 *keys, u32 count, u32 num_test_iter)
 {
+    u64 found = 0;
+    auto start = current_time();
+    map_type h = init(HASHMAP_INITIAL_CAPACITY);
+    for (u32 iter = 0; iter < num_test_iter; iter++)
+    {
+        for (u32 group = 0; group + 8 <= count; group += 8)
+        {
+            clear(&h);
+            for (u32 i = group; i < group + 8; i++)
+            {
+                put(&h, keys[i], i);
+            }
+            for (u32 i = group; i < group + 8; i++)
+            {
+                u32 val = 0;
+                found += retrieve(&h, keys[i], &val) == NO_ERROR;
+            }
+        }
+    }
+    free_map(&h);
+    auto us_elapsed = microseconds_elapsed(start, current_time());
+    return (float)us_elapsed.count() / 1000000.0f;
+}
 
-    printf("Building test buffer...\n");
-    u32 test_count = 25000000; // (u32)pow(2, 16);
-    u32 *keys = (u32 *)malloc(sizeof(u32) * test_count);
-    len_string *vals = (len_string *)malloc(sizeof(len_string) * test_count);
-    srand(1);
-    for (int i = 0; i < test_count; i++)
+static void run_tiny_map_benchmark(u32 *keys, u32 count, u32 num_test_iter)
+{
+    float table = time_tiny_maps(h_init_u32_u32, h_put_u32_u32, h_retrieve_u32_u32,
+                                 h_free_u32_u32, keys, count, num_test_iter);
+    float small = time_tiny_maps(h_init_u32_u32_small, h_put_u32_u32_small,
+                                 h_retrieve_u32_u32_small, h_free_u32_u32_small,
+                                 keys, count, num_test_iter);
+    float reused = time_reused_tiny_maps(h_init_u32_u32, h_put_u32_u32, h_retrieve_u32_u32,
+                                         h_clear_u32_u32, h_free_u32_u32, keys, count,
+                                         num_test_iter);
+    fprintf(stdout, "8 entry maps: table %.3fs, inline %.3fs, cleared table %.3fs\n", table,
+            small, reused);
+}
+
+// Looks every key up straight out of one packed buffer, as request parsing would, either by
+// building an owning len_string per lookup or by probing with a view into the buffer
+static void run_view_lookup_benchmark(len_string *strings, u32 count, u32 num_test_iter)
+{
+    h_map_len_string_u32 h = h_init_len_string_u32();
+    u64 buffer_len = 0;
+    for (u32 i = 0; i < count; i++)
     {
-        keys[i] = (u32)rand();
-        char buf[64];
-        itoa(i, buf, 10);
-        vals[i] = l_string(buf);
+        h_put_len_string_u32(&h, strings[i], i);
+        buffer_len += strings[i].string_len;
     }
-    printf("Beginning tests...\n");
-    u32 num_test_iter = 128;
-    if (argc > 1)
+    char *buffer = (char *)malloc(buffer_len);
+    u64 *offsets = (u64 *)malloc(sizeof(u64) * count);
+    u64 offset = 0;
+    for (u32 i = 0; i < count; i++)
     {
-        num_test_iter = atoi(argv[1]);
+        offsets[i] = offset;
+        memcpy(buffer + offset, strings[i].str, strings[i].string_len);
+        offset += strings[i].string_len;
+    }
+
+    u64 found = 0;
+    auto start = current_time();
+    for (u32 iter = 0; iter < num_test_iter; iter++)
+    {
+        for (u32 i = 0; i < count; i++)
+        {
+            u32 val = 0;
+            len_string key = l_string(buffer + offsets[i], strings[i].string_len);
+            found += h_retrieve_len_string_u32(&h, key, &val) == NO_ERROR;
+            free_l_string(&key);
+        }
+    }
+    auto us_elapsed = microseconds_elapsed(start, current_time());
+    fprintf(stdout, "len_string key lookup: %.3fs\n", (float)us_elapsed.count() / 1000000.0f);
+
+    start = current_time();
+    for (u32 iter = 0; iter < num_test_iter; iter++)
+    {
+        for (u32 i = 0; i < count; i++)
+        {
+            u32 val = 0;
+            len_string_view view = l_string_view(buffer + offsets[i], strings[i].string_len);
+            found += h_retrieve_len_string_u32(&h, &view, &val) == NO_ERROR;
+        }
+    }
+    us_elapsed = microseconds_elapsed(start, current_time());
+    fprintf(stdout, "len_string_view lookup: %.3fs (%llu found)\n",
+            (float)us_elapsed.count() / 1000000.0f, (unsigned long long)found);
+
+    free(offsets);
+    free(buffer);
+    h_free_len_string_u32(&h);
+}
+
+// Bytes per entry and lookup time for string keys held as len_strings vs compact keys,
+// once with the short decimal strings and once with them behind a long shared prefix.
+// A len_string key's bytes include its heap buffer, which the map doesn't own.
+static void time_string_keys(const char *label, len_string *keys, u32 count, u32 num_test_iter)
+{
+    h_map_len_string_u32 h = h_init_len_string_u32();
+    u64 len_string_bytes = 0;
+    for (u32 i = 0; i < count; i++)
+    {
+        h_put_len_string_u32(&h, keys[i], i);
+        len_string_bytes += keys[i].buffer_len;
+    }
+    len_string_bytes += (u64)bucket_array_size(h.n_buckets) *
+                        (sizeof(h_bool) + sizeof(h_u32) + sizeof(len_string) + sizeof(u32));
+
+    h_map_compact_u32 compact = h_init_compact_u32();
+    for (u32 i = 0; i < count; i++)
+    {
+        h_put_compact_u32(&compact, keys[i].str, keys[i].string_len, i);
+    }
+    u64 compact_bytes = (u64)bucket_array_size(compact.n_buckets) *
+                            (sizeof(h_compact_key) + sizeof(h_u8) + sizeof(u32)) +
+                        compact.arena_used;
+
+    u64 found = 0;
+    auto start = current_time();
+    for (u32 iter = 0; iter < num_test_iter; iter++)
+    {
+        for (u32 i = 0; i < count; i++)
+        {
+            u32 val = 0;
+            found += h_retrieve_len_string_u32(&h, keys[i], &val) == NO_ERROR;
+        }
+    }
+    float len_string_time = (float)microseconds_elapsed(start, current_time()).count() / 1000000.0f;
+
+    start = current_time();
+    for (u32 iter = 0; iter < num_test_iter; iter++)
+    {
+        for (u32 i = 0; i < count; i++)
+        {
+            u32 val = 0;
+            found += h_retrieve_compact_u32(&compact, keys[i].str, keys[i].string_len, &val) ==
+                     NO_ERROR;
+        }
+    }
+    float compact_time = (float)microseconds_elapsed(start, current_time()).count() / 1000000.0f;
+
+    fprintf(stdout, "%s len_string: %.1f bytes/entry, %.3fs; compact: %.1f bytes/entry, %.3fs\n",
+            label, (double)len_string_bytes / count, len_string_time,
+            (double)compact_bytes / count, compact_time);
+    if (found != 2ull * count * num_test_iter)
+    {
+        fprintf(stderr, "string maps lost keys\n");
+    }
+    if (compact_bytes > len_string_bytes)
+    {
+        fprintf(stderr, "%s: compact map uses more memory than the len_string map\n", label);
+    }
+    h_free_compact_u32(&compact);
+    h_free_len_string_u32(&h);
+}
+
+static void run_compact_string_benchmark(len_string *strings, u32 count, u32 num_test_iter)
+{
+    time_string_keys("short keys", strings, count, num_test_iter);
+
+    len_string *long_keys = (len_string *)malloc(sizeof(len_string) * count);
+    for (u32 i = 0; i < count; i++)
+    {
+        long_keys[i] = l_string("https://example.com/items/");
+        append_to_len_string(&long_keys[i], strings[i].str, strings[i].string_len);
+    }
+    time_string_keys("prefixed keys", long_keys, count, num_test_iter);
+    for (u32 i = 0; i < count; i++)
+    {
+        free_l_string(&long_keys[i]);
+    }
+    free(long_keys);
+}
+
+// Puts and lookups of random keys against keys that are all multiples of 4096. u32_hash
+// is the identity, so the second set all share their low 12 bits: without reseeding they
+// pile into one bucket per 4096 and every overflowing run doubles the table.
+static void time_put_retrieve(const char *label, u32 *keys, u32 count, u32 num_test_iter)
+{
+    float put_time = 0.0f;
+    float retrieve_time = 0.0f;
+    u32 n_buckets = 0;
+    u64 found = 0;
+    for (u32 iter = 0; iter < num_test_iter; iter++)
+    {
+        auto start = current_time();
+        h_map_u32_u32 h = h_init_u32_u32();
+        for (u32 i = 0; i < count; i++)
+        {
+            h_put_u32_u32(&h, keys[i], i);
+        }
+        auto mid = current_time();
+        for (u32 i = 0; i < count; i++)
+        {
+            u32 val = 0;
+            found += h_retrieve_u32_u32(&h, keys[i], &val) == NO_ERROR;
+        }
+        put_time += (float)microseconds_elapsed(start, mid).count() / 1000000.0f;
+        retrieve_time += (float)microseconds_elapsed(mid, current_time()).count() / 1000000.0f;
+        n_buckets = h.n_buckets;
+        h_free_u32_u32(&h);
+    }
+    fprintf(stdout, "%s: put %.3fs, retrieve %.3fs, %u buckets for %u keys (%llu found)\n", label,
+            put_time, retrieve_time, n_buckets, count, (unsigned long long)found);
+}
+
+static void run_hostile_key_benchmark(u32 *keys, u32 count, u32 num_test_iter)
+{
+    if (count > (1u << 20))
+    {
+        count = 1u << 20;
+    }
+    u32 *hostile = (u32 *)malloc(sizeof(u32) * count);
+    for (u32 i = 0; i < count; i++)
+    {
+        hostile[i] = i << 12;
+    }
+    time_put_retrieve("random keys", keys, count, num_test_iter);
+    time_put_retrieve("colliding keys", hostile, count, num_test_iter);
+    free(hostile);
+}
+
+// Lookups against the same keys with and without a Bloom prefilter, as the share of lookups
+// that hit goes from none to all. Misses set the top bit, which rand() never does.
+static void run_prefilter_benchmark(u32 *keys, u32 count, u32 num_test_iter)
+{
+    h_map_u32_u32 plain = h_init_u32_u32();
+    h_filtered_u32_u32 filtered = h_init_filtered_u32_u32();
+    for (u32 i = 0; i < count; i++)
+    {
+        h_put_u32_u32(&plain, keys[i], i);
+        h_put_u32_u32(&filtered, keys[i], i);
+    }
+    const u32 hit_percents[] = {0, 10, 50, 90, 100};
+    u32 *probes = (u32 *)malloc(sizeof(u32) * count);
+    for (u32 p = 0; p < arrayCount(hit_percents); p++)
+    {
+        for (u32 i = 0; i < count; i++)
+        {
+            u32 key = keys[(i * 7919u) % count];
+            probes[i] = (u32)(rand() % 100) < hit_percents[p] ? key : key | 0x80000000u;
+        }
+        u64 plain_found = 0;
+        auto start = current_time();
+        for (u32 iter = 0; iter < num_test_iter; iter++)
+        {
+            for (u32 i = 0; i < count; i++)
+            {
+                u32 val = 0;
+                plain_found += h_retrieve_u32_u32(&plain, probes[i], &val) == NO_ERROR;
+            }
+        }
+        float plain_time = (float)microseconds_elapsed(start, current_time()).count() / 1000000.0f;
+
+        u64 filtered_found = 0;
+        start = current_time();
+        for (u32 iter = 0; iter < num_test_iter; iter++)
+        {
+            for (u32 i = 0; i < count; i++)
+            {
+                u32 val = 0;
+                filtered_found += h_retrieve_u32_u32(&filtered, probes[i], &val) == NO_ERROR;
+            }
+        }
+        float filtered_time =
+            (float)microseconds_elapsed(start, current_time()).count() / 1000000.0f;
+        fprintf(stdout, "%3u%% hits: plain %.3fs, prefiltered %.3fs\n", hit_percents[p],
+                plain_time, filtered_time);
+        if (plain_found != filtered_found)
+        {
+            fprintf(stderr, "prefiltered map disagrees with plain map\n");
+        }
+    }
+    fprintf(stdout, "filter: %.1f bits per entry\n",
+            (double)(filtered.filter.word_mask + 1) * 64.0 / (double)filtered.map.buckets_used);
+
+    // Removing keys until the tables shrink through their low water mark moves every key's
+    // home, long before enough keys are gone for the removal count alone to rebuild the filter
+    h_set_low_water_u32_u32(&plain, 30);
+    h_set_low_water_u32_u32(&filtered.map, 30);
+    h_u32 n_buckets = filtered.map.n_buckets;
+    for (u32 i = 0; i < count && filtered.map.n_buckets == n_buckets; i++)
+    {
+        h_remove_u32_u32(&plain, keys[i]);
+        h_remove_u32_u32(&filtered, keys[i]);
+    }
+    u64 plain_found = 0;
+    u64 filtered_found = 0;
+    for (u32 i = 0; i < count; i++)
+    {
+        u32 val = 0;
+        plain_found += h_retrieve_u32_u32(&plain, keys[i], &val) == NO_ERROR;
+        filtered_found += h_retrieve_u32_u32(&filtered, keys[i], &val) == NO_ERROR;
+    }
+    if (plain_found != filtered_found)
+    {
+        fprintf(stderr, "prefiltered map disagrees with plain map after shrinking\n");
+    }
+    free(probes);
+    h_free_u32_u32(&filtered);
+    h_free_u32_u32(&plain);
+}
+
+// Looks up, counts and group-sums a probe array twice the size of the map, half of it keys
+// in the map and half random (mostly misses), serially through h_retrieve_* and then with
+// the parallel kernels at 1, 2, 4... threads up to the hardware thread count
+static void run_parallel_lookup_benchmark(u32 *keys, u32 count, u32 num_test_iter)
+{
+    const u32 n_groups = 1024;
+    h_map_u32_u32 h = h_init_u32_u32();
+    for (u32 i = 0; i < count; i++)
+    {
+        h_put_u32_u32(&h, keys[i], i % n_groups);
+    }
+    u64 n_probes = 2ull * count;
+    u32 *probes = (u32 *)malloc(sizeof(u32) * n_probes);
+    u64 *weights = (u64 *)malloc(sizeof(u64) * n_probes);
+    u32 *out = (u32 *)malloc(sizeof(u32) * n_probes);
+    u64 *sums = (u64 *)malloc(sizeof(u64) * n_groups);
+    for (u64 i = 0; i < n_probes; i++)
+    {
+        probes[i] = (i & 1) ? keys[(i / 2) % count] : (u32)rand() * 2654435761u;
+        weights[i] = i & 7;
+    }
+
+    u64 serial_found = 0;
+    auto start = current_time();
+    for (u32 iter = 0; iter < num_test_iter; iter++)
+    {
+        memset(sums, 0, sizeof(u64) * n_groups);
+        for (u64 i = 0; i < n_probes; i++)
+        {
+            if (h_retrieve_u32_u32(&h, probes[i], &out[i]) == NO_ERROR)
+            {
+                serial_found++;
+                sums[out[i]] += weights[i];
+            }
+        }
+    }
+    float serial = (float)microseconds_elapsed(start, current_time()).count() / 1000000.0f;
+    fprintf(stdout, "serial retrieve + sum: %.3fs\n", serial);
+
+    u32 max_threads = std::thread::hardware_concurrency();
+    if (!max_threads)
+    {
+        max_threads = 1;
+    }
+    for (u32 n_threads = 1;; n_threads *= 2)
+    {
+        if (n_threads > max_threads)
+        {
+            n_threads = max_threads;
+        }
+        u64 found = 0;
+        float kernel_time[3] = {};
+        for (u32 iter = 0; iter < num_test_iter; iter++)
+        {
+            start = current_time();
+            found += h_parallel_retrieve_u32_u32(&h, probes, n_probes, out, 0, n_threads);
+            auto mid = current_time();
+            found -= h_parallel_count_u32_u32(&h, probes, n_probes, n_threads);
+            auto counted = current_time();
+            memset(sums, 0, sizeof(u64) * n_groups);
+            h_parallel_group_sum_u32_u32(&h, probes, weights, n_probes, sums, n_groups,
+                                         n_threads);
+            auto summed = current_time();
+            kernel_time[0] += (float)microseconds_elapsed(start, mid).count() / 1000000.0f;
+            kernel_time[1] += (float)microseconds_elapsed(mid, counted).count() / 1000000.0f;
+            kernel_time[2] += (float)microseconds_elapsed(counted, summed).count() / 1000000.0f;
+        }
+        fprintf(stdout, "%u threads: retrieve %.3fs, count %.3fs, group sum %.3fs\n", n_threads,
+                kernel_time[0], kernel_time[1], kernel_time[2]);
+        if (found)
+        {
+            fprintf(stderr, "parallel retrieve and count disagree\n");
+        }
+        if (n_threads == max_threads)
+        {
+            break;
+        }
+    }
+    fprintf(stdout, "(%llu serial hits)\n", (unsigned long long)serial_found);
+
+    free(sums);
+    free(out);
+    free(weights);
+    free(probes);
+    h_free_u32_u32(&h);
+}
+
+// The byte loop streq used to be, kept to compare against
+static b32 streq_bytes(char *a, char *b, u32 b_len)
+{
+    LOOP(i, b_len)
+    {
+        if (a[i] != b[i])
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Compares count pairs of len byte strings, either equal or differing only in their last
+// byte, so the whole string is read either way
+static float time_streq(b32 (*eq)(char *, char *, u32), char *a, char *b, u32 len, u32 count,
+                        u32 num_test_iter, u64 *matches)
+{
+    auto start = current_time();
+    for (u32 iter = 0; iter < num_test_iter; iter++)
+    {
+        for (u32 i = 0; i < count; i++)
+        {
+            *matches += eq(a + (u64)i * len, b + (u64)i * len, len);
+        }
+    }
+    return (float)microseconds_elapsed(start, current_time()).count() / 1000000.0f;
+}
+
+// streq on its own at a few key lengths, then a string keyed map whose keys share a long
+// prefix, so every probe that matches a tag compares most of a key
+static void run_string_equality_benchmark(len_string *strings, u32 count, u32 num_test_iter)
+{
+    const u32 lengths[] = {7, 12, 24, 64, 256};
+    const u32 pairs = 4096;
+    u64 matches = 0;
+    for (u32 l = 0; l < arrayCount(lengths); l++)
+    {
+        u32 len = lengths[l];
+        char *a = (char *)malloc((u64)pairs * len);
+        char *b = (char *)malloc((u64)pairs * len);
+        for (u64 i = 0; i < (u64)pairs * len; i++)
+        {
+            a[i] = (char)('a' + rand() % 26);
+        }
+        memcpy(b, a, (u64)pairs * len);
+        float bytes_eq = time_streq(streq_bytes, a, b, len, pairs, num_test_iter, &matches);
+        float simd_eq = time_streq(streq, a, b, len, pairs, num_test_iter, &matches);
+        for (u32 i = 0; i < pairs; i++)
+        {
+            b[(u64)i * len + len - 1] ^= 1;
+        }
+        float bytes_ne = time_streq(streq_bytes, a, b, len, pairs, num_test_iter, &matches);
+        float simd_ne = time_streq(streq, a, b, len, pairs, num_test_iter, &matches);
+        fprintf(stdout, "%3u bytes: equal %.3fs -> %.3fs, unequal %.3fs -> %.3fs\n", len,
+                bytes_eq, simd_eq, bytes_ne, simd_ne);
+        free(a);
+        free(b);
+    }
+    if (matches != 2ull * pairs * num_test_iter * arrayCount(lengths))
+    {
+        fprintf(stderr, "streq disagreed with the byte loop\n");
+    }
+
+    auto start = current_time();
+    len_string *keys = (len_string *)malloc(sizeof(len_string) * count);
+    for (u32 i = 0; i < count; i++)
+    {
+        keys[i] = l_string("https://example.com/catalogue/items/by-id/");
+        append_to_len_string(&keys[i], strings[i].str, strings[i].string_len);
+    }
+    float build = (float)microseconds_elapsed(start, current_time()).count() / 1000000.0f;
+
+    u64 found = 0;
+    start = current_time();
+    for (u32 iter = 0; iter < num_test_iter; iter++)
+    {
+        h_map_len_string_u32 h = h_init_len_string_u32();
+        for (u32 i = 0; i < count; i++)
+        {
+            h_put_len_string_u32(&h, keys[i], i);
+        }
+        for (u32 i = 0; i < count; i++)
+        {
+            u32 val = 0;
+            found += h_retrieve_len_string_u32(&h, keys[i], &val) == NO_ERROR;
+        }
+        h_free_len_string_u32(&h);
+    }
+    float map = (float)microseconds_elapsed(start, current_time()).count() / 1000000.0f;
+    fprintf(stdout, "building %u prefixed keys: %.3fs; len_string map put+retrieve: %.3fs\n",
+            count, build, map);
+    if (found != (u64)count * num_test_iter)
+    {
+        fprintf(stderr, "len_string map lost keys\n");
+    }
+    for (u32 i = 0; i < count; i++)
+    {
+        free_l_string(&keys[i]);
+    }
+    free(keys);
+}
+
+// Buckets visited and keys compared by a lookup for an absent key, stopping either where
+// a resident's PSL drops below the probe distance or (as lookups now do) where its rank
+// drops below the key's. Only the second also skips comparing keys whose tag differs.
+struct miss_probe_counts
+{
+    u64 psl_visited;
+    u64 psl_compares;
+    u64 rank_visited;
+    u64 rank_compares;
+};
+
+template <typename map_type>
+static void count_miss_probes(map_type *map, h_u64 hash, miss_probe_counts *counts)
+{
+    h_u64 home = h_seed_hash(hash, map->seed) & (map->n_buckets - 1);
+    h_u32 rank = h_rank_tag(hash);
+    h_bool psl_done = H_FALSE;
+    h_bool rank_done = H_FALSE;
+    for (h_u64 i = home; i < home + map->max_psl && !(psl_done && rank_done); i++)
+    {
+        h_bool empty = !map->fulls[i];
+        if (!psl_done)
+        {
+            counts->psl_visited++;
+            psl_done = empty || h_rank_psl(map->psls[i]) < i - home;
+            counts->psl_compares += !psl_done;
+        }
+        if (!rank_done)
+        {
+            counts->rank_visited++;
+            rank_done = empty || map->psls[i] < rank;
+            counts->rank_compares += !rank_done && map->psls[i] == rank;
+        }
+        rank += H_RANK_PSL_ONE;
+    }
+}
+
+// Half the keys are inserted and every lookup is for the other half, so each one misses
+static void run_miss_benchmark(u32 *keys, len_string *strings, u32 count, u32 num_test_iter)
+{
+    u32 half = count / 2;
+    h_map_len_string_u32 strs = h_init_len_string_u32();
+    h_map_u32_u32 ints = h_init_u32_u32();
+    for (u32 i = 0; i < half; i++)
+    {
+        h_put_len_string_u32(&strs, strings[i], i);
+        h_put_u32_u32(&ints, keys[i], i);
+    }
+
+    miss_probe_counts str_counts = {};
+    miss_probe_counts int_counts = {};
+    u32 misses = 0;
+    for (u32 i = half; i < count; i++)
+    {
+        count_miss_probes(&strs, len_string_hash(&strings[i]), &str_counts);
+        u32 val = 0;
+        if (h_retrieve_u32_u32(&ints, keys[i], &val) != NO_ERROR)
+        {
+            count_miss_probes(&ints, u32_hash(&keys[i]), &int_counts);
+            misses++;
+        }
+    }
+    u32 n_str = count - half;
+    fprintf(stdout, "len_string misses: %.2f -> %.2f buckets, %.2f -> %.2f compares per lookup\n",
+            (float)str_counts.psl_visited / n_str, (float)str_counts.rank_visited / n_str,
+            (float)str_counts.psl_compares / n_str, (float)str_counts.rank_compares / n_str);
+    fprintf(stdout, "u32 misses:        %.2f -> %.2f buckets, %.2f -> %.2f compares per lookup\n",
+            (float)int_counts.psl_visited / misses, (float)int_counts.rank_visited / misses,
+            (float)int_counts.psl_compares / misses, (float)int_counts.rank_compares / misses);
+
+    u64 found = 0;
+    auto start = current_time();
+    for (u32 iter = 0; iter < num_test_iter; iter++)
+    {
+        for (u32 i = half; i < count; i++)
+        {
+            u32 val = 0;
+            found += h_retrieve_len_string_u32(&strs, strings[i], &val) == NO_ERROR;
+        }
+    }
+    auto str_elapsed = microseconds_elapsed(start, current_time());
+    start = current_time();
+    for (u32 iter = 0; iter < num_test_iter; iter++)
+    {
+        for (u32 i = half; i < count; i++)
+        {
+            u32 val = 0;
+            found += h_retrieve_u32_u32(&ints, keys[i], &val) == NO_ERROR;
+        }
+    }
+    auto int_elapsed = microseconds_elapsed(start, current_time());
+    fprintf(stdout, "miss lookups: len_string %.3fs, u32 %.3fs (%llu found)\n",
+            (float)str_elapsed.count() / 1000000.0f, (float)int_elapsed.count() / 1000000.0f,
+            (unsigned long long)found);
+    h_free_len_string_u32(&strs);
+    h_free_u32_u32(&ints);
+}
+
+HASH_COMBINE(u32_add, u32)
+{
+    *into += *from;
+}
+
+// Four overlapping per-thread partial counts folded into one map, either by re-inserting
+// every entry (hashing each key again) or with h_merge
+static void run_merge_benchmark(len_string *strings, u32 count, u32 num_test_iter)
+{
+    const u32 n_partials = 4;
+    h_map_len_string_u32 partials[n_partials];
+    for (u32 p = 0; p < n_partials; p++)
+    {
+        partials[p] = h_init_len_string_u32(count);
+        for (u32 i = p * (count / 8); i < p * (count / 8) + count / 2; i++)
+        {
+            h_put_len_string_u32(&partials[p], strings[i], 1);
+        }
+    }
+
+    u64 total = 0;
+    auto start = current_time();
+    for (u32 iter = 0; iter < num_test_iter; iter++)
+    {
+        h_map_len_string_u32 h = h_copy_len_string_u32(&partials[0]);
+        for (u32 p = 1; p < n_partials; p++)
+        {
+            h_map_len_string_u32 *src = &partials[p];
+            h_u32 array_size = bucket_array_size(src->n_buckets);
+            for (h_u32 i = 0; i < array_size; i++)
+            {
+                if (!src->fulls[i])
+                {
+                    continue;
+                }
+                h_u64 index = 0;
+                if (find_index_len_string_u32(&h, &src->keys[i], &index) == NO_ERROR)
+                {
+                    h.vals[index] += src->vals[i];
+                }
+                else
+                {
+                    h_put_len_string_u32(&h, src->keys[i], src->vals[i]);
+                }
+            }
+        }
+        total += h.buckets_used;
+        h_free_len_string_u32(&h);
+    }
+    auto us_elapsed = microseconds_elapsed(start, current_time());
+    fprintf(stdout, "re-insert merge: %.3fs\n", (float)us_elapsed.count() / 1000000.0f);
+
+    start = current_time();
+    for (u32 iter = 0; iter < num_test_iter; iter++)
+    {
+        h_map_len_string_u32 h = h_copy_len_string_u32(&partials[0]);
+        for (u32 p = 1; p < n_partials; p++)
+        {
+            h_merge_len_string_u32(&h, &partials[p], u32_add);
+        }
+        total += h.buckets_used;
+        h_free_len_string_u32(&h);
+    }
+    us_elapsed = microseconds_elapsed(start, current_time());
+    fprintf(stdout, "h_merge: %.3fs (%llu entries)\n", (float)us_elapsed.count() / 1000000.0f,
+            (unsigned long long)total);
+
+    for (u32 p = 0; p < n_partials; p++)
+    {
+        h_free_len_string_u32(&partials[p]);
+    }
+}
+
+// Builds an inverted index of roughly 16 postings per key, then reads every key's postings
+static void run_multimap_benchmark(u32 *keys, u32 count, u32 num_test_iter)
+{
+    u32 n_keys = count / 16 + 1;
+    u64 sum = 0;
+    auto start = current_time();
+    for (u32 iter = 0; iter < num_test_iter; iter++)
+    {
+        h_map_u32_u32_vector h = h_init_u32_u32_vector();
+        for (u32 i = 0; i < count; i++)
+        {
+            u32 key = keys[i] % n_keys;
+            h_u64 index = 0;
+            if (find_index_u32_u32_vector(&h, &key, &index) != NO_ERROR)
+            {
+                h_put_u32_u32_vector(&h, key, std::vector<u32>());
+                find_index_u32_u32_vector(&h, &key, &index);
+            }
+            val_at_u32_u32_vector(&h, index)->push_back(i);
+        }
+        for (u32 key = 0; key < n_keys; key++)
+        {
+            h_u64 index = 0;
+            if (find_index_u32_u32_vector(&h, &key, &index) == NO_ERROR)
+            {
+                std::vector<u32> *postings = val_at_u32_u32_vector(&h, index);
+                for (u32 i = 0; i < postings->size(); i++)
+                {
+                    sum += (*postings)[i];
+                }
+            }
+        }
+        h_free_u32_u32_vector(&h);
+    }
+    auto us_elapsed = microseconds_elapsed(start, current_time());
+    fprintf(stdout, "vector per key: %.3fs\n", (float)us_elapsed.count() / 1000000.0f);
+
+    start = current_time();
+    for (u32 iter = 0; iter < num_test_iter; iter++)
+    {
+        h_map_u32_postings h = h_init_u32_postings();
+        for (u32 i = 0; i < count; i++)
+        {
+            h_put_u32_postings(&h, keys[i] % n_keys, i);
+        }
+        for (u32 key = 0; key < n_keys; key++)
+        {
+            h_span_u32_postings postings = h_retrieve_all_u32_postings(&h, key);
+            for (u32 i = 0; i < postings.count; i++)
+            {
+                sum += postings.vals[i];
+            }
+        }
+        h_free_u32_postings(&h);
+    }
+    us_elapsed = microseconds_elapsed(start, current_time());
+    fprintf(stdout, "multimap: %.3fs (%llu)\n", (float)us_elapsed.count() / 1000000.0f,
+            (unsigned long long)sum);
+}
+
+// One pinned reader per node, all probing node 0's copy (as with one shared map) or each
+// probing the copy on its own node. On a single node box both runs read the same copy.
+static float time_node_readers(h_replicas_u32_u32 *replicas, h_bool local, u32 *keys, u32 count,
+                               u32 num_test_iter)
+{
+    std::thread readers[H_NUMA_MAX_NODES];
+    u64 found[H_NUMA_MAX_NODES] = {};
+    auto start = current_time();
+    for (u32 node = 0; node < replicas->n_nodes; node++)
+    {
+        readers[node] = std::thread([=, &found]() {
+            h_numa_pin_to_node(node);
+            h_map_u32_u32 *shared = &replicas->replicas[0];
+            u64 node_found = 0;
+            for (u32 iter = 0; iter < num_test_iter; iter++)
+            {
+                for (u32 i = 0; i < count; i++)
+                {
+                    u32 val = 0;
+                    h_result res = local ? h_retrieve_u32_u32(replicas, keys[i], &val)
+                                         : h_retrieve_u32_u32(shared, keys[i], &val);
+                    node_found += res == NO_ERROR;
+                }
+            }
+            found[node] = node_found;
+        });
+    }
+    for (u32 node = 0; node < replicas->n_nodes; node++)
+    {
+        readers[node].join();
+    }
+    auto us_elapsed = microseconds_elapsed(start, current_time());
+    return (float)us_elapsed.count() / 1000000.0f;
+}
+
+static void run_numa_benchmark(u32 *keys, u32 count, u32 num_test_iter)
+{
+    h_map_u32_u32 h = h_init_u32_u32(count);
+    for (u32 i = 0; i < count; i++)
+    {
+        h_put_u32_u32(&h, keys[i], i);
+    }
+    h_replicas_u32_u32 replicas = h_replicate_u32_u32(&h);
+    float shared = time_node_readers(&replicas, H_FALSE, keys, count, num_test_iter);
+    float local = time_node_readers(&replicas, H_TRUE, keys, count, num_test_iter);
+    float lookups = (float)count * num_test_iter * replicas.n_nodes / 1000000.0f;
+    fprintf(stdout, "%u node(s): node 0 copy %.1f M lookups/s, local copy %.1f M lookups/s\n",
+            replicas.n_nodes, lookups / shared, lookups / local);
+    h_free_u32_u32(&replicas);
+    h_free_u32_u32(&h);
+}
+
+// Logged puts with an fsync per operation vs group commit, then recovery of the log.
+// The fsync-per-put run is capped, since each put then waits on the disk.
+static float time_logged_puts(const char *path, u32 *keys, u32 count, u32 group_size)
+{
+    remove(path);
+    h_map_u32_u32 h = h_init_u32_u32();
+    h_wal_u32_u32 wal = h_wal_open_u32_u32(&h, path, group_size);
+    auto start = current_time();
+    for (u32 i = 0; i < count; i++)
+    {
+        h_wal_put_u32_u32(&wal, keys[i], i);
+    }
+    h_wal_close_u32_u32(&wal);
+    auto us_elapsed = microseconds_elapsed(start, current_time());
+    h_free_u32_u32(&h);
+    return (float)us_elapsed.count() / count;
+}
+
+static void run_wal_benchmark(u32 *keys, u32 count)
+{
+    const char *path = "hashmap_bench.wal";
+    u32 synced_count = count < 1000 ? count : 1000;
+    float per_op = time_logged_puts(path, keys, synced_count, 1);
+    float grouped = time_logged_puts(path, keys, count, H_WAL_DEFAULT_GROUP_SIZE);
+    fprintf(stdout, "fsync per put: %.2fus/put, group commit: %.2fus/put\n", per_op, grouped);
+
+    h_map_u32_u32 h = h_init_u32_u32();
+    h_u64 records = 0;
+    auto start = current_time();
+    h_wal_recover_u32_u32(&h, path, &records);
+    auto us_elapsed = microseconds_elapsed(start, current_time());
+    fprintf(stdout, "recovered %llu records in %.3fs\n", (unsigned long long)records,
+            (float)us_elapsed.count() / 1000000.0f);
+
+    // A crash mid-write leaves a torn record at the end of the log. Commits made after
+    // recovering from it, and a checkpoint after those, must all survive the next recovery.
+    FILE *file = fopen(path, "ab");
+    fwrite("\x01\x02\x03", 1, 3, file);
+    fclose(file);
+    h_free_u32_u32(&h);
+    h = h_init_u32_u32();
+    h_wal_recover_u32_u32(&h, path);
+    u32 expected = h.buckets_used;
+    h_wal_u32_u32 wal = h_wal_open_u32_u32(&h, path);
+    for (u32 i = 0; i < 1000; i++)
+    {
+        expected += h_wal_put_u32_u32(&wal, 0x80000000u | i, i) == NO_ERROR;
+    }
+    h_wal_commit_u32_u32(&wal);
+    h_map_u32_u32 after_commit = h_init_u32_u32();
+    h_wal_recover_u32_u32(&after_commit, path);
+    h_wal_checkpoint_u32_u32(&wal);
+    h_wal_close_u32_u32(&wal);
+    h_map_u32_u32 after_checkpoint = h_init_u32_u32();
+    h_wal_recover_u32_u32(&after_checkpoint, path);
+    if (after_commit.buckets_used != expected || after_checkpoint.buckets_used != expected)
+    {
+        fprintf(stderr, "log lost commits after a torn tail: %u and %u of %u entries\n",
+                after_commit.buckets_used, after_checkpoint.buckets_used, expected);
+    }
+    h_free_u32_u32(&after_checkpoint);
+    h_free_u32_u32(&after_commit);
+    h_free_u32_u32(&h);
+    remove(path);
+}
+
+// Loads a file of binary u32 key/value records, slurping it whole and inserting record by
+// record vs streaming it through h_load_binary
+static void run_stream_benchmark(u32 *keys, u32 count)
+{
+    const char *path = "hashmap_bench.bin";
+    FILE *file = fopen(path, "wb");
+    for (u32 i = 0; i < count; i++)
+    {
+        fwrite(&keys[i], sizeof(u32), 1, file);
+        fwrite(&i, sizeof(u32), 1, file);
+    }
+    fclose(file);
+
+    auto start = current_time();
+    u64 size = 0;
+    u8 *data = read_entire_file_binary((char *)path, &size);
+    h_map_u32_u32 h = h_init_u32_u32();
+    for (u64 offset = 0; offset + 2 * sizeof(u32) <= size; offset += 2 * sizeof(u32))
+    {
+        u32 key, val;
+        memcpy(&key, data + offset, sizeof(u32));
+        memcpy(&val, data + offset + sizeof(u32), sizeof(u32));
+        h_put_u32_u32(&h, key, val);
+    }
+    free(data);
+    auto us_elapsed = microseconds_elapsed(start, current_time());
+    fprintf(stdout, "read whole file + h_put: %.3fs (%u entries)\n",
+            (float)us_elapsed.count() / 1000000.0f, h.buckets_used);
+    h_free_u32_u32(&h);
+
+    start = current_time();
+    h = h_init_u32_u32();
+    h_u64 loaded = 0;
+    h_load_binary_u32_u32(&h, path, &loaded);
+    us_elapsed = microseconds_elapsed(start, current_time());
+    fprintf(stdout, "h_load_binary: %.3fs (%llu entries)\n", (float)us_elapsed.count() / 1000000.0f,
+            (unsigned long long)loaded);
+    h_free_u32_u32(&h);
+    remove(path);
+}
+
+// Inserts every key, then looks each one up and looks up as many absent keys. rand() never
+// sets the top bit, so keys with it set miss without touching the empty key.
+template <typename map_type>
+static void time_u32_workload(map_type (*init)(h_u32),
+                              h_result (*put)(map_type *, u32, u32),
+                              h_result (*retrieve)(map_type *, u32, u32 *),
+                              h_bool (*free_map)(map_type *),
+                              u32 *keys, u32 count, u32 num_test_iter,
+                              float *o_insert, float *o_hit, float *o_miss)
+{
+    u32 found = 0;
+    *o_insert = *o_hit = *o_miss = 0.0f;
+    for (u32 iter = 0; iter < num_test_iter; iter++)
+    {
+        map_type h = init(HASHMAP_INITIAL_CAPACITY);
+        auto start = current_time();
+        for (u32 i = 0; i < count; i++)
+        {
+            put(&h, keys[i], i);
+        }
+        auto inserted = current_time();
+        for (u32 i = 0; i < count; i++)
+        {
+            u32 val = 0;
+            found += retrieve(&h, keys[i], &val) == NO_ERROR;
+        }
+        auto hit = current_time();
+        for (u32 i = 0; i < count; i++)
+        {
+            u32 val = 0;
+            found += retrieve(&h, 0x80000000 | (keys[i] >> 1), &val) == NO_ERROR;
+        }
+        auto missed = current_time();
+        *o_insert += (float)microseconds_elapsed(start, inserted).count() / 1000000.0f;
+        *o_hit += (float)microseconds_elapsed(inserted, hit).count() / 1000000.0f;
+        *o_miss += (float)microseconds_elapsed(hit, missed).count() / 1000000.0f;
+        free_map(&h);
+    }
+    if (found != count * num_test_iter)
+    {
+        fprintf(stderr, "u32 workload found %u of %u keys\n", found, count * num_test_iter);
+    }
+}
+
+static void run_int_key_benchmark(u32 *keys, u32 count, u32 num_test_iter)
+{
+    float insert = 0.0f, hit = 0.0f, miss = 0.0f;
+    time_u32_workload(h_init_u32_u32, h_put_u32_u32, h_retrieve_u32_u32, h_free_u32_u32, keys,
+                      count, num_test_iter, &insert, &hit, &miss);
+    fprintf(stdout, "HASHMAP_INIT:     insert %.3fs, hits %.3fs, misses %.3fs\n", insert, hit,
+            miss);
+    time_u32_workload(h_init_u32_u32_int, h_put_u32_u32_int, h_retrieve_u32_u32_int,
+                      h_free_u32_u32_int, keys, count, num_test_iter, &insert, &hit, &miss);
+    fprintf(stdout, "HASHMAP_INIT_INT: insert %.3fs, hits %.3fs, misses %.3fs\n", insert, hit,
+            miss);
+}
+
+enum trace_op
+{
+    TRACE_GET,
+    TRACE_PUT,
+    TRACE_REMOVE,
+};
+
+struct trace_entry
+{
+    trace_op op;
+    u32 key;
+};
+
+// Replays one trace of gets, puts and removes on a map, starting from empty each iteration
+template <typename map_type>
+static float time_trace(map_type (*init)(h_u32),
+                        h_result (*put)(map_type *, u32, u32),
+                        h_result (*retrieve)(map_type *, u32, u32 *),
+                        h_result (*remove)(map_type *, u32, u32 *),
+                        h_bool (*free_map)(map_type *),
+                        trace_entry *trace, u32 count, u32 num_test_iter, u64 *o_found)
+{
+    auto start = current_time();
+    for (u32 iter = 0; iter < num_test_iter; iter++)
+    {
+        map_type h = init(HASHMAP_INITIAL_CAPACITY);
+        for (u32 i = 0; i < count; i++)
+        {
+            u32 val = 0;
+            switch (trace[i].op)
+            {
+            case TRACE_GET:
+                *o_found += retrieve(&h, trace[i].key, &val) == NO_ERROR;
+                break;
+            case TRACE_PUT:
+                put(&h, trace[i].key, i);
+                break;
+            case TRACE_REMOVE:
+                remove(&h, trace[i].key, &val);
+                break;
+            }
+        }
+        free_map(&h);
+    }
+    auto us_elapsed = microseconds_elapsed(start, current_time());
+    return (float)us_elapsed.count() / 1000000.0f;
+}
+
+// Every engine replays the same traces: a read heavy mix and a write heavy one, each
+// drawing keys from a pool of half the key buffer so that gets both hit and miss
+static void run_engine_benchmark(u32 *keys, u32 count, u32 num_test_iter)
+{
+    trace_entry *trace = (trace_entry *)malloc(sizeof(trace_entry) * count);
+    u32 read_pcts[] = {90, 50};
+    for (u32 mix = 0; mix < 2; mix++)
+    {
+        srand(3);
+        for (u32 i = 0; i < count; i++)
+        {
+            u32 roll = (u32)rand() % 100;
+            trace[i].key = keys[(u32)rand() % (count / 2 + 1)];
+            if (roll < read_pcts[mix])
+            {
+                trace[i].op = TRACE_GET;
+            }
+            else
+            {
+                trace[i].op = roll % 4 == 0 ? TRACE_REMOVE : TRACE_PUT;
+            }
+        }
+        u64 found[4] = {};
+        float robin_hood = time_trace(h_init_u32_u32, h_put_u32_u32, h_retrieve_u32_u32,
+                                      h_remove_u32_u32, h_free_u32_u32, trace, count,
+                                      num_test_iter, &found[0]);
+        float swiss = time_trace(h_init_u32_u32_swiss, h_put_u32_u32_swiss,
+                                 h_retrieve_u32_u32_swiss, h_remove_u32_u32_swiss,
+                                 h_free_u32_u32_swiss, trace, count, num_test_iter, &found[1]);
+        float cuckoo = time_trace(h_init_u32_u32_cuckoo, h_put_u32_u32_cuckoo,
+                                  h_retrieve_u32_u32_cuckoo, h_remove_u32_u32_cuckoo,
+                                  h_free_u32_u32_cuckoo, trace, count, num_test_iter,
+                                  &found[2]);
+        float hopscotch = time_trace(h_init_u32_u32_hopscotch, h_put_u32_u32_hopscotch,
+                                     h_retrieve_u32_u32_hopscotch, h_remove_u32_u32_hopscotch,
+                                     h_free_u32_u32_hopscotch, trace, count, num_test_iter,
+                                     &found[3]);
+        fprintf(stdout,
+                "%u%% reads: robin hood %.3fs, swiss %.3fs, cuckoo %.3fs, hopscotch %.3fs\n",
+                read_pcts[mix], robin_hood, swiss, cuckoo, hopscotch);
+        if (found[1] != found[0] || found[2] != found[0] || found[3] != found[0])
+        {
+            fprintf(stderr, "engines disagree: %llu %llu %llu %llu hits\n",
+                    (unsigned long long)found[0], (unsigned long long)found[1],
+                    (unsigned long long)found[2], (unsigned long long)found[3]);
+        }
+    }
+    free(trace);
+}
+
+// HDR-style histogram: exact below 32 ticks, then 16 sub-buckets per power of two, so any
+// recorded latency is reported to within about 6% however long the tail gets
+#define LATENCY_SUB_BUCKETS 16
+#define LATENCY_BUCKETS (2 * LATENCY_SUB_BUCKETS + 64 * LATENCY_SUB_BUCKETS)
+
+struct latency_histogram
+{
+    u64 counts[LATENCY_BUCKETS];
+    u64 total;
+    u64 max;
+};
+
+static inline u32 latency_bucket(u64 ticks)
+{
+    if (ticks < 2 * LATENCY_SUB_BUCKETS)
+    {
+        return (u32)ticks;
+    }
+    u32 msb = (ticks >> 32) ? 32 + log_2_h_u32((h_u32)(ticks >> 32)) : log_2_h_u32((h_u32)ticks);
+    u32 shift = msb - 4;
+    return 2 * LATENCY_SUB_BUCKETS + (shift - 1) * LATENCY_SUB_BUCKETS +
+           (u32)(ticks >> shift) - LATENCY_SUB_BUCKETS;
+}
+
+// Largest tick count that falls in bucket
+static inline u64 latency_bucket_ticks(u32 bucket)
+{
+    if (bucket < 2 * LATENCY_SUB_BUCKETS)
+    {
+        return bucket;
+    }
+    u32 shift = (bucket - 2 * LATENCY_SUB_BUCKETS) / LATENCY_SUB_BUCKETS + 1;
+    u64 mantissa = (bucket - 2 * LATENCY_SUB_BUCKETS) % LATENCY_SUB_BUCKETS + LATENCY_SUB_BUCKETS;
+    return ((mantissa + 1) << shift) - 1;
+}
+
+static inline void record_latency(latency_histogram *histogram, u64 ticks)
+{
+    histogram->counts[latency_bucket(ticks)]++;
+    histogram->total++;
+    if (ticks > histogram->max)
+    {
+        histogram->max = ticks;
+    }
+}
+
+static u64 latency_percentile(latency_histogram *histogram, double percentile)
+{
+    u64 wanted = (u64)(percentile / 100.0 * (double)histogram->total);
+    u64 seen = 0;
+    for (u32 i = 0; i < LATENCY_BUCKETS; i++)
+    {
+        seen += histogram->counts[i];
+        if (seen > wanted)
+        {
+            return latency_bucket_ticks(i) < histogram->max ? latency_bucket_ticks(i)
+                                                            : histogram->max;
+        }
+    }
+    return histogram->max;
+}
+
+static void print_latencies(const char *label, latency_histogram *histogram, double ns_per_tick)
+{
+    fprintf(stdout, "%-24s p50 %7.0fns  p99 %7.0fns  p99.9 %8.0fns  max %10.0fns\n", label,
+            latency_percentile(histogram, 50.0) * ns_per_tick,
+            latency_percentile(histogram, 99.0) * ns_per_tick,
+            latency_percentile(histogram, 99.9) * ns_per_tick, histogram->max * ns_per_tick);
+}
+
+// The main loop's workload with every put and get timed on its own, so the puts that
+// land on a grow_map rehash show up in the tail instead of vanishing into the total
+static void run_latency_benchmark(u32 *keys, len_string *vals, u32 count, u32 num_test_iter)
+{
+    latency_histogram *histograms = (latency_histogram *)calloc(4, sizeof(latency_histogram));
+    latency_histogram *h_map_puts = &histograms[0];
+    latency_histogram *h_map_gets = &histograms[1];
+    latency_histogram *std_puts = &histograms[2];
+    latency_histogram *std_gets = &histograms[3];
+    for (u32 iter = 0; iter < num_test_iter; iter++)
+    {
+        h_map_u32_len_string h = h_init_u32_len_string();
+        for (u32 i = 0; i < count; i++)
+        {
+            u64 start = read_ticks();
+            h_put_u32_len_string(&h, keys[i], vals[i]);
+            record_latency(h_map_puts, read_ticks() - start);
+        }
+        for (u32 i = 0; i < count; i++)
+        {
+            len_string ret;
+            u64 start = read_ticks();
+            h_retrieve_u32_len_string(&h, keys[i], &ret);
+            record_latency(h_map_gets, read_ticks() - start);
+        }
+        h_free_u32_len_string(&h);
+
+        std::unordered_map<u32, len_string> map;
+        for (u32 i = 0; i < count; i++)
+        {
+            u64 start = read_ticks();
+            map.emplace(keys[i], vals[i]);
+            record_latency(std_puts, read_ticks() - start);
+        }
+        for (u32 i = 0; i < count; i++)
+        {
+            u64 start = read_ticks();
+            auto found = map.find(keys[i]);
+            record_latency(std_gets, read_ticks() - start);
+            (void)found;
+        }
+    }
+    double ns_per_tick = nanoseconds_per_tick();
+    print_latencies("h_map put:", h_map_puts, ns_per_tick);
+    print_latencies("h_map get:", h_map_gets, ns_per_tick);
+    print_latencies("std::unordered_map put:", std_puts, ns_per_tick);
+    print_latencies("std::unordered_map get:", std_gets, ns_per_tick);
+    free(histograms);
+}
+
+// Per-put latency while filling a map from empty, growing inside h_put vs handing each
+// rehash past H_ASYNC_MIN_BUCKETS to a background thread
+static void run_async_rehash_benchmark(u32 *keys, u32 count, u32 num_test_iter)
+{
+    latency_histogram *histograms = (latency_histogram *)calloc(2, sizeof(latency_histogram));
+    latency_histogram *inline_puts = &histograms[0];
+    latency_histogram *async_puts = &histograms[1];
+    for (u32 iter = 0; iter < num_test_iter; iter++)
+    {
+        h_map_u32_u32 h = h_init_u32_u32();
+        for (u32 i = 0; i < count; i++)
+        {
+            u64 start = read_ticks();
+            h_put_u32_u32(&h, keys[i], i);
+            record_latency(inline_puts, read_ticks() - start);
+        }
+        h_free_u32_u32(&h);
+
+        h_async_u32_u32 async = h_init_async_u32_u32();
+        for (u32 i = 0; i < count; i++)
+        {
+            u64 start = read_ticks();
+            h_put_u32_u32(&async, keys[i], i);
+            record_latency(async_puts, read_ticks() - start);
+        }
+        h_free_u32_u32(&async);
+    }
+    double ns_per_tick = nanoseconds_per_tick();
+    print_latencies("inline rehash put:", inline_puts, ns_per_tick);
+    print_latencies("async rehash put:", async_puts, ns_per_tick);
+    free(histograms);
+}
+
+// Replays a Zipfian (s = 0.99) trace through caches holding 1%, 5% and 10% of the distinct
+// keys, filling the cache on every miss
+static void run_cache_benchmark(u32 *keys, u32 count)
+{
+    u32 n_distinct = count < 1000000 ? count : 1000000;
+    double *cdf = (double *)malloc(sizeof(double) * n_distinct);
+    double total = 0.0;
+    for (u32 i = 0; i < n_distinct; i++)
+    {
+        total += 1.0 / pow((double)(i + 1), 0.99);
+        cdf[i] = total;
+    }
+    u32 *trace = (u32 *)malloc(sizeof(u32) * count);
+    srand(2);
+    for (u32 i = 0; i < count; i++)
+    {
+        double target = total * ((double)rand() / ((double)RAND_MAX + 1.0));
+        u32 lo = 0;
+        u32 hi = n_distinct - 1;
+        while (lo < hi)
+        {
+            u32 mid = (lo + hi) / 2;
+            if (cdf[mid] < target)
+            {
+                lo = mid + 1;
+            }
+            else
+            {
+                hi = mid;
+            }
+        }
+        trace[i] = keys[lo];
+    }
+    free(cdf);
+
+    u32 percents[] = {1, 5, 10};
+    for (u32 p = 0; p < 3; p++)
+    {
+        h_cache_u32_u32_cache cache = h_cache_init_u32_u32_cache(n_distinct / 100 * percents[p]);
+        auto start = current_time();
+        for (u32 i = 0; i < count; i++)
+        {
+            u32 val = 0;
+            if (h_cache_get_u32_u32_cache(&cache, trace[i], &val) != NO_ERROR)
+            {
+                h_cache_put_u32_u32_cache(&cache, trace[i], i);
+            }
+        }
+        auto us_elapsed = microseconds_elapsed(start, current_time());
+        fprintf(stdout, "cache of %u%%: hit rate %.3f, %.3fs\n", percents[p],
+                h_cache_hit_rate_u32_u32_cache(&cache), (float)us_elapsed.count() / 1000000.0f);
+        h_cache_free_u32_u32_cache(&cache);
+    }
+    free(trace);
+}
+
+// len_string print_bucket(const h_map &map, const bucket &bucket)
+// {
+//     len_string l = l_string("");
+//     char buf[256];
+//     sprintf(buf, "h_bool full = %d\n h_u32 psl = %ld\n void* key = %lld\n void* val = %lld\n", bucket.full, bucket.psl, (h_u64)bucket.key, (h_u64)bucket.val);
+//     append_to_len_string(&l, buf);
+
+//     return l;
+// }
+
+// static void run_occupancy_benchmark(h_u32 tests_x, h_u32 tests_y)
+// {
+//     len_string occupancy_vals = l_string("");
+//     for (int i = 0; i < tests_x; i++)
+//     {
+//         h_map h = hashmap(sizeof(u32), sizeof(len_string), u32_hash, u32_equals, tests_y);
+//         auto t = current_time();
+
+//         srand(t.time_since_epoch().count());
+//         for (int j = 0; j < tests_y; j++)
+//         {
+//             u32 key = (u32)rand();
+//             char buf[64];
+//             itoa(j, buf, 10);
+//             len_string val = l_string(buf);
+//             h_result result = hashmap_insert_u32_len_string(&h, &key, &val);
+//             if (result != NO_ERROR)
+//             {
+//                 break;
+//             }
+//         }
+//         char buf[32];
+//         sprintf(buf, "%.5f", ((float)h.buckets_used / (float)h.n_buckets));
+//         append_to_len_string(&occupancy_vals, buf);
+//         append_to_len_string(&occupancy_vals, ",");
+
+//         // fprintf(stderr, "Occupancy: %.2f % (%d / %d)\n\n", 100.0f * ((float)h.buckets_used / (float)h.n_buckets), h.buckets_used, h.n_buckets);
+//         // for (int i = 0; i < h.n_buckets; i++)
+//         // {
+//         //     len_string l = print_bucket(h, h.buckets[i]);
+//         //     fprintf(stderr, l.str);
+//         //     fprintf(stderr, "\n");
+//         //     free_l_string(&l);
+//         // }
+//     }
+//     char file_name[64];
+//     sprintf(file_name, "W:\\blib_hashmap\\results\\occupancy_%d.txt", tests_y);
+//     FILE *f = fopen(file_name, "wb");
+//     fwrite(occupancy_vals.str, sizeof(u8), occupancy_vals.string_len, f);
+//     fclose(f);
+// }
+
+// Puts into a versioned map with no snapshots, then again taking a snapshot every
+// snapshot_every puts and keeping it until the next, so writes keep landing on chunks a
+// snapshot still shares and have to copy them.
+static float time_versioned_puts(u32 *keys, u32 count, u32 snapshot_every, u64 *o_snapshot_ns)
+{
+    h_versioned_u32_u32 h = h_init_versioned_u32_u32();
+    h_versioned_u32_u32 snapshot = {};
+    u64 snapshot_ns = 0;
+    auto start = current_time();
+    for (u32 i = 0; i < count; i++)
+    {
+        if (snapshot_every && i % snapshot_every == 0)
+        {
+            h_free_u32_u32(&snapshot);
+            auto snapshot_start = std::chrono::steady_clock::now();
+            snapshot = h_snapshot_u32_u32(&h);
+            snapshot_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                               std::chrono::steady_clock::now() - snapshot_start)
+                               .count();
+        }
+        h_put_u32_u32(&h, keys[i], i);
+    }
+    auto us_elapsed = microseconds_elapsed(start, current_time());
+    h_free_u32_u32(&snapshot);
+    h_free_u32_u32(&h);
+    *o_snapshot_ns = snapshot_ns;
+    return (float)us_elapsed.count() / 1000000.0f;
+}
+
+static void run_snapshot_benchmark(u32 *keys, u32 count, u32 num_test_iter)
+{
+    const u32 snapshot_every = 4096;
+    float plain = 0.0f;
+    float versioned = 0.0f;
+    float snapshotted = 0.0f;
+    u64 snapshot_ns = 0;
+    for (u32 iter = 0; iter < num_test_iter; iter++)
+    {
+        auto start = current_time();
+        h_map_u32_u32 h = h_init_u32_u32();
+        for (u32 i = 0; i < count; i++)
+        {
+            h_put_u32_u32(&h, keys[i], i);
+        }
+        h_free_u32_u32(&h);
+        plain += (float)microseconds_elapsed(start, current_time()).count() / 1000000.0f;
+
+        u64 ns = 0;
+        versioned += time_versioned_puts(keys, count, 0, &ns);
+        snapshotted += time_versioned_puts(keys, count, snapshot_every, &ns);
+        snapshot_ns += ns;
+    }
+    u64 n_snapshots = (u64)((count + snapshot_every - 1) / snapshot_every) * num_test_iter;
+    fprintf(stdout, "h_map puts: %.3fs\n", plain);
+    fprintf(stdout, "versioned puts: %.3fs\n", versioned);
+    fprintf(stdout, "versioned puts, snapshot every %u: %.3fs (%.0fns per snapshot)\n",
+            snapshot_every, snapshotted, (double)snapshot_ns / (double)n_snapshots);
+}
+
+int main(int argc, char **argv)
+{
+
+    u32 num_test_iter = 128;
+    if (argc > 1)
+    {
+        num_test_iter = atoi(argv[1]);
+    }
+    const char *benchmark = "default";
+    if (argc > 2)
+    {
+        benchmark = argv[2];
+    }
+    u32 test_count = 25000000; // (u32)pow(2, 16);
+    if (argc > 3)
+    {
+        test_count = atoi(argv[3]);
+    }
+
+    printf("Building test buffer...\n");
+    u32 *keys = (u32 *)malloc(sizeof(u32) * test_count);
+    len_string *vals = (len_string *)malloc(sizeof(len_string) * test_count);
+    srand(1);
+    for (int i = 0; i < test_count; i++)
+    {
+        keys[i] = (u32)rand();
+        char buf[64];
+        itoa(i, buf, 10);
+        vals[i] = l_string(buf);
+    }
+    printf("Beginning tests...\n");
+    printf("num_test_iter: %d\n", num_test_iter);
+    if (strcmp(benchmark, "value_sizes") == 0)
+    {
+        run_value_size_benchmarks(keys, test_count, num_test_iter);
+        return 0;
+    }
+    if (strcmp(benchmark, "tiny_maps") == 0)
+    {
+        run_tiny_map_benchmark(keys, test_count, num_test_iter);
+        return 0;
+    }
+    if (strcmp(benchmark, "hostile_keys") == 0)
+    {
+        run_hostile_key_benchmark(keys, test_count, num_test_iter);
+        return 0;
+    }
+    if (strcmp(benchmark, "prefilter") == 0)
+    {
+        run_prefilter_benchmark(keys, test_count, num_test_iter);
+        return 0;
+    }
+    if (strcmp(benchmark, "parallel_lookup") == 0)
+    {
+        run_parallel_lookup_benchmark(keys, test_count, num_test_iter);
+        return 0;
+    }
+    if (strcmp(benchmark, "string_equality") == 0)
+    {
+        run_string_equality_benchmark(vals, test_count, num_test_iter);
+        return 0;
+    }
+    if (strcmp(benchmark, "compact_strings") == 0)
+    {
+        run_compact_string_benchmark(vals, test_count, num_test_iter);
+        return 0;
+    }
+    if (strcmp(benchmark, "async_rehash") == 0)
+    {
+        run_async_rehash_benchmark(keys, test_count, num_test_iter);
+        return 0;
+    }
+    if (strcmp(benchmark, "snapshots") == 0)
+    {
+        run_snapshot_benchmark(keys, test_count, num_test_iter);
+        return 0;
+    }
+    if (strcmp(benchmark, "latency") == 0)
+    {
+        run_latency_benchmark(keys, vals, test_count, num_test_iter);
+        return 0;
+    }
+    if (strcmp(benchmark, "engines") == 0)
+    {
+        run_engine_benchmark(keys, test_count, num_test_iter);
+        return 0;
+    }
+    if (strcmp(benchmark, "misses") == 0)
+    {
+        run_miss_benchmark(keys, vals, test_count, num_test_iter);
+        return 0;
+    }
+    if (strcmp(benchmark, "int_keys") == 0)
+    {
+        run_int_key_benchmark(keys, test_count, num_test_iter);
+        return 0;
+    }
+    if (strcmp(benchmark, "cache") == 0)
+    {
+        run_cache_benchmark(keys, test_count);
+        return 0;
+    }
+    if (strcmp(benchmark, "stream") == 0)
+    {
+        run_stream_benchmark(keys, test_count);
+        return 0;
+    }
+    if (strcmp(benchmark, "wal") == 0)
+    {
+        run_wal_benchmark(keys, test_count);
+        return 0;
+    }
+    if (strcmp(benchmark, "numa") == 0)
+    {
+        run_numa_benchmark(keys, test_count, num_test_iter);
+        return 0;
+    }
+    if (strcmp(benchmark, "multimap") == 0)
+    {
+        run_multimap_benchmark(keys, test_count, num_test_iter);
+        return 0;
+    }
+    if (strcmp(benchmark, "merge") == 0)
+    {
+        run_merge_benchmark(vals, test_count, num_test_iter);
+        return 0;
+    }
+    if (strcmp(benchmark, "view_lookup") == 0)
+    {
+        run_view_lookup_benchmark(vals, test_count, num_test_iter);
+        return 0;
     }
-    printf("num_test_iter: %d\n", num_test_iter);
     auto start = current_time();
     for (int i = 0; i < num_test_iter; i++)
     {
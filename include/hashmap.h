@@ -6,8 +6,31 @@
 #include <malloc.h>
 #include <string.h>
 #include <math.h>
+#include <new>
+#include <random>
+#include <utility>
+#include <type_traits>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define H_HAS_SSE2 1
+#endif
 
 #define HASHMAP_INITIAL_CAPACITY 32
+#define HASHMAP_MIN_CAPACITY 8
+// Load factor (in percent) that h_shrink_to_fit_* rehashes down to
+#define HASHMAP_SHRINK_TARGET_LOAD_PCT 50
+// An insert whose run would overflow max_psl doubles the table, or reseeds it instead if it
+// has at least HASHMAP_RESEED_MIN_BUCKETS buckets and is under HASHMAP_RESEED_LOAD_PCT full
+// (see h_seed_hash). That is done once per insert: if the key still doesn't fit, h_put_*
+// returns MAP_FULL and the table doesn't grow again.
+#define HASHMAP_RESEED_LOAD_PCT 25
+#define HASHMAP_RESEED_MIN_BUCKETS 1024
+// Non-zero seeds every map at h_init_* rather than on its first pathological run. Maps then
+// rarely share a seed, so h_merge_* and set operations between them rehash every key.
+#ifndef HASHMAP_SEED_HASHES
+#define HASHMAP_SEED_HASHES 0
+#endif
 
 #if H_DEBUG
 #define H_ASSERT(pred, text)                                               \
@@ -25,6 +48,7 @@
 typedef uint64_t h_u64;
 typedef uint8_t h_bool;
 typedef uint32_t h_u32;
+typedef uint8_t h_u8;
 typedef size_t h_size;
 #define H_SUCCESS (1)
 #define H_TRUE (1)
@@ -47,6 +71,8 @@ enum h_result
     FOUND_HIGHER_PSL,
     EMPTY_BUCKET,
     EXCEEDED_MAP_BOUNDS,
+    // The key is one a map reserves for itself, like HASHMAP_INIT_INT's __empty_key
+    RESERVED_KEY,
     UNKNOWN_ERROR = 0xFFFF
 };
 
@@ -89,43 +115,418 @@ static inline h_u32 max_psl(h_u32 n_buckets)
     return log_2_h_u32(n_buckets);
 }
 
+// Buckets past n_buckets absorb runs that start near the end of the table, so probing
+// never wraps and never has to grow just because it ran off the end.
+static inline h_u32 bucket_array_size(h_u32 n_buckets)
+{
+    return n_buckets + max_psl(n_buckets);
+}
+
+static inline h_u64 h_align_up(h_u64 offset, h_u64 alignment)
+{
+    return (offset + alignment - 1) & ~(alignment - 1);
+}
+
 static inline h_u64 power_2_mod(h_u64 a, h_u64 b)
 {
     return a & (b - 1);
 }
 
+// Buckets are raw storage: only full buckets hold live objects. These move entries
+// around without temporaries, degrading to memcpy for trivially copyable types.
+template <typename T>
+static inline void h_move_construct(T *dst, T *src)
+{
+    if (std::is_trivially_copyable<T>::value)
+    {
+        memcpy((void *)dst, (void *)src, sizeof(T));
+    }
+    else
+    {
+        new (dst) T(std::move(*src));
+    }
+}
+
+template <typename T>
+static inline void h_destroy(T *obj)
+{
+    if (!std::is_trivially_destructible<T>::value)
+    {
+        obj->~T();
+    }
+}
+
+template <typename T>
+static inline void h_copy_construct(T *dst, T *src)
+{
+    if (std::is_trivially_copyable<T>::value)
+    {
+        memcpy((void *)dst, (void *)src, sizeof(T));
+    }
+    else
+    {
+        new (dst) T(*src);
+    }
+}
+
+// Moves *src into uninitialised storage at dst and ends the lifetime of *src
+template <typename T>
+static inline void h_relocate(T *dst, T *src)
+{
+    h_move_construct(dst, src);
+    h_destroy(src);
+}
+
+template <typename T>
+static inline void h_swap(T *a, T *b)
+{
+    if (std::is_trivially_copyable<T>::value)
+    {
+        alignas(T) unsigned char temp[sizeof(T)];
+        memcpy(temp, (void *)a, sizeof(T));
+        memcpy((void *)a, (void *)b, sizeof(T));
+        memcpy((void *)b, temp, sizeof(T));
+    }
+    else
+    {
+        T temp(std::move(*a));
+        *a = std::move(*b);
+        *b = std::move(temp);
+    }
+}
+
+// Value type of sets generated by HASHSET_INIT. Maps over it allocate no value array and
+// every value operation below compiles away.
+struct h_no_value
+{
+};
+#define H_STORES_VALUES(val_type) (!std::is_same<val_type, h_no_value>::value)
+
+template <typename T>
+static inline T *h_val_slot(T *vals, h_u64 index)
+{
+    return &vals[index];
+}
+
+static inline h_no_value *h_val_slot(h_no_value *vals, h_u64 index)
+{
+    return NULL;
+}
+
+static inline void h_copy_construct(h_no_value *dst, h_no_value *src) {}
+static inline void h_move_construct(h_no_value *dst, h_no_value *src) {}
+static inline void h_destroy(h_no_value *obj) {}
+static inline void h_relocate(h_no_value *dst, h_no_value *src) {}
+static inline void h_swap(h_no_value *a, h_no_value *b) {}
+
+// Raw storage for the entries of a small map, held inline in the map struct
+template <typename T, h_u32 N>
+struct h_inline_array
+{
+    alignas(T) unsigned char bytes[sizeof(T) * N];
+    T *get()
+    {
+        return (T *)bytes;
+    }
+};
+
+template <typename T>
+struct h_inline_array<T, 0>
+{
+    T *get()
+    {
+        return NULL;
+    }
+};
+
+#define H_INDEX_EMPTY 0xFFFFFFFF
+#define H_INT_SCAN_WIDTH 8
+#define H_ENTRY_DEAD (1ull << 63)
+#define H_PSL_MASK 0xFF
+
+// Bucket of the ordered map: an index into the dense entry array plus a 24 bit hash
+// fingerprint packed above the PSL, so misses rarely touch the entries themselves.
+struct h_index_bucket
+{
+    h_u32 index;
+    h_u32 meta;
+};
+
+static inline h_u32 h_fingerprint(h_u64 hash)
+{
+    return (h_u32)((hash ^ (hash >> 32)) & 0xFFFFFF);
+}
+
+// Robin Hood buckets store a rank rather than a bare PSL: the PSL in the top bits and a 24
+// bit tag of the hash below it. Ranks order a run by PSL and then by tag, so entries that
+// share a home are kept sorted, and a lookup can stop at the first bucket ranked below
+// the key it wants. The tag comes from the top of a multiplicative mix so that it still
+// varies between keys with the same home when the hash's low bits are all it has.
+#define H_RANK_PSL_SHIFT 24
+#define H_RANK_TAG_MASK 0xFFFFFF
+#define H_RANK_PSL_ONE (1u << H_RANK_PSL_SHIFT)
+
+static inline h_u32 h_rank_tag(h_u64 hash)
+{
+    return (h_u32)((hash * 0x9E3779B97F4A7C15ull) >> 40);
+}
+
+static inline h_u32 h_rank_psl(h_u32 rank)
+{
+    return rank >> H_RANK_PSL_SHIFT;
+}
+
+// MurmurHash3's 64-bit finaliser: every input bit affects every output bit
+static inline h_u64 h_fmix64(h_u64 hash)
+{
+    hash ^= hash >> 33;
+    hash *= 0xFF51AFD7ED558CCDull;
+    hash ^= hash >> 33;
+    hash *= 0xC4CEB9FE1A85EC53ull;
+    return hash ^ (hash >> 33);
+}
+
+// Maps index by the low bits of the user's hash until a run overflows max_psl while the
+// table is mostly empty. That means keys are colliding in those bits, from hostile input or
+// a hash with weak low bits, and doubling the table would only burn memory, so the map
+// picks a random seed instead and rehashes at the same size. A seeded map indexes by a
+// seeded mix of the whole hash, which a caller can't aim at one bucket without knowing the
+// seed. Seed 0 leaves the hash as it is.
+static inline h_u64 h_seed_hash(h_u64 hash, h_u64 seed)
+{
+    if (!seed)
+    {
+        return hash;
+    }
+    return h_fmix64(hash ^ seed);
+}
+
+// Never 0. Each thread draws its state from std::random_device once and steps it with
+// splitmix64, so reseeding doesn't cost a system call.
+static h_u64 h_random_seed()
+{
+    static thread_local h_u64 state =
+        ((h_u64)std::random_device{}() << 32) ^ (h_u64)std::random_device{}();
+    state += 0x9E3779B97F4A7C15ull;
+    h_u64 x = state;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+    x ^= x >> 31;
+    return x ? x : 1;
+}
+
+// Where one multimap key's values live in the map's shared value arena
+struct h_value_list
+{
+    h_u32 offset;
+    h_u32 count;
+    h_u32 capacity;
+};
+
+// Bit i set where keys[i] == key, for the H_INT_SCAN_WIDTH keys at keys
+template <typename T>
+static inline h_u32 h_int_lane_mask(const T *keys, T key)
+{
+    h_u32 mask = 0;
+    for (h_u32 i = 0; i < H_INT_SCAN_WIDTH; i++)
+    {
+        mask |= (h_u32)(keys[i] == key) << i;
+    }
+    return mask;
+}
+
+#if H_HAS_SSE2
+template <>
+inline h_u32 h_int_lane_mask<h_u32>(const h_u32 *keys, h_u32 key)
+{
+    __m128i needle = _mm_set1_epi32((int)key);
+    __m128i lo = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)keys), needle);
+    __m128i hi = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)(keys + 4)), needle);
+    return (h_u32)_mm_movemask_ps(_mm_castsi128_ps(lo)) |
+           ((h_u32)_mm_movemask_ps(_mm_castsi128_ps(hi)) << 4);
+}
+#endif
+
+static inline h_u32 h_lowest_lane(h_u32 mask)
+{
+    h_u32 lane = 0;
+    while (!(mask & (1u << lane)))
+    {
+        lane++;
+    }
+    return lane;
+}
+
+// Key of HASHMAP_INIT_STRING maps: 16 bytes and no pointer. A string of up to
+// H_STR_INLINE_MAX bytes is held in the key itself, zero padded, with its length in the
+// last byte, so two such keys are equal exactly when all 16 bytes are. Longer strings live
+// in the map's arena; their key holds the arena offset, the length and the low 56 bits of
+// the hash, so most mismatches are rejected without reading the arena.
+#define H_STR_INLINE_MAX 15
+#define H_STR_TAG_ARENA 0xFF
+#define H_STR_TAG_EMPTY 0xFE
+#define H_STR_HASH_MASK ((1ull << 56) - 1)
+// An arena string shares its prefix with the last restart string when they have at least
+// this many bytes in common; otherwise it is stored whole and becomes the restart string
+#define H_STR_MIN_SHARED 8
+// Arena record header: restart record offset, then the number of bytes shared with it
+#define H_STR_RECORD_HEADER 8
+
+struct h_compact_key
+{
+    unsigned char bytes[16];
+};
+
+static inline h_u8 h_compact_tag(const h_compact_key *key)
+{
+    return key->bytes[15];
+}
+
+static inline h_u32 h_compact_u32(const h_compact_key *key, h_u32 at)
+{
+    h_u32 ret;
+    memcpy(&ret, key->bytes + at, sizeof(ret));
+    return ret;
+}
+
+// The hash bits an arena key keeps, H_STR_HASH_MASK of the hash it was made from
+static inline h_u64 h_compact_hash(const h_compact_key *key)
+{
+    return h_compact_u32(key, 8) | ((h_u64)key->bytes[12] << 32) |
+           ((h_u64)key->bytes[13] << 40) | ((h_u64)key->bytes[14] << 48);
+}
+
+// A key for str as it would be stored, with the arena offset left at 0
+static inline h_compact_key h_compact_key_make(const char *str, h_u32 len, h_u64 hash)
+{
+    h_compact_key key = {};
+    if (len <= H_STR_INLINE_MAX)
+    {
+        memcpy(key.bytes, str, len);
+        key.bytes[15] = (h_u8)len;
+        return key;
+    }
+    h_u32 hash_lo = (h_u32)hash;
+    memcpy(key.bytes + 4, &len, sizeof(len));
+    memcpy(key.bytes + 8, &hash_lo, sizeof(hash_lo));
+    key.bytes[12] = (h_u8)(hash >> 32);
+    key.bytes[13] = (h_u8)(hash >> 40);
+    key.bytes[14] = (h_u8)(hash >> 48);
+    key.bytes[15] = H_STR_TAG_ARENA;
+    return key;
+}
+
 #define HASH_FUNCTION(name, type) h_u64 name(type *to_hash)
 #define HASH_EQUALS(name, type) h_bool name(type *a, type *b)
+// Equality between a stored key and a lookup view (e.g. pointer + length into a buffer).
+// The view's hash function must agree with the key's for equal contents.
+#define HASH_VIEW_EQUALS(name, key_type, view_type) h_bool name(key_type *key, view_type *view)
+// Resolves a key present in both maps of an h_merge_*: folds from into into.
+#define HASH_COMBINE(name, type) void name(type *into, type *from)
+
+#define HASHMAP_INIT(name, key_type, val_type, __hash_func, __equals_func) \
+    HASHMAP_INIT_SMALL(name, key_type, val_type, __hash_func, __equals_func, 0)
 
-// TODO handle tie-breakers. Currently we just move on, but this isn't optimal (i think)
-#define HASHMAP_INIT(name, key_type, val_type, __hash_func, __equals_func)                      \
+// PSL ties are broken by a hash tag, so runs stay sorted by rank (see h_rank_tag).
+// Maps with a non-zero __inline_capacity keep up to that many entries inline in the map
+// struct, searched linearly, and only allocate the Robin Hood table once it is exceeded.
+#define HASHMAP_INIT_SMALL(name, key_type, val_type, __hash_func, __equals_func,                \
+                           __inline_capacity)                                                   \
     typedef HASH_FUNCTION(h_hashfunc_##name, key_type);                                         \
     typedef HASH_EQUALS(h_equalfunc_##name, key_type);                                          \
+    typedef HASH_COMBINE(h_combinefunc_##name, val_type);                                       \
+    typedef key_type h_key_type_##name;                                                         \
+    typedef val_type h_val_type_##name;                                                         \
+    /* Compared against through a constant, as a literal 0 trips -Wtype-limits */               \
+    static const h_u32 h_inline_capacity_##name = __inline_capacity;                            \
+    static_assert(__inline_capacity == 0 || (std::is_trivially_copyable<key_type>::value &&     \
+                                             std::is_trivially_copyable<val_type>::value),      \
+                  "inline storage is copied with the map struct");                              \
                                                                                                 \
     struct h_map_##name                                                                         \
     {                                                                                           \
         h_u32 n_buckets;                                                                        \
         h_u32 max_psl;                                                                          \
         h_u32 buckets_used;                                                                     \
+        h_u32 low_water_pct;                                                                    \
+        /* Table size the map last reseeded at, so it reseeds at most once per size */          \
+        h_u32 reseeded_size;                                                                    \
+        h_u64 seed;                                                                             \
+        h_bool fixed_capacity;                                                                  \
+        h_bool borrowed_memory;                                                                 \
         h_bool *fulls;                                                                          \
         h_u32 *psls;                                                                            \
         key_type *keys;                                                                         \
         val_type *vals;                                                                         \
         h_hashfunc_##name *hash_func;                                                           \
         h_equalfunc_##name *equal_func;                                                         \
+        h_inline_array<key_type, __inline_capacity> inline_keys;                                \
+        h_inline_array<val_type, __inline_capacity> inline_vals;                                \
     };                                                                                          \
                                                                                                 \
-    static inline void allocate_and_set_buffers(h_map_##name *map)                              \
+    /* Nothing is allocated until the first insert that doesn't fit in the inline storage */    \
+    /* (none without __inline_capacity); until then fulls is NULL. */                           \
+    static inline h_bool is_inline_##name(h_map_##name *map)                                    \
     {                                                                                           \
-        map->fulls = (h_bool *)counter_malloc(sizeof(h_bool) * map->n_buckets);                 \
-        map->psls = (h_u32 *)counter_malloc(sizeof(h_u32) * map->n_buckets);                    \
-        map->keys = (key_type *)counter_malloc(sizeof(key_type) * map->n_buckets);              \
-        map->vals = (val_type *)counter_malloc(sizeof(val_type) * map->n_buckets);              \
+        return !map->fulls;                                                                     \
+    }                                                                                           \
                                                                                                 \
-        memset(map->fulls, 0, map->n_buckets * sizeof(h_bool));                                 \
-        memset(map->psls, 0, map->n_buckets * sizeof(h_u32));                                   \
-        memset(map->keys, 0, map->n_buckets * sizeof(key_type));                                \
-        memset(map->vals, 0, map->n_buckets * sizeof(val_type));                                \
+    static inline val_type *val_at_##name(h_map_##name *map, h_u64 index)                       \
+    {                                                                                           \
+        if (is_inline_##name(map))                                                              \
+        {                                                                                       \
+            return h_val_slot(map->inline_vals.get(), index);                                   \
+        }                                                                                       \
+        return h_val_slot(map->vals, index);                                                    \
+    }                                                                                           \
+                                                                                                \
+    /* Returns H_FALSE, with nothing allocated, if any array can't be allocated */              \
+    static inline h_bool allocate_and_set_buffers(h_map_##name *map)                            \
+    {                                                                                           \
+        h_u32 array_size = bucket_array_size(map->n_buckets);                                   \
+        map->fulls = (h_bool *)counter_malloc(sizeof(h_bool) * array_size);                     \
+        map->psls = (h_u32 *)counter_malloc(sizeof(h_u32) * array_size);                        \
+        map->keys = (key_type *)counter_malloc(sizeof(key_type) * array_size);                  \
+                                                                                                \
+        if (H_STORES_VALUES(val_type))                                                          \
+        {                                                                                       \
+            map->vals = (val_type *)counter_malloc(sizeof(val_type) * array_size);              \
+        }                                                                                       \
+        if (!map->fulls || !map->psls || !map->keys ||                                          \
+            (H_STORES_VALUES(val_type) && !map->vals))                                          \
+        {                                                                                       \
+            free(map->fulls);                                                                   \
+            free(map->psls);                                                                    \
+            free(map->keys);                                                                    \
+            if (H_STORES_VALUES(val_type))                                                      \
+            {                                                                                   \
+                free(map->vals);                                                                \
+            }                                                                                   \
+            return H_FALSE;                                                                     \
+        }                                                                                       \
+        /* Only occupancy needs clearing: nothing else is read from an empty bucket */          \
+        memset(map->fulls, 0, array_size * sizeof(h_bool));                                     \
+        return H_TRUE;                                                                          \
+    }                                                                                           \
+                                                                                                \
+    /* Offsets of the bucket arrays within one block, in the order fulls, psls, keys, */        \
+    /* vals; returns the block's size. */                                                       \
+    static inline h_u64 buffer_layout_##name(h_u32 n_buckets, h_u64 *o_offsets)                 \
+    {                                                                                           \
+        h_u64 array_size = bucket_array_size(n_buckets);                                        \
+        h_u64 offset = 0;                                                                       \
+        o_offsets[0] = offset;                                                                  \
+        offset = h_align_up(offset + sizeof(h_bool) * array_size, alignof(h_u32));              \
+        o_offsets[1] = offset;                                                                  \
+        offset = h_align_up(offset + sizeof(h_u32) * array_size, alignof(key_type));            \
+        o_offsets[2] = offset;                                                                  \
+        offset = h_align_up(offset + sizeof(key_type) * array_size, alignof(val_type));         \
+        o_offsets[3] = offset;                                                                  \
+        if (H_STORES_VALUES(val_type))                                                          \
+        {                                                                                       \
+            offset += sizeof(val_type) * array_size;                                            \
+        }                                                                                       \
+        return offset;                                                                          \
     }                                                                                           \
                                                                                                 \
     static inline h_map_##name h_init_##name(h_u32 capacity = HASHMAP_INITIAL_CAPACITY)         \
@@ -136,11 +537,49 @@ static inline h_u64 power_2_mod(h_u64 a, h_u64 b)
             capacity = compute_next_highest_power_of_two(capacity);                             \
         }                                                                                       \
         ret.n_buckets = capacity;                                                               \
-        allocate_and_set_buffers(&ret);                                                         \
+        ret.max_psl = max_psl(ret.n_buckets);                                                   \
+        ret.seed = HASHMAP_SEED_HASHES ? h_random_seed() : 0;                                   \
                                                                                                 \
         ret.hash_func = __hash_func;                                                            \
         ret.equal_func = __equals_func;                                                         \
-        ret.max_psl = max_psl(ret.n_buckets);                                                   \
+        return ret;                                                                             \
+    }                                                                                           \
+                                                                                                \
+    /* Bytes of caller memory h_init_in_place_* needs for a table of capacity buckets */        \
+    static inline h_u64 h_memory_size_##name(h_u32 capacity)                                    \
+    {                                                                                           \
+        h_u64 offsets[4];                                                                       \
+        return buffer_layout_##name(h_init_##name(capacity).n_buckets, offsets);                \
+    }                                                                                           \
+                                                                                                \
+    /* Builds a map over caller memory for real-time paths that can't allocate. The map */      \
+    /* has a fixed capacity: h_put_* returns MAP_FULL rather than growing, removals never */    \
+    /* shrink it, h_reserve_* and h_shrink_to_fit_* leave it as it is, and h_free_* only */     \
+    /* destroys the entries. Puts, retrieves and removes never allocate, and no probe */        \
+    /* visits more than max_psl (log2 of capacity) buckets. memory must be aligned for */       \
+    /* key_type and val_type and at least h_memory_size_*(capacity) bytes; if it isn't, */      \
+    /* the map is left without a table and every h_put_* returns MAP_FULL. */                   \
+    static h_map_##name h_init_in_place_##name(h_u32 capacity, void *memory, h_u64 memory_size) \
+    {                                                                                           \
+        h_map_##name ret = h_init_##name(capacity);                                             \
+        ret.fixed_capacity = H_TRUE;                                                            \
+        ret.borrowed_memory = H_TRUE;                                                           \
+        h_u64 offsets[4];                                                                       \
+        h_u64 size = buffer_layout_##name(ret.n_buckets, offsets);                              \
+        /* The offsets are aligned relative to memory, so memory needs the strictest */         \
+        h_u64 alignment = alignof(h_u32);                                                       \
+        alignment = alignment < alignof(key_type) ? alignof(key_type) : alignment;              \
+        alignment = alignment < alignof(val_type) ? alignof(val_type) : alignment;              \
+        if (!memory || memory_size < size || (uintptr_t)memory % alignment != 0)                \
+        {                                                                                       \
+            return ret;                                                                         \
+        }                                                                                       \
+        char *base = (char *)memory;                                                            \
+        ret.fulls = (h_bool *)(base + offsets[0]);                                              \
+        ret.psls = (h_u32 *)(base + offsets[1]);                                                \
+        ret.keys = (key_type *)(base + offsets[2]);                                             \
+        ret.vals = H_STORES_VALUES(val_type) ? (val_type *)(base + offsets[3]) : NULL;          \
+        memset(ret.fulls, 0, bucket_array_size(ret.n_buckets) * sizeof(h_bool));                \
         return ret;                                                                             \
     }                                                                                           \
                                                                                                 \
@@ -154,195 +593,2832 @@ static inline h_u64 power_2_mod(h_u64 a, h_u64 b)
         map->psls[a_id] = map->psls[b_id];                                                      \
         map->psls[b_id] = temp_psl;                                                             \
                                                                                                 \
-        key_type temp_key = map->keys[a_id];                                                    \
-        map->keys[a_id] = map->keys[b_id];                                                      \
-        map->keys[b_id] = temp_key;                                                             \
-                                                                                                \
-        val_type temp_val = map->vals[a_id];                                                    \
-        map->vals[a_id] = map->vals[b_id];                                                      \
-        map->vals[b_id] = temp_val;                                                             \
+        h_swap(&map->keys[a_id], &map->keys[b_id]);                                             \
+        h_swap(h_val_slot(map->vals, a_id), h_val_slot(map->vals, b_id));                       \
                                                                                                 \
         return NO_ERROR;                                                                        \
     }                                                                                           \
                                                                                                 \
-    static h_result probe_##name(h_map_##name *map,                                             \
-                                 h_u64 hash_index,                                              \
-                                 key_type key,                                                  \
-                                 val_type val,                                                  \
-                                 h_u64 *index_inserted = 0,                                     \
-                                 h_bool *shuffled = 0,                                          \
-                                 h_bool *grew = 0);                                             \
-                                                                                                \
-    static inline h_u64 compute_index_##name(h_map_##name *map, key_type *key)                  \
+    static inline h_u64 index_from_hash_##name(h_map_##name *map, h_u64 hash)                   \
     {                                                                                           \
-        return (map->hash_func(key) & (map->n_buckets - 1));                                    \
+        return (h_seed_hash(hash, map->seed) & (map->n_buckets - 1));                           \
     }                                                                                           \
                                                                                                 \
-    static h_result grow_map_##name(h_map_##name *map)                                          \
+    /* Robin Hood layout, worked out on ranks alone, of the count entries of keys (those */     \
+    /* flagged in fulls, or all of them if fulls is NULL) in map's freshly cleared arrays. */   \
+    /* origins[i] gets the index in keys of the entry bucket i is to hold. Returns H_FALSE */   \
+    /* as soon as an entry would pass max_psl; no entry has been moved either way. */           \
+    static h_bool plan_layout_##name(h_map_##name *map, key_type *keys, h_bool *fulls,          \
+                                     h_u32 count, h_u32 *origins)                               \
     {                                                                                           \
-        h_u32 prev_size = map->n_buckets;                                                       \
-        if (!is_power_of_two(map->n_buckets))                                                   \
-        {                                                                                       \
-            map->n_buckets = compute_next_highest_power_of_two(map->n_buckets);                 \
-        }                                                                                       \
-        else                                                                                    \
+        for (h_u32 j = 0; j < count; j++)                                                       \
         {                                                                                       \
-            map->n_buckets *= 2;                                                                \
+            if (fulls && !fulls[j])                                                             \
+            {                                                                                   \
+                continue;                                                                       \
+            }                                                                                   \
+            h_u64 hash = map->hash_func(&keys[j]);                                              \
+            h_u64 i = index_from_hash_##name(map, hash);                                        \
+            h_u32 rank = h_rank_tag(hash);                                                      \
+            h_u32 origin = j;                                                                   \
+            while (map->fulls[i])                                                               \
+            {                                                                                   \
+                if (map->psls[i] < rank)                                                        \
+                {                                                                               \
+                    h_u32 resident_rank = map->psls[i];                                         \
+                    h_u32 resident_origin = origins[i];                                         \
+                    map->psls[i] = rank;                                                        \
+                    origins[i] = origin;                                                        \
+                    rank = resident_rank;                                                       \
+                    origin = resident_origin;                                                   \
+                }                                                                               \
+                i++;                                                                            \
+                rank += H_RANK_PSL_ONE;                                                         \
+                if (h_rank_psl(rank) >= map->max_psl)                                           \
+                {                                                                               \
+                    return H_FALSE;                                                             \
+                }                                                                               \
+            }                                                                                   \
+            map->fulls[i] = 1;                                                                  \
+            map->psls[i] = rank;                                                                \
+            origins[i] = origin;                                                                \
         }                                                                                       \
+        return H_TRUE;                                                                          \
+    }                                                                                           \
+                                                                                                \
+    /* Rebuilds the table, or the inline entries, in new_n_buckets buckets under the */         \
+    /* current seed. The layout is planned before any entry moves, so if the new arrays */      \
+    /* can't be allocated or an entry wouldn't fit, this returns MAP_FULL with the map as */    \
+    /* it was. */                                                                               \
+    static h_result rehash_map_##name(h_map_##name *map, h_u32 new_n_buckets)                   \
+    {                                                                                           \
+        h_bool was_inline = is_inline_##name(map);                                              \
+        h_u32 prev_n_buckets = map->n_buckets;                                                  \
+        h_u32 prev_size = was_inline ? map->buckets_used : bucket_array_size(prev_n_buckets);   \
         h_bool *old_fulls = map->fulls;                                                         \
+        h_u32 *old_psls = map->psls;                                                            \
         key_type *old_keys = map->keys;                                                         \
         val_type *old_vals = map->vals;                                                         \
+        key_type *src_keys = was_inline ? map->inline_keys.get() : old_keys;                    \
+        val_type *src_vals = was_inline ? map->inline_vals.get() : old_vals;                    \
+        if (map->buckets_used > new_n_buckets)                                                  \
+        {                                                                                       \
+            return MAP_FULL;                                                                    \
+        }                                                                                       \
                                                                                                 \
-        allocate_and_set_buffers(map);                                                          \
-        map->buckets_used = 0;                                                                  \
-        for (h_u32 i = 0; i < prev_size; i++)                                                   \
+        map->n_buckets = new_n_buckets;                                                         \
+        map->max_psl = max_psl(map->n_buckets);                                                 \
+        h_u32 array_size = bucket_array_size(map->n_buckets);                                   \
+        /* An empty map, such as an inline one promoted before its first insert, has */         \
+        /* nothing to plan */                                                                   \
+        h_u32 *origins = 0;                                                                     \
+        if (map->buckets_used > 0)                                                              \
         {                                                                                       \
-            if (old_fulls[i])                                                                   \
+            origins = (h_u32 *)counter_malloc(sizeof(h_u32) * array_size);                      \
+        }                                                                                       \
+        h_bool allocated = origins || map->buckets_used == 0;                                   \
+        allocated = allocated && allocate_and_set_buffers(map);                                 \
+        if (!allocated ||                                                                       \
+            (origins && !plan_layout_##name(map, src_keys, old_fulls, prev_size, origins)))     \
+        {                                                                                       \
+            if (allocated)                                                                      \
+            {                                                                                   \
+                free(map->fulls);                                                               \
+                free(map->psls);                                                                \
+                free(map->keys);                                                                \
+                free(map->vals);                                                                \
+            }                                                                                   \
+            free(origins);                                                                      \
+            map->n_buckets = prev_n_buckets;                                                    \
+            map->max_psl = max_psl(map->n_buckets);                                             \
+            map->fulls = old_fulls;                                                             \
+            map->psls = old_psls;                                                               \
+            map->keys = old_keys;                                                               \
+            map->vals = old_vals;                                                               \
+            return MAP_FULL;                                                                    \
+        }                                                                                       \
+        for (h_u32 i = 0; origins && i < array_size; i++)                                       \
+        {                                                                                       \
+            if (map->fulls[i])                                                                  \
             {                                                                                   \
-                h_u64 new_hash = compute_index_##name(map, &old_keys[i]);                       \
-                h_bool grew = false;                                                            \
-                probe_##name(map, new_hash, old_keys[i], old_vals[i], 0, 0, 0);                 \
+                h_relocate(&map->keys[i], &src_keys[origins[i]]);                               \
+                h_relocate(h_val_slot(map->vals, i), h_val_slot(src_vals, origins[i]));         \
             }                                                                                   \
         }                                                                                       \
+        free(origins);                                                                          \
         free(old_fulls);                                                                        \
+        free(old_psls);                                                                         \
         free(old_keys);                                                                         \
         free(old_vals);                                                                         \
         return NO_ERROR;                                                                        \
     }                                                                                           \
                                                                                                 \
-    static h_result probe_##name(h_map_##name *map,                                             \
-                                 h_u64 hash_index,                                              \
-                                 key_type key,                                                  \
-                                 val_type val,                                                  \
-                                 h_u64 *index_inserted,                                         \
-                                 h_bool *shuffled,                                              \
-                                 h_bool *grew)                                                  \
+    static h_result grow_map_##name(h_map_##name *map)                                          \
     {                                                                                           \
-        h_u64 probe_position = hash_index;                                                      \
-        h_result ret = UNKNOWN_ERROR;                                                           \
-        h_u32 psl_curr = 0;                                                                     \
-        while (psl_curr < map->max_psl && probe_position < map->n_buckets)                      \
+        h_u32 new_n_buckets = map->n_buckets;                                                   \
+        if (!is_power_of_two(new_n_buckets))                                                    \
         {                                                                                       \
-            if (map->fulls[probe_position])                                                     \
+            new_n_buckets = compute_next_highest_power_of_two(new_n_buckets);                   \
+        }                                                                                       \
+        else                                                                                    \
+        {                                                                                       \
+            new_n_buckets *= 2;                                                                 \
+        }                                                                                       \
+        return rehash_map_##name(map, new_n_buckets);                                           \
+    }                                                                                           \
+                                                                                                \
+    static inline h_bool is_sparse_##name(h_map_##name *map)                                    \
+    {                                                                                           \
+        return map->n_buckets >= HASHMAP_RESEED_MIN_BUCKETS &&                                  \
+               (h_u64)map->buckets_used * 100 <                                                 \
+                   (h_u64)map->n_buckets * HASHMAP_RESEED_LOAD_PCT;                             \
+    }                                                                                           \
+                                                                                                \
+    static h_result reseed_map_##name(h_map_##name *map)                                        \
+    {                                                                                           \
+        h_u64 prev_seed = map->seed;                                                            \
+        map->seed = h_random_seed();                                                            \
+        map->reseeded_size = map->n_buckets;                                                    \
+        h_result res = rehash_map_##name(map, map->n_buckets);                                  \
+        if (res != NO_ERROR)                                                                    \
+        {                                                                                       \
+            map->seed = prev_seed;                                                              \
+        }                                                                                       \
+        return res;                                                                             \
+    }                                                                                           \
+                                                                                                \
+    /* Moves the inline entries into a table with room for twice as many. Returns */            \
+    /* MAP_FULL, with the entries still inline, if that table can't be built or the map */      \
+    /* was meant to live in caller memory (see h_init_in_place_*). */                           \
+    static h_result promote_inline_##name(h_map_##name *map)                                    \
+    {                                                                                           \
+        if (map->borrowed_memory)                                                               \
+        {                                                                                       \
+            return MAP_FULL;                                                                    \
+        }                                                                                       \
+        h_u32 wanted = compute_next_highest_power_of_two(map->buckets_used * 2);                \
+        return rehash_map_##name(map, map->n_buckets < wanted ? wanted : map->n_buckets);       \
+    }                                                                                           \
+                                                                                                \
+    static void demote_to_inline_##name(h_map_##name *map, h_u32 new_n_buckets)                 \
+    {                                                                                           \
+        key_type *keys = map->inline_keys.get();                                                \
+        val_type *vals = map->inline_vals.get();                                                \
+        h_u32 count = 0;                                                                        \
+        h_u32 array_size = bucket_array_size(map->n_buckets);                                   \
+        for (h_u32 i = 0; i < array_size; i++)                                                  \
+        {                                                                                       \
+            if (map->fulls[i])                                                                  \
             {                                                                                   \
-                h_bool same_key = map->equal_func(&map->keys[probe_position], &key);            \
-                if (same_key == H_TRUE)                                                         \
-                {                                                                               \
-                    return SAME_KEY;                                                            \
-                }                                                                               \
-                if (map->psls[probe_position] < psl_curr)                                       \
-                {                                                                               \
-                    h_u32 temp_psl = psl_curr;                                                  \
-                    psl_curr = map->psls[probe_position];                                       \
-                    map->psls[probe_position] = temp_psl;                                       \
+                h_relocate(&keys[count], &map->keys[i]);                                        \
+                h_relocate(h_val_slot(vals, count), h_val_slot(map->vals, i));                  \
+                count++;                                                                        \
+            }                                                                                   \
+        }                                                                                       \
+        free(map->fulls);                                                                       \
+        free(map->psls);                                                                        \
+        free(map->keys);                                                                        \
+        free(map->vals);                                                                        \
+        map->fulls = NULL;                                                                      \
+        map->psls = NULL;                                                                       \
+        map->keys = NULL;                                                                       \
+        map->vals = NULL;                                                                       \
+        map->n_buckets = new_n_buckets;                                                         \
+        map->max_psl = max_psl(map->n_buckets);                                                 \
+    }                                                                                           \
+                                                                                                \
+    static inline h_u32 shrunk_size_##name(h_map_##name *map)                                   \
+    {                                                                                           \
+        h_u64 wanted = ((h_u64)map->buckets_used * 100) / HASHMAP_SHRINK_TARGET_LOAD_PCT;       \
+        h_u32 new_n_buckets = compute_next_highest_power_of_two((h_u32)wanted);                 \
+        if (new_n_buckets < HASHMAP_MIN_CAPACITY)                                               \
+        {                                                                                       \
+            new_n_buckets = HASHMAP_MIN_CAPACITY;                                               \
+        }                                                                                       \
+        return new_n_buckets;                                                                   \
+    }                                                                                           \
                                                                                                 \
-                    key_type temp_key = key;                                                    \
-                    key = map->keys[probe_position];                                            \
-                    map->keys[probe_position] = key;                                            \
+    /* Never leaves the table bigger than it was: if the entries don't fit the smaller */       \
+    /* table, this returns MAP_FULL and the map keeps its size. */                              \
+    static h_result h_shrink_to_fit_##name(h_map_##name *map)                                   \
+    {                                                                                           \
+        if (is_inline_##name(map) || map->borrowed_memory)                                      \
+        {                                                                                       \
+            return NO_ERROR;                                                                    \
+        }                                                                                       \
+        h_u32 new_n_buckets = shrunk_size_##name(map);                                          \
+        if (map->buckets_used <= __inline_capacity)                                             \
+        {                                                                                       \
+            demote_to_inline_##name(map, new_n_buckets);                                        \
+            return NO_ERROR;                                                                    \
+        }                                                                                       \
+        if (new_n_buckets >= map->n_buckets)                                                    \
+        {                                                                                       \
+            return NO_ERROR;                                                                    \
+        }                                                                                       \
+        return rehash_map_##name(map, new_n_buckets);                                           \
+    }                                                                                           \
                                                                                                 \
-                    val_type temp_val = val;                                                    \
-                    val = map->vals[probe_position];                                            \
-                    map->vals[probe_position] = temp_val;                                       \
-                }                                                                               \
-                else                                                                            \
+    /* Sizes the table so count entries fit without h_put having to grow it. */                 \
+    static h_result h_reserve_##name(h_map_##name *map, h_u32 count)                            \
+    {                                                                                           \
+        h_u32 wanted = compute_next_highest_power_of_two(count);                                \
+        if (is_inline_##name(map))                                                              \
+        {                                                                                       \
+            if (count <= __inline_capacity)                                                     \
+            {                                                                                   \
+                return NO_ERROR;                                                                \
+            }                                                                                   \
+            if (map->n_buckets < wanted)                                                        \
+            {                                                                                   \
+                map->n_buckets = wanted;                                                        \
+            }                                                                                   \
+            return promote_inline_##name(map);                                                  \
+        }                                                                                       \
+        if (map->n_buckets < wanted && !map->borrowed_memory)                                   \
+        {                                                                                       \
+            return rehash_map_##name(map, wanted);                                              \
+        }                                                                                       \
+        return NO_ERROR;                                                                        \
+    }                                                                                           \
+                                                                                                \
+    /* Below low_water_pct percent occupancy, h_remove rehashes down. 0 disables. */            \
+    static inline void h_set_low_water_##name(h_map_##name *map, h_u32 low_water_pct)           \
+    {                                                                                           \
+        H_ASSERT(low_water_pct < HASHMAP_SHRINK_TARGET_LOAD_PCT, "low water too high");         \
+        map->low_water_pct = low_water_pct;                                                     \
+    }                                                                                           \
+                                                                                                \
+    /* A fixed capacity table never grows: an insert that would grow it returns MAP_FULL */     \
+    /* instead and leaves the map as it was. */                                                 \
+    static inline void h_set_fixed_capacity_##name(h_map_##name *map, h_bool fixed)             \
+    {                                                                                           \
+        H_ASSERT(fixed || !map->borrowed_memory, "a map over caller memory can't grow");        \
+        map->fixed_capacity = fixed;                                                            \
+    }                                                                                           \
+                                                                                                \
+    /* Whether inserting at home fits without any entry passing max_psl. A Robin Hood */        \
+    /* insert shifts the entries between its bucket and the next empty one along by one, */     \
+    /* so it fits if none of those is already at max_psl - 1. A bucket holding the key */       \
+    /* itself also counts as fitting, since the insert then stops there; without has_room */    \
+    /* nothing else does. */                                                                    \
+    static h_bool insert_fits_##name(h_map_##name *map, h_u64 home, h_u32 tag, key_type *key,   \
+                                     h_bool has_room)                                           \
+    {                                                                                           \
+        h_u64 array_size = bucket_array_size(map->n_buckets);                                   \
+        h_u64 i = home;                                                                         \
+        h_u32 rank = tag;                                                                       \
+        while (map->fulls[i] && map->psls[i] >= rank)                                           \
+        {                                                                                       \
+            if (map->psls[i] == rank && map->equal_func(&map->keys[i], key))                    \
+            {                                                                                   \
+                return H_TRUE;                                                                  \
+            }                                                                                   \
+            i++;                                                                                \
+            rank += H_RANK_PSL_ONE;                                                             \
+            if (h_rank_psl(rank) >= map->max_psl)                                               \
+            {                                                                                   \
+                return H_FALSE;                                                                 \
+            }                                                                                   \
+        }                                                                                       \
+        if (!has_room)                                                                          \
+        {                                                                                       \
+            return H_FALSE;                                                                     \
+        }                                                                                       \
+        for (; i < array_size && map->fulls[i]; i++)                                            \
+        {                                                                                       \
+            if (h_rank_psl(map->psls[i]) + 1 >= map->max_psl)                                   \
+            {                                                                                   \
+                return H_FALSE;                                                                 \
+            }                                                                                   \
+        }                                                                                       \
+        return i < array_size;                                                                  \
+    }                                                                                           \
+                                                                                                \
+    /* Called once an insert has got MAP_FULL from probe_*. Under HASHMAP_RESEED_LOAD_PCT */    \
+    /* a run only overflows max_psl when hashes cluster, and doubling barely spreads a */       \
+    /* cluster (and never one of equal hashes), so a sparse table is reseeded instead, at */    \
+    /* most once per size. Any other table doubles. */                                          \
+    static h_result make_room_##name(h_map_##name *map)                                         \
+    {                                                                                           \
+        if (map->fixed_capacity)                                                                \
+        {                                                                                       \
+            return MAP_FULL;                                                                    \
+        }                                                                                       \
+        if (!is_sparse_##name(map))                                                             \
+        {                                                                                       \
+            return grow_map_##name(map);                                                        \
+        }                                                                                       \
+        if (map->reseeded_size == map->n_buckets)                                               \
+        {                                                                                       \
+            return MAP_FULL;                                                                    \
+        }                                                                                       \
+        return reseed_map_##name(map);                                                          \
+    }                                                                                           \
+                                                                                                \
+    /* Robin Hood insert from a known home. The key goes after every entry of its run */        \
+    /* ranked at or above it (the key can only be one of those of equal rank, so only */        \
+    /* they are compared) and shifts the rest of the run along by one. It fits if there */      \
+    /* is a free bucket and nothing it passes or shifts would reach max_psl; a shift */         \
+    /* that would is undone, so MAP_FULL leaves the map as it was. */                           \
+    static h_result probe_##name(h_map_##name *map, h_u64 home, h_u32 tag, key_type *key,       \
+                                 val_type *val, h_u64 *index_inserted = 0)                      \
+    {                                                                                           \
+        h_u64 i = home;                                                                         \
+        h_u32 rank = tag;                                                                       \
+        while (map->fulls[i] && map->psls[i] >= rank)                                           \
+        {                                                                                       \
+            if (map->psls[i] == rank && map->equal_func(&map->keys[i], key))                    \
+            {                                                                                   \
+                if (index_inserted)                                                             \
                 {                                                                               \
-                    psl_curr++;                                                                 \
+                    *index_inserted = i;                                                        \
                 }                                                                               \
+                return SAME_KEY;                                                                \
             }                                                                                   \
-            else                                                                                \
+            i++;                                                                                \
+            rank += H_RANK_PSL_ONE;                                                             \
+            if (h_rank_psl(rank) >= map->max_psl)                                               \
             {                                                                                   \
-                map->fulls[probe_position] = 1;                                                 \
-                map->psls[probe_position] = psl_curr;                                           \
-                map->keys[probe_position] = key;                                                \
-                map->vals[probe_position] = val;                                                \
-                map->buckets_used++;                                                            \
-                if (shuffled)                                                                   \
+                return MAP_FULL;                                                                \
+            }                                                                                   \
+        }                                                                                       \
+        h_u64 array_size = bucket_array_size(map->n_buckets);                                   \
+        h_u64 end = i;                                                                          \
+        while (end < array_size && map->fulls[end])                                             \
+        {                                                                                       \
+            end++;                                                                              \
+        }                                                                                       \
+        if (end == array_size || map->buckets_used >= map->n_buckets)                           \
+        {                                                                                       \
+            return MAP_FULL;                                                                    \
+        }                                                                                       \
+        for (h_u64 j = end; j > i; j--)                                                         \
+        {                                                                                       \
+            h_u32 shifted = map->psls[j - 1] + H_RANK_PSL_ONE;                                  \
+            if (h_rank_psl(shifted) >= map->max_psl)                                            \
+            {                                                                                   \
+                for (h_u64 k = j + 1; k <= end; k++)                                            \
                 {                                                                               \
-                    *shuffled = false;                                                          \
+                    map->psls[k - 1] = map->psls[k] - H_RANK_PSL_ONE;                           \
+                    h_relocate(&map->keys[k - 1], &map->keys[k]);                               \
+                    h_relocate(h_val_slot(map->vals, k - 1), h_val_slot(map->vals, k));         \
                 }                                                                               \
-                return NO_ERROR;                                                                \
+                return MAP_FULL;                                                                \
             }                                                                                   \
-            probe_position++;                                                                   \
+            map->psls[j] = shifted;                                                             \
+            h_relocate(&map->keys[j], &map->keys[j - 1]);                                       \
+            h_relocate(h_val_slot(map->vals, j), h_val_slot(map->vals, j - 1));                 \
         }                                                                                       \
+        map->fulls[end] = 1;                                                                    \
+        map->psls[i] = rank;                                                                    \
+        h_move_construct(&map->keys[i], key);                                                   \
+        h_move_construct(h_val_slot(map->vals, i), val);                                        \
+        map->buckets_used++;                                                                    \
+        if (index_inserted)                                                                     \
+        {                                                                                       \
+            *index_inserted = i;                                                                \
+        }                                                                                       \
+        return NO_ERROR;                                                                        \
+    }                                                                                           \
                                                                                                 \
-        if (probe_position >= map->n_buckets || psl_curr >= map->max_psl)                       \
+    /* probe_* with one retry: if the key doesn't fit, make_room_* grows or reseeds the */      \
+    /* table and the key is hashed again for its new home. MAP_FULL after that leaves key */    \
+    /* and val with the caller and the table no bigger than one doubling. */                    \
+    static h_result place_##name(h_map_##name *map, h_u64 home, h_u32 tag, key_type *key,       \
+                                 val_type *val, h_u64 *index_inserted = 0)                      \
+    {                                                                                           \
+        h_result res = probe_##name(map, home, tag, key, val, index_inserted);                  \
+        if (res != MAP_FULL)                                                                    \
         {                                                                                       \
-            if (grew)                                                                           \
-            {                                                                                   \
-                *grew = true;                                                                   \
-            }                                                                                   \
-            grow_map_##name(map);                                                               \
-            h_u64 target_idx = compute_index_##name(map, &key);                                 \
-            h_bool grew_twice = false;                                                          \
-            h_result res = probe_##name(map, target_idx, key, val, 0, 0, &grew_twice);          \
-            H_ASSERT(grew_twice == false, "h_map shouldn't be growing twice");                  \
             return res;                                                                         \
         }                                                                                       \
-        return ret;                                                                             \
+        res = make_room_##name(map);                                                            \
+        if (res != NO_ERROR)                                                                    \
+        {                                                                                       \
+            return res;                                                                         \
+        }                                                                                       \
+        home = index_from_hash_##name(map, map->hash_func(key));                                \
+        return probe_##name(map, home, tag, key, val, index_inserted);                          \
     }                                                                                           \
+                                                                                                \
+    /* Table insert for a key whose hash is already known, moving from key and val. */          \
+    static h_result put_hashed_##name(h_map_##name *map, h_u64 hash, key_type *key,             \
+                                      val_type *val)                                            \
+    {                                                                                           \
+        h_u64 home = index_from_hash_##name(map, hash);                                         \
+        return place_##name(map, home, h_rank_tag(hash), key, val);                             \
+    }                                                                                           \
+                                                                                                \
     static h_result h_put_##name(h_map_##name *map, key_type key, val_type val)                 \
     {                                                                                           \
-        if (map->buckets_used >= map->n_buckets)                                                \
+        if (is_inline_##name(map))                                                              \
         {                                                                                       \
-            grow_map_##name(map);                                                               \
-            map->max_psl = max_psl(map->n_buckets);                                             \
+            key_type *keys = map->inline_keys.get();                                            \
+            for (h_u32 i = 0; i < map->buckets_used; i++)                                       \
+            {                                                                                   \
+                if (map->equal_func(&keys[i], &key))                                            \
+                {                                                                               \
+                    return SAME_KEY;                                                            \
+                }                                                                               \
+            }                                                                                   \
+            if (map->buckets_used < h_inline_capacity_##name)                                   \
+            {                                                                                   \
+                h_move_construct(&keys[map->buckets_used], &key);                               \
+                h_move_construct(val_at_##name(map, map->buckets_used), &val);                  \
+                map->buckets_used++;                                                            \
+                return NO_ERROR;                                                                \
+            }                                                                                   \
+            h_result res = promote_inline_##name(map);                                          \
+            if (res != NO_ERROR)                                                                \
+            {                                                                                   \
+                return res;                                                                     \
+            }                                                                                   \
         }                                                                                       \
-        h_u64 index = compute_index_##name(map, &key);                                          \
-        h_result probe_result = UNKNOWN_ERROR;                                                  \
-        probe_result = probe_##name(map, index, key, val);                                      \
-        return probe_result;                                                                    \
+        return put_hashed_##name(map, map->hash_func(&key), &key, &val);                        \
     }                                                                                           \
                                                                                                 \
     static inline h_result hashmap_insert_##name(h_map_##name *map, key_type key, val_type val) \
     {                                                                                           \
-        return h_put_##name(map, key, val);                                                     \
+        return h_put_##name(map, std::move(key), std::move(val));                               \
     }                                                                                           \
                                                                                                 \
-    static h_result h_retrieve_##name(h_map_##name *map, key_type key, val_type *o_val)         \
+    /* Searches the table from a known home bucket. A bucket ranked below the key at that */    \
+    /* distance would come after it in the run, so the key isn't in the map; only buckets */    \
+    /* of equal rank can hold it. */                                                            \
+    template <typename view_type>                                                               \
+    static h_result find_index_from_##name(h_map_##name *map, h_u64 index, h_u32 tag,           \
+                                           view_type *view,                                     \
+                                           h_bool (*view_equals)(key_type *, view_type *),      \
+                                           h_u64 *o_index)                                      \
     {                                                                                           \
-        h_u64 index = compute_index_##name(map, &key);                                          \
-        h_u32 max_psl_dist = max_psl(map->n_buckets);                                           \
-        for (h_u32 i = index; i < map->n_buckets && i < max_psl_dist + index; i++)              \
+        h_u32 rank = tag;                                                                       \
+        for (h_u64 i = index; i < map->max_psl + index; i++, rank += H_RANK_PSL_ONE)            \
         {                                                                                       \
             if (map->fulls[i])                                                                  \
             {                                                                                   \
-                if (map->psls[i] > i)                                                           \
+                if (map->psls[i] < rank)                                                        \
                 {                                                                               \
-                    o_val = NULL;                                                               \
                     return FOUND_HIGHER_PSL;                                                    \
                 }                                                                               \
-                else                                                                            \
+                else if (map->psls[i] == rank)                                                  \
                 {                                                                               \
-                    if (map->equal_func(&map->keys[i], &key))                                   \
+                    if (view_equals(&map->keys[i], view))                                       \
                     {                                                                           \
-                        o_val = &map->vals[i];                                                  \
+                        *o_index = i;                                                           \
                         return NO_ERROR;                                                        \
                     }                                                                           \
                 }                                                                               \
             }                                                                                   \
             else                                                                                \
             {                                                                                   \
-                o_val = NULL;                                                                   \
                 return EMPTY_BUCKET;                                                            \
             }                                                                                   \
         }                                                                                       \
         return EXCEEDED_MAP_BOUNDS;                                                             \
     }                                                                                           \
                                                                                                 \
+    template <typename view_type>                                                               \
+    static h_result find_index_by_##name(h_map_##name *map, view_type *view,                    \
+                                         h_u64 (*view_hash)(view_type *),                       \
+                                         h_bool (*view_equals)(key_type *, view_type *),        \
+                                         h_u64 *o_index)                                        \
+    {                                                                                           \
+        if (is_inline_##name(map))                                                              \
+        {                                                                                       \
+            key_type *keys = map->inline_keys.get();                                            \
+            for (h_u32 i = 0; i < map->buckets_used; i++)                                       \
+            {                                                                                   \
+                if (view_equals(&keys[i], view))                                                \
+                {                                                                               \
+                    *o_index = i;                                                               \
+                    return NO_ERROR;                                                            \
+                }                                                                               \
+            }                                                                                   \
+            return EMPTY_BUCKET;                                                                \
+        }                                                                                       \
+        h_u64 hash = view_hash(view);                                                           \
+        h_u64 index = index_from_hash_##name(map, hash);                                        \
+        return find_index_from_##name(map, index, h_rank_tag(hash), view, view_equals,          \
+                                      o_index);                                                 \
+    }                                                                                           \
+                                                                                                \
+    static inline h_result find_index_##name(h_map_##name *map, key_type *key, h_u64 *o_index)  \
+    {                                                                                           \
+        return find_index_by_##name(map, key, map->hash_func, map->equal_func, o_index);        \
+    }                                                                                           \
+                                                                                                \
+    static h_result h_retrieve_##name(h_map_##name *map, key_type key, val_type *o_val)         \
+    {                                                                                           \
+        h_u64 index = 0;                                                                        \
+        h_result res = find_index_##name(map, &key, &index);                                    \
+        if (res == NO_ERROR && o_val)                                                           \
+        {                                                                                       \
+            *o_val = *val_at_##name(map, index);                                                \
+        }                                                                                       \
+        return res;                                                                             \
+    }                                                                                           \
+                                                                                                \
+    /* Backward-shift deletion: pull the rest of the run one bucket towards its home. */        \
+    static h_result remove_at_index_##name(h_map_##name *map, h_u64 index, val_type *o_val)     \
+    {                                                                                           \
+        if (is_inline_##name(map))                                                              \
+        {                                                                                       \
+            key_type *keys = map->inline_keys.get();                                            \
+            if (o_val)                                                                          \
+            {                                                                                   \
+                *o_val = std::move(*val_at_##name(map, index));                                 \
+            }                                                                                   \
+            h_u32 last = --map->buckets_used;                                                   \
+            if (index != last)                                                                  \
+            {                                                                                   \
+                keys[index] = keys[last];                                                       \
+                *val_at_##name(map, index) = *val_at_##name(map, last);                         \
+            }                                                                                   \
+            return NO_ERROR;                                                                    \
+        }                                                                                       \
+        if (o_val)                                                                              \
+        {                                                                                       \
+            *o_val = std::move(*h_val_slot(map->vals, index));                                  \
+        }                                                                                       \
+        h_destroy(&map->keys[index]);                                                           \
+        h_destroy(h_val_slot(map->vals, index));                                                \
+        h_u64 next = index + 1;                                                                 \
+        h_u64 array_size = bucket_array_size(map->n_buckets);                                   \
+        while (next < array_size && map->fulls[next] && h_rank_psl(map->psls[next]) > 0)        \
+        {                                                                                       \
+            map->psls[next - 1] = map->psls[next] - H_RANK_PSL_ONE;                             \
+            h_relocate(&map->keys[next - 1], &map->keys[next]);                                 \
+            h_relocate(h_val_slot(map->vals, next - 1), h_val_slot(map->vals, next));           \
+            next++;                                                                             \
+        }                                                                                       \
+        map->fulls[next - 1] = 0;                                                               \
+        map->psls[next - 1] = 0;                                                                \
+        map->buckets_used--;                                                                    \
+                                                                                                \
+        if (map->low_water_pct && !map->fixed_capacity &&                                       \
+            map->n_buckets > HASHMAP_MIN_CAPACITY &&                                            \
+            (h_u64)map->buckets_used * 100 < (h_u64)map->n_buckets * map->low_water_pct)        \
+        {                                                                                       \
+            h_shrink_to_fit_##name(map);                                                        \
+        }                                                                                       \
+        return NO_ERROR;                                                                        \
+    }                                                                                           \
+                                                                                                \
+    static h_result h_remove_##name(h_map_##name *map, key_type key, val_type *o_val = 0)       \
+    {                                                                                           \
+        h_u64 index = 0;                                                                        \
+        h_result res = find_index_##name(map, &key, &index);                                    \
+        if (res != NO_ERROR)                                                                    \
+        {                                                                                       \
+            return res;                                                                         \
+        }                                                                                       \
+        return remove_at_index_##name(map, index, o_val);                                       \
+    }                                                                                           \
+                                                                                                \
     static inline h_bool h_free_##name(h_map_##name *map)                                       \
     {                                                                                           \
         if (map->fulls)                                                                         \
         {                                                                                       \
-            free(map->fulls);                                                                   \
-            free(map->psls);                                                                    \
-            free(map->keys);                                                                    \
-            free(map->vals);                                                                    \
+            if (!std::is_trivially_destructible<key_type>::value ||                             \
+                !std::is_trivially_destructible<val_type>::value)                               \
+            {                                                                                   \
+                h_u32 array_size = bucket_array_size(map->n_buckets);                           \
+                for (h_u32 i = 0; i < array_size; i++)                                          \
+                {                                                                               \
+                    if (map->fulls[i])                                                          \
+                    {                                                                           \
+                        h_destroy(&map->keys[i]);                                               \
+                        h_destroy(h_val_slot(map->vals, i));                                    \
+                    }                                                                           \
+                }                                                                               \
+            }                                                                                   \
+            if (!map->borrowed_memory)                                                          \
+            {                                                                                   \
+                free(map->fulls);                                                               \
+                free(map->psls);                                                                \
+                free(map->keys);                                                                \
+                free(map->vals);                                                                \
+            }                                                                                   \
         }                                                                                       \
         else                                                                                    \
         {                                                                                       \
             return H_FAILURE;                                                                   \
         }                                                                                       \
         return H_SUCCESS;                                                                       \
+    }                                                                                           \
+                                                                                                \
+    /* Empties the map but keeps its capacity: only the occupancy flags are reset, so a */      \
+    /* map reused per request costs a single memset instead of an allocation. */                \
+    static void h_clear_##name(h_map_##name *map)                                               \
+    {                                                                                           \
+        if (!is_inline_##name(map))                                                             \
+        {                                                                                       \
+            h_u32 array_size = bucket_array_size(map->n_buckets);                               \
+            if (!std::is_trivially_destructible<key_type>::value ||                             \
+                !std::is_trivially_destructible<val_type>::value)                               \
+            {                                                                                   \
+                for (h_u32 i = 0; i < array_size; i++)                                          \
+                {                                                                               \
+                    if (map->fulls[i])                                                          \
+                    {                                                                           \
+                        h_destroy(&map->keys[i]);                                               \
+                        h_destroy(h_val_slot(map->vals, i));                                    \
+                    }                                                                           \
+                }                                                                               \
+            }                                                                                   \
+            memset(map->fulls, 0, array_size * sizeof(h_bool));                                 \
+        }                                                                                       \
+        map->buckets_used = 0;                                                                  \
+    }                                                                                           \
+                                                                                                \
+    static h_map_##name h_copy_##name(h_map_##name *map)                                        \
+    {                                                                                           \
+        h_map_##name ret = *map;                                                                \
+        if (is_inline_##name(map))                                                              \
+        {                                                                                       \
+            return ret;                                                                         \
+        }                                                                                       \
+        ret.borrowed_memory = H_FALSE;                                                          \
+        allocate_and_set_buffers(&ret);                                                         \
+        h_u32 array_size = bucket_array_size(map->n_buckets);                                   \
+        memcpy(ret.fulls, map->fulls, array_size * sizeof(h_bool));                             \
+        memcpy(ret.psls, map->psls, array_size * sizeof(h_u32));                                \
+        for (h_u32 i = 0; i < array_size; i++)                                                  \
+        {                                                                                       \
+            if (map->fulls[i])                                                                  \
+            {                                                                                   \
+                h_copy_construct(&ret.keys[i], &map->keys[i]);                                  \
+                h_copy_construct(h_val_slot(ret.vals, i), h_val_slot(map->vals, i));            \
+            }                                                                                   \
+        }                                                                                       \
+        return ret;                                                                             \
+    }                                                                                           \
+                                                                                                \
+    /* Returns NO_ERROR whether key was copied over or combined, or the error that kept */      \
+    /* it out of dst (MAP_FULL if it doesn't fit even after make_room_*). */                    \
+    static h_result merge_entry_##name(h_map_##name *dst, h_u64 home, h_u32 tag, key_type *key, \
+                                       val_type *val, h_combinefunc_##name *combine)            \
+    {                                                                                           \
+        h_u64 index = 0;                                                                        \
+        /* Probing stops at an existing key before moving anything, so when copies are free */  \
+        /* a single probe both inserts and finds the entry to combine with. */                  \
+        if (!is_inline_##name(dst) && std::is_trivially_copyable<key_type>::value &&            \
+            std::is_trivially_copyable<val_type>::value)                                        \
+        {                                                                                       \
+            key_type key_copy = *key;                                                           \
+            val_type val_copy = *val;                                                           \
+            h_result res = place_##name(dst, home, tag, &key_copy, &val_copy, &index);          \
+            if (res == SAME_KEY && combine)                                                     \
+            {                                                                                   \
+                combine(h_val_slot(dst->vals, index), val);                                     \
+            }                                                                                   \
+            return res == SAME_KEY ? NO_ERROR : res;                                            \
+        }                                                                                       \
+        h_result found = is_inline_##name(dst)                                                  \
+                             ? find_index_##name(dst, key, &index)                              \
+                             : find_index_from_##name(dst, home, tag, key, dst->equal_func,     \
+                                                      &index);                                  \
+        if (found == NO_ERROR)                                                                  \
+        {                                                                                       \
+            if (combine)                                                                        \
+            {                                                                                   \
+                combine(val_at_##name(dst, index), val);                                        \
+            }                                                                                   \
+            return NO_ERROR;                                                                    \
+        }                                                                                       \
+        key_type key_copy(*key);                                                                \
+        val_type val_copy(*val);                                                                \
+        if (is_inline_##name(dst))                                                              \
+        {                                                                                       \
+            return h_put_##name(dst, std::move(key_copy), std::move(val_copy));                 \
+        }                                                                                       \
+        return place_##name(dst, home, tag, &key_copy, &val_copy);                              \
+    }                                                                                           \
+                                                                                                \
+    /* Folds src into dst: missing keys are copied over and keys in both maps are passed */     \
+    /* to combine(dst_val, src_val); a NULL combine keeps dst's value. src is unchanged. */     \
+    /* While both tables have the same size and seed an entry's home in dst is its bucket */    \
+    /* in src minus its PSL and its tag is in its rank, so src is walked in bucket order, */    \
+    /* dst is probed front to back and no key is hashed. Same-size tables skip the */           \
+    /* up-front reserve, since shared keys often keep the union within the current size. */     \
+    /* A fixed capacity dst is never reserved, so it fills up to its size. Stops at the */      \
+    /* first key that can't be merged and returns why; the keys merged before it stay. */       \
+    static h_result h_merge_##name(h_map_##name *dst, h_map_##name *src,                        \
+                                   h_combinefunc_##name *combine)                               \
+    {                                                                                           \
+        h_result res = NO_ERROR;                                                                \
+        if (is_inline_##name(src))                                                              \
+        {                                                                                       \
+            if (!dst->fixed_capacity)                                                           \
+            {                                                                                   \
+                res = h_reserve_##name(dst, dst->buckets_used + src->buckets_used);             \
+            }                                                                                   \
+            key_type *keys = src->inline_keys.get();                                            \
+            for (h_u32 i = 0; res == NO_ERROR && i < src->buckets_used; i++)                    \
+            {                                                                                   \
+                h_u64 hash = dst->hash_func(&keys[i]);                                          \
+                res = merge_entry_##name(dst, index_from_hash_##name(dst, hash),                \
+                                         h_rank_tag(hash), &keys[i], val_at_##name(src, i),     \
+                                         combine);                                              \
+            }                                                                                   \
+            return res;                                                                         \
+        }                                                                                       \
+        if (!dst->fixed_capacity &&                                                             \
+            (is_inline_##name(dst) || dst->n_buckets != src->n_buckets))                        \
+        {                                                                                       \
+            res = h_reserve_##name(dst, dst->buckets_used + src->buckets_used);                 \
+        }                                                                                       \
+        h_u32 array_size = bucket_array_size(src->n_buckets);                                   \
+        for (h_u32 i = 0; res == NO_ERROR && i < array_size; i++)                               \
+        {                                                                                       \
+            if (!src->fulls[i])                                                                 \
+            {                                                                                   \
+                continue;                                                                       \
+            }                                                                                   \
+            h_u64 home = 0;                                                                     \
+            h_u32 tag = 0;                                                                      \
+            if (!is_inline_##name(dst) && dst->n_buckets == src->n_buckets &&                   \
+                dst->seed == src->seed)                                                         \
+            {                                                                                   \
+                home = i - h_rank_psl(src->psls[i]);                                            \
+                tag = src->psls[i] & H_RANK_TAG_MASK;                                           \
+            }                                                                                   \
+            else                                                                                \
+            {                                                                                   \
+                h_u64 hash = dst->hash_func(&src->keys[i]);                                     \
+                home = index_from_hash_##name(dst, hash);                                       \
+                tag = h_rank_tag(hash);                                                         \
+            }                                                                                   \
+            res = merge_entry_##name(dst, home, tag, &src->keys[i], h_val_slot(src->vals, i),   \
+                                     combine);                                                  \
+        }                                                                                       \
+        return res;                                                                             \
+    }
+
+// Adds h_retrieve_* / h_remove_* overloads to a HASHMAP_INIT map that probe with a
+// view type instead of key_type, so callers never have to build (or allocate) a key.
+#define HASHMAP_VIEW_LOOKUP(name, view_type, __view_hash, __view_equals)                    \
+    static inline h_result h_retrieve_##name(h_map_##name *map, view_type *view,            \
+                                             h_val_type_##name *o_val)                      \
+    {                                                                                       \
+        h_u64 index = 0;                                                                    \
+        h_result res = find_index_by_##name(map, view, __view_hash, __view_equals, &index); \
+        if (res == NO_ERROR && o_val)                                                       \
+        {                                                                                   \
+            *o_val = *val_at_##name(map, index);                                            \
+        }                                                                                   \
+        return res;                                                                         \
+    }                                                                                       \
+                                                                                            \
+    static inline h_result h_remove_##name(h_map_##name *map, view_type *view,              \
+                                           h_val_type_##name *o_val = 0)                    \
+    {                                                                                       \
+        h_u64 index = 0;                                                                    \
+        h_result res = find_index_by_##name(map, view, __view_hash, __view_equals, &index); \
+        if (res != NO_ERROR)                                                                \
+        {                                                                                   \
+            return res;                                                                     \
+        }                                                                                   \
+        return remove_at_index_##name(map, index, o_val);                                   \
+    }
+
+// Set over the same Robin Hood core: no value array is allocated and probing only moves keys.
+#define HASHSET_INIT(name, key_type, __hash_func, __equals_func)                             \
+    HASHMAP_INIT(name, key_type, h_no_value, __hash_func, __equals_func)                     \
+                                                                                             \
+    static inline h_result h_insert_##name(h_map_##name *set, key_type key)                  \
+    {                                                                                        \
+        return h_put_##name(set, std::move(key), h_no_value());                              \
+    }                                                                                        \
+                                                                                             \
+    static inline h_bool h_contains_##name(h_map_##name *set, key_type *key)                 \
+    {                                                                                        \
+        h_u64 index = 0;                                                                     \
+        return find_index_##name(set, key, &index) == NO_ERROR;                              \
+    }                                                                                        \
+                                                                                             \
+    /* While both tables are the same size and seed the key in src bucket i has home */      \
+    /* i - psl and the tag in its rank, so walking src in bucket order fills dst front */    \
+    /* to back without rehashing anything. */                                                \
+    static inline h_result insert_from_bucket_##name(h_map_##name *dst, h_map_##name *src,   \
+                                                     h_u32 i)                                \
+    {                                                                                        \
+        if (is_inline_##name(dst))                                                           \
+        {                                                                                    \
+            h_result promoted = promote_inline_##name(dst);                                  \
+            if (promoted != NO_ERROR)                                                        \
+            {                                                                                \
+                return promoted;                                                             \
+            }                                                                                \
+        }                                                                                    \
+        key_type key(src->keys[i]);                                                          \
+        h_no_value val;                                                                      \
+        h_u64 home = i - h_rank_psl(src->psls[i]);                                           \
+        h_u32 tag = src->psls[i] & H_RANK_TAG_MASK;                                          \
+        if (dst->n_buckets != src->n_buckets || dst->seed != src->seed)                      \
+        {                                                                                    \
+            h_u64 hash = dst->hash_func(&key);                                               \
+            home = index_from_hash_##name(dst, hash);                                        \
+            tag = h_rank_tag(hash);                                                          \
+        }                                                                                    \
+        h_result res = place_##name(dst, home, tag, &key, &val);                             \
+        return res == SAME_KEY ? NO_ERROR : res;                                             \
+    }                                                                                        \
+                                                                                             \
+    /* The set operations build their result in a new set and hand it over through */        \
+    /* o_result only if every key made it in. Otherwise the partial set is freed, */         \
+    /* *o_result is left alone and the error that kept a key out is returned. */             \
+    static h_result finish_set_op_##name(h_map_##name *ret, h_result res,                    \
+                                         h_map_##name *o_result)                             \
+    {                                                                                        \
+        if (res != NO_ERROR)                                                                 \
+        {                                                                                    \
+            h_free_##name(ret);                                                              \
+            return res;                                                                      \
+        }                                                                                    \
+        *o_result = *ret;                                                                    \
+        return NO_ERROR;                                                                     \
+    }                                                                                        \
+                                                                                             \
+    static h_result h_union_##name(h_map_##name *a, h_map_##name *b, h_map_##name *o_result) \
+    {                                                                                        \
+        h_map_##name *larger = a->buckets_used >= b->buckets_used ? a : b;                   \
+        h_map_##name *smaller = larger == a ? b : a;                                         \
+        h_map_##name ret = h_copy_##name(larger);                                            \
+        h_result res = NO_ERROR;                                                             \
+        h_u32 array_size = smaller->fulls ? bucket_array_size(smaller->n_buckets) : 0;       \
+        for (h_u32 i = 0; res == NO_ERROR && i < array_size; i++)                            \
+        {                                                                                    \
+            if (smaller->fulls[i])                                                           \
+            {                                                                                \
+                res = insert_from_bucket_##name(&ret, smaller, i);                           \
+            }                                                                                \
+        }                                                                                    \
+        return finish_set_op_##name(&ret, res, o_result);                                    \
+    }                                                                                        \
+                                                                                             \
+    static h_result h_intersection_##name(h_map_##name *a, h_map_##name *b,                  \
+                                          h_map_##name *o_result)                            \
+    {                                                                                        \
+        h_map_##name *larger = a->buckets_used >= b->buckets_used ? a : b;                   \
+        h_map_##name *smaller = larger == a ? b : a;                                         \
+        h_map_##name ret = h_init_##name(smaller->n_buckets);                                \
+        h_result res = NO_ERROR;                                                             \
+        h_u32 array_size = smaller->fulls ? bucket_array_size(smaller->n_buckets) : 0;       \
+        for (h_u32 i = 0; res == NO_ERROR && i < array_size; i++)                            \
+        {                                                                                    \
+            if (smaller->fulls[i] && h_contains_##name(larger, &smaller->keys[i]))           \
+            {                                                                                \
+                res = insert_from_bucket_##name(&ret, smaller, i);                           \
+            }                                                                                \
+        }                                                                                    \
+        return finish_set_op_##name(&ret, res, o_result);                                    \
+    }                                                                                        \
+                                                                                             \
+    /* Keys of a that are not in b */                                                        \
+    static h_result h_difference_##name(h_map_##name *a, h_map_##name *b,                    \
+                                        h_map_##name *o_result)                              \
+    {                                                                                        \
+        h_map_##name ret = h_init_##name(a->n_buckets);                                      \
+        h_result res = NO_ERROR;                                                             \
+        h_u32 array_size = a->fulls ? bucket_array_size(a->n_buckets) : 0;                   \
+        for (h_u32 i = 0; res == NO_ERROR && i < array_size; i++)                            \
+        {                                                                                    \
+            if (a->fulls[i] && !h_contains_##name(b, &a->keys[i]))                           \
+            {                                                                                \
+                res = insert_from_bucket_##name(&ret, a, i);                                 \
+            }                                                                                \
+        }                                                                                    \
+        return finish_set_op_##name(&ret, res, o_result);                                    \
+    }
+
+// Stores values in a dense side array and keeps only a 32-bit slot index in the bucket, so
+// Robin Hood displacement and rehashing move small records regardless of sizeof(val_type).
+#define HASHMAP_INIT_OUT_OF_LINE(name, key_type, val_type, __hash_func, __equals_func)         \
+    HASHMAP_INIT(name##_slots, key_type, h_u32, __hash_func, __equals_func)                    \
+                                                                                               \
+    struct h_map_##name                                                                        \
+    {                                                                                          \
+        h_map_##name##_slots slots;                                                            \
+        val_type *vals;                                                                        \
+        h_u32 n_vals;                                                                          \
+        h_u32 vals_capacity;                                                                   \
+        h_u32 *free_slots;                                                                     \
+        h_u32 n_free_slots;                                                                    \
+    };                                                                                         \
+                                                                                               \
+    static inline h_map_##name h_init_##name(h_u32 capacity = HASHMAP_INITIAL_CAPACITY)        \
+    {                                                                                          \
+        h_map_##name ret = {};                                                                 \
+        ret.slots = h_init_##name##_slots(capacity);                                           \
+        return ret;                                                                            \
+    }                                                                                          \
+                                                                                               \
+    /* Slots below n_vals are all live when there are no free slots, so growth can relocate */ \
+    /* the whole prefix without consulting the table. */                                       \
+    static inline h_u32 acquire_slot_##name(h_map_##name *map)                                 \
+    {                                                                                          \
+        if (map->n_free_slots)                                                                 \
+        {                                                                                      \
+            return map->free_slots[--map->n_free_slots];                                       \
+        }                                                                                      \
+        if (map->n_vals == map->vals_capacity)                                                 \
+        {                                                                                      \
+            h_u32 new_capacity = map->slots.n_buckets;                                         \
+            if (map->vals_capacity)                                                            \
+            {                                                                                  \
+                new_capacity = map->vals_capacity * 2;                                         \
+            }                                                                                  \
+            val_type *new_vals = (val_type *)counter_malloc(sizeof(val_type) * new_capacity);  \
+            for (h_u32 i = 0; i < map->n_vals; i++)                                            \
+            {                                                                                  \
+                h_relocate(&new_vals[i], &map->vals[i]);                                       \
+            }                                                                                  \
+            free(map->vals);                                                                   \
+            free(map->free_slots);                                                             \
+            map->vals = new_vals;                                                              \
+            map->free_slots = (h_u32 *)counter_malloc(sizeof(h_u32) * new_capacity);           \
+            map->vals_capacity = new_capacity;                                                 \
+        }                                                                                      \
+        return map->n_vals++;                                                                  \
+    }                                                                                          \
+                                                                                               \
+    static h_result h_put_##name(h_map_##name *map, key_type key, val_type val)                \
+    {                                                                                          \
+        h_u32 slot = acquire_slot_##name(map);                                                 \
+        h_result res = h_put_##name##_slots(&map->slots, std::move(key), slot);                \
+        if (res != NO_ERROR)                                                                   \
+        {                                                                                      \
+            map->free_slots[map->n_free_slots++] = slot;                                       \
+            return res;                                                                        \
+        }                                                                                      \
+        new (&map->vals[slot]) val_type(std::move(val));                                       \
+        return NO_ERROR;                                                                       \
+    }                                                                                          \
+                                                                                               \
+    static inline val_type *h_retrieve_ptr_##name(h_map_##name *map, key_type key)             \
+    {                                                                                          \
+        h_u32 slot = 0;                                                                        \
+        if (h_retrieve_##name##_slots(&map->slots, key, &slot) != NO_ERROR)                    \
+        {                                                                                      \
+            return NULL;                                                                       \
+        }                                                                                      \
+        return &map->vals[slot];                                                               \
+    }                                                                                          \
+                                                                                               \
+    static h_result h_retrieve_##name(h_map_##name *map, key_type key, val_type *o_val)        \
+    {                                                                                          \
+        h_u32 slot = 0;                                                                        \
+        h_result res = h_retrieve_##name##_slots(&map->slots, key, &slot);                     \
+        if (res == NO_ERROR && o_val)                                                          \
+        {                                                                                      \
+            *o_val = map->vals[slot];                                                          \
+        }                                                                                      \
+        return res;                                                                            \
+    }                                                                                          \
+                                                                                               \
+    static h_result h_remove_##name(h_map_##name *map, key_type key, val_type *o_val = 0)      \
+    {                                                                                          \
+        h_u32 slot = 0;                                                                        \
+        h_result res = h_remove_##name##_slots(&map->slots, key, &slot);                       \
+        if (res != NO_ERROR)                                                                   \
+        {                                                                                      \
+            return res;                                                                        \
+        }                                                                                      \
+        if (o_val)                                                                             \
+        {                                                                                      \
+            *o_val = std::move(map->vals[slot]);                                               \
+        }                                                                                      \
+        h_destroy(&map->vals[slot]);                                                           \
+        map->free_slots[map->n_free_slots++] = slot;                                           \
+        return NO_ERROR;                                                                       \
+    }                                                                                          \
+                                                                                               \
+    static inline h_bool h_free_##name(h_map_##name *map)                                      \
+    {                                                                                          \
+        if (!std::is_trivially_destructible<val_type>::value && map->slots.fulls)              \
+        {                                                                                      \
+            h_u32 array_size = bucket_array_size(map->slots.n_buckets);                        \
+            for (h_u32 i = 0; i < array_size; i++)                                             \
+            {                                                                                  \
+                if (map->slots.fulls[i])                                                       \
+                {                                                                              \
+                    h_destroy(&map->vals[map->slots.vals[i]]);                                 \
+                }                                                                              \
+            }                                                                                  \
+        }                                                                                      \
+        free(map->vals);                                                                       \
+        free(map->free_slots);                                                                 \
+        return h_free_##name##_slots(&map->slots);                                             \
+    }                                                                                          \
+                                                                                               \
+    static void h_clear_##name(h_map_##name *map)                                              \
+    {                                                                                          \
+        if (!std::is_trivially_destructible<val_type>::value && map->slots.fulls)              \
+        {                                                                                      \
+            h_u32 array_size = bucket_array_size(map->slots.n_buckets);                        \
+            for (h_u32 i = 0; i < array_size; i++)                                             \
+            {                                                                                  \
+                if (map->slots.fulls[i])                                                       \
+                {                                                                              \
+                    h_destroy(&map->vals[map->slots.vals[i]]);                                 \
+                }                                                                              \
+            }                                                                                  \
+        }                                                                                      \
+        h_clear_##name##_slots(&map->slots);                                                   \
+        map->n_vals = 0;                                                                       \
+        map->n_free_slots = 0;                                                                 \
+    }
+
+
+// Insertion-ordered variant: keys and values live in a dense entry array and the Robin
+// Hood table only stores index records, so iteration is a linear scan of packed entries.
+#define HASHMAP_ORDERED_INIT(name, key_type, val_type, __hash_func, __equals_func)            \
+    typedef HASH_FUNCTION(h_hashfunc_##name, key_type);                                       \
+    typedef HASH_EQUALS(h_equalfunc_##name, key_type);                                        \
+    typedef HASH_COMBINE(h_combinefunc_##name, val_type);                                     \
+                                                                                              \
+    struct h_entry_##name                                                                     \
+    {                                                                                         \
+        h_u64 hash;                                                                           \
+        key_type key;                                                                         \
+        val_type val;                                                                         \
+    };                                                                                        \
+                                                                                              \
+    struct h_map_##name                                                                       \
+    {                                                                                         \
+        h_u32 n_buckets;                                                                      \
+        h_u32 max_psl;                                                                        \
+        h_u32 buckets_used;                                                                   \
+        h_u32 n_entries;                                                                      \
+        h_u32 n_dead;                                                                         \
+        h_u32 entries_capacity;                                                               \
+        h_index_bucket *buckets;                                                              \
+        h_entry_##name *entries;                                                              \
+        h_hashfunc_##name *hash_func;                                                         \
+        h_equalfunc_##name *equal_func;                                                       \
+        /* As in HASHMAP_INIT: the size last reseeded at, and the seed (see h_seed_hash) */   \
+        h_u32 reseeded_size;                                                                  \
+        h_u64 seed;                                                                           \
+    };                                                                                        \
+                                                                                              \
+    /* Returns H_FALSE, with nothing allocated, if the index can't be allocated */            \
+    static inline h_bool allocate_index_buckets(h_map_##name *map)                            \
+    {                                                                                         \
+        h_u32 array_size = bucket_array_size(map->n_buckets);                                 \
+        map->buckets = (h_index_bucket *)counter_malloc(sizeof(h_index_bucket) * array_size); \
+        if (!map->buckets)                                                                    \
+        {                                                                                     \
+            return H_FALSE;                                                                   \
+        }                                                                                     \
+        memset(map->buckets, 0xFF, sizeof(h_index_bucket) * array_size);                      \
+        return H_TRUE;                                                                        \
+    }                                                                                         \
+                                                                                              \
+    static inline h_map_##name h_init_##name(h_u32 capacity = HASHMAP_INITIAL_CAPACITY)       \
+    {                                                                                         \
+        h_map_##name ret = {};                                                                \
+        if (!is_power_of_two(capacity))                                                       \
+        {                                                                                     \
+            capacity = compute_next_highest_power_of_two(capacity);                           \
+        }                                                                                     \
+        ret.n_buckets = capacity;                                                             \
+        ret.max_psl = max_psl(ret.n_buckets);                                                 \
+        ret.entries_capacity = capacity;                                                      \
+        ret.seed = HASHMAP_SEED_HASHES ? h_random_seed() : 0;                                 \
+                                                                                              \
+        ret.hash_func = __hash_func;                                                          \
+        ret.equal_func = __equals_func;                                                       \
+        return ret;                                                                           \
+    }                                                                                         \
+                                                                                              \
+    /* The index is always mixed, seeded or not: the fingerprint already takes the */         \
+    /* hash's spare bits, and this keeps a hash with weak low bits from clustering. */        \
+    static inline h_u64 index_from_hash_##name(h_map_##name *map, h_u64 hash)                 \
+    {                                                                                         \
+        return (h_fmix64(hash ^ map->seed) & (map->n_buckets - 1));                           \
+    }                                                                                         \
+                                                                                              \
+    /* Robin Hood insert of the record for entry index. The record passes every bucket */     \
+    /* at least as far from its home as it would be and shifts the rest of the run */         \
+    /* along by one. Returns H_FALSE, with the index as it was, if the table is full or */    \
+    /* the record or a shifted one would reach max_psl. */                                    \
+    static h_bool insert_index_##name(h_map_##name *map, h_u64 hash, h_u32 index)             \
+    {                                                                                         \
+        if (map->buckets_used >= map->n_buckets)                                              \
+        {                                                                                     \
+            return H_FALSE;                                                                   \
+        }                                                                                     \
+        h_u64 position = index_from_hash_##name(map, hash);                                   \
+        h_u32 psl_curr = 0;                                                                   \
+        while (map->buckets[position].index != H_INDEX_EMPTY &&                               \
+               (map->buckets[position].meta & H_PSL_MASK) >= psl_curr)                        \
+        {                                                                                     \
+            position++;                                                                       \
+            if (++psl_curr >= map->max_psl)                                                   \
+            {                                                                                 \
+                return H_FALSE;                                                               \
+            }                                                                                 \
+        }                                                                                     \
+        h_u64 array_size = bucket_array_size(map->n_buckets);                                 \
+        h_u64 end = position;                                                                 \
+        for (; end < array_size && map->buckets[end].index != H_INDEX_EMPTY; end++)           \
+        {                                                                                     \
+            if ((map->buckets[end].meta & H_PSL_MASK) + 1 >= map->max_psl)                    \
+            {                                                                                 \
+                return H_FALSE;                                                               \
+            }                                                                                 \
+        }                                                                                     \
+        if (end == array_size)                                                                \
+        {                                                                                     \
+            return H_FALSE;                                                                   \
+        }                                                                                     \
+        for (h_u64 j = end; j > position; j--)                                                \
+        {                                                                                     \
+            map->buckets[j] = map->buckets[j - 1];                                            \
+            map->buckets[j].meta++;                                                           \
+        }                                                                                     \
+        map->buckets[position].index = index;                                                 \
+        map->buckets[position].meta = (h_fingerprint(hash) << 8) | psl_curr;                  \
+        map->buckets_used++;                                                                  \
+        return H_TRUE;                                                                        \
+    }                                                                                         \
+                                                                                              \
+    /* Rebuilds the index in new_n_buckets buckets under the current seed, reading the */     \
+    /* hashes from the entries in order; growth never touches the entries themselves */       \
+    /* beyond compacting removed ones out. The new index is filled before anything */         \
+    /* moves, so if it can't be allocated or a record doesn't fit, this returns MAP_FULL */   \
+    /* with the map as it was. */                                                             \
+    static h_result rebuild_index_##name(h_map_##name *map, h_u32 new_n_buckets)              \
+    {                                                                                         \
+        h_u32 prev_n_buckets = map->n_buckets;                                                \
+        h_u32 prev_buckets_used = map->buckets_used;                                          \
+        h_index_bucket *old_buckets = map->buckets;                                           \
+        map->n_buckets = new_n_buckets;                                                       \
+        map->max_psl = max_psl(map->n_buckets);                                               \
+        map->buckets_used = 0;                                                                \
+        h_bool placed_all = allocate_index_buckets(map);                                      \
+        /* Records get the indices the live entries will have once compacted */               \
+        h_u32 live = 0;                                                                       \
+        for (h_u32 i = 0; i < map->n_entries && placed_all; i++)                              \
+        {                                                                                     \
+            if (!(map->entries[i].hash & H_ENTRY_DEAD))                                       \
+            {                                                                                 \
+                placed_all = insert_index_##name(map, map->entries[i].hash, live++);          \
+            }                                                                                 \
+        }                                                                                     \
+        if (!placed_all)                                                                      \
+        {                                                                                     \
+            free(map->buckets);                                                               \
+            map->n_buckets = prev_n_buckets;                                                  \
+            map->max_psl = max_psl(map->n_buckets);                                           \
+            map->buckets_used = prev_buckets_used;                                            \
+            map->buckets = old_buckets;                                                       \
+            return MAP_FULL;                                                                  \
+        }                                                                                     \
+        free(old_buckets);                                                                    \
+                                                                                              \
+        if (map->n_dead)                                                                      \
+        {                                                                                     \
+            h_u32 write = 0;                                                                  \
+            for (h_u32 read = 0; read < map->n_entries; read++)                               \
+            {                                                                                 \
+                h_entry_##name *entry = &map->entries[read];                                  \
+                if (entry->hash & H_ENTRY_DEAD)                                               \
+                {                                                                             \
+                    continue;                                                                 \
+                }                                                                             \
+                if (write != read)                                                            \
+                {                                                                             \
+                    map->entries[write].hash = entry->hash;                                   \
+                    h_relocate(&map->entries[write].key, &entry->key);                        \
+                    h_relocate(&map->entries[write].val, &entry->val);                        \
+                }                                                                             \
+                write++;                                                                      \
+            }                                                                                 \
+            map->n_entries = write;                                                           \
+            map->n_dead = 0;                                                                  \
+        }                                                                                     \
+        return NO_ERROR;                                                                      \
+    }                                                                                         \
+                                                                                              \
+    static inline h_bool is_sparse_##name(h_map_##name *map)                                  \
+    {                                                                                         \
+        return map->n_buckets >= HASHMAP_RESEED_MIN_BUCKETS &&                                \
+               (h_u64)map->buckets_used * 100 <                                               \
+                   (h_u64)map->n_buckets * HASHMAP_RESEED_LOAD_PCT;                           \
+    }                                                                                         \
+                                                                                              \
+    /* As make_room_* in HASHMAP_INIT, for the index: a sparse index is reseeded once */      \
+    /* per size, any other doubles, and a sparse index already reseeded at this size */       \
+    /* gets MAP_FULL. */                                                                      \
+    static h_result make_room_##name(h_map_##name *map)                                       \
+    {                                                                                         \
+        if (!is_sparse_##name(map))                                                           \
+        {                                                                                     \
+            return rebuild_index_##name(map, map->n_buckets * 2);                             \
+        }                                                                                     \
+        if (map->reseeded_size == map->n_buckets)                                             \
+        {                                                                                     \
+            return MAP_FULL;                                                                  \
+        }                                                                                     \
+        h_u64 prev_seed = map->seed;                                                          \
+        map->seed = h_random_seed();                                                          \
+        map->reseeded_size = map->n_buckets;                                                  \
+        h_result res = rebuild_index_##name(map, map->n_buckets);                             \
+        if (res != NO_ERROR)                                                                  \
+        {                                                                                     \
+            map->seed = prev_seed;                                                            \
+        }                                                                                     \
+        return res;                                                                           \
+    }                                                                                         \
+    static h_result find_bucket_##name(h_map_##name *map, h_u64 hash, key_type *key,          \
+                                       h_u64 *o_position)                                     \
+    {                                                                                         \
+        if (!map->buckets)                                                                    \
+        {                                                                                     \
+            return EMPTY_BUCKET;                                                              \
+        }                                                                                     \
+        h_u64 index = index_from_hash_##name(map, hash);                                      \
+        h_u32 fingerprint = h_fingerprint(hash);                                              \
+        for (h_u64 i = index; i < index + map->max_psl; i++)                                  \
+        {                                                                                     \
+            h_index_bucket bucket = map->buckets[i];                                          \
+            if (bucket.index == H_INDEX_EMPTY)                                                \
+            {                                                                                 \
+                return EMPTY_BUCKET;                                                          \
+            }                                                                                 \
+            if ((bucket.meta & H_PSL_MASK) < i - index)                                       \
+            {                                                                                 \
+                return FOUND_HIGHER_PSL;                                                      \
+            }                                                                                 \
+            if ((bucket.meta >> 8) == fingerprint &&                                          \
+                map->equal_func(&map->entries[bucket.index].key, key))                        \
+            {                                                                                 \
+                *o_position = i;                                                              \
+                return NO_ERROR;                                                              \
+            }                                                                                 \
+        }                                                                                     \
+        return EXCEEDED_MAP_BOUNDS;                                                           \
+    }                                                                                         \
+                                                                                              \
+    static inline h_u64 hash_key_##name(h_map_##name *map, key_type *key)                     \
+    {                                                                                         \
+        return map->hash_func(key) & ~H_ENTRY_DEAD;                                           \
+    }                                                                                         \
+                                                                                              \
+    /* Returns H_FALSE, with the entries where they were, if the new array can't be */        \
+    /* allocated */                                                                           \
+    static h_bool resize_entries_##name(h_map_##name *map, h_u32 new_capacity)                \
+    {                                                                                         \
+        h_entry_##name *new_entries =                                                         \
+            (h_entry_##name *)counter_malloc(sizeof(h_entry_##name) * (h_u64)new_capacity);   \
+        if (!new_entries)                                                                     \
+        {                                                                                     \
+            return H_FALSE;                                                                   \
+        }                                                                                     \
+        for (h_u32 i = 0; i < map->n_entries; i++)                                            \
+        {                                                                                     \
+            new_entries[i].hash = map->entries[i].hash;                                       \
+            if (!(map->entries[i].hash & H_ENTRY_DEAD))                                       \
+            {                                                                                 \
+                h_relocate(&new_entries[i].key, &map->entries[i].key);                        \
+                h_relocate(&new_entries[i].val, &map->entries[i].val);                        \
+            }                                                                                 \
+        }                                                                                     \
+        free(map->entries);                                                                   \
+        map->entries = new_entries;                                                           \
+        map->entries_capacity = new_capacity;                                                 \
+        return H_TRUE;                                                                        \
+    }                                                                                         \
+                                                                                              \
+    /* Appends a key known to be absent, moving from key and val. The record is indexed */    \
+    /* before the entry is written, growing or reseeding the index once if it doesn't */      \
+    /* fit, so MAP_FULL leaves key and val with the caller and the map as it was. */          \
+    static h_result put_hashed_##name(h_map_##name *map, h_u64 hash, key_type *key,           \
+                                      val_type *val)                                          \
+    {                                                                                         \
+        if (!map->buckets)                                                                    \
+        {                                                                                     \
+            if (!allocate_index_buckets(map))                                                 \
+            {                                                                                 \
+                return MAP_FULL;                                                              \
+            }                                                                                 \
+            h_u64 entries_size = sizeof(h_entry_##name) * (h_u64)map->entries_capacity;       \
+            map->entries = (h_entry_##name *)counter_malloc(entries_size);                    \
+            if (!map->entries)                                                                \
+            {                                                                                 \
+                free(map->buckets);                                                           \
+                map->buckets = NULL;                                                          \
+                return MAP_FULL;                                                              \
+            }                                                                                 \
+        }                                                                                     \
+        if (map->n_entries == map->entries_capacity &&                                        \
+            !resize_entries_##name(map, map->entries_capacity * 2))                           \
+        {                                                                                     \
+            return MAP_FULL;                                                                  \
+        }                                                                                     \
+        if (!insert_index_##name(map, hash, map->n_entries))                                  \
+        {                                                                                     \
+            /* make_room_* may compact the entries, so the index is read again after it */    \
+            h_result res = make_room_##name(map);                                             \
+            if (res != NO_ERROR)                                                              \
+            {                                                                                 \
+                return res;                                                                   \
+            }                                                                                 \
+            if (!insert_index_##name(map, hash, map->n_entries))                              \
+            {                                                                                 \
+                return MAP_FULL;                                                              \
+            }                                                                                 \
+        }                                                                                     \
+        h_entry_##name *entry = &map->entries[map->n_entries++];                              \
+        entry->hash = hash;                                                                   \
+        new (&entry->key) key_type(std::move(*key));                                          \
+        new (&entry->val) val_type(std::move(*val));                                          \
+        return NO_ERROR;                                                                      \
+    }                                                                                         \
+                                                                                              \
+    static h_result h_put_##name(h_map_##name *map, key_type key, val_type val)               \
+    {                                                                                         \
+        h_u64 hash = hash_key_##name(map, &key);                                              \
+        h_u64 position = 0;                                                                   \
+        if (find_bucket_##name(map, hash, &key, &position) == NO_ERROR)                       \
+        {                                                                                     \
+            return SAME_KEY;                                                                  \
+        }                                                                                     \
+        return put_hashed_##name(map, hash, &key, &val);                                      \
+    }                                                                                         \
+                                                                                              \
+    static inline val_type *h_retrieve_ptr_##name(h_map_##name *map, key_type key)            \
+    {                                                                                         \
+        h_u64 position = 0;                                                                   \
+        if (find_bucket_##name(map, hash_key_##name(map, &key), &key, &position) != NO_ERROR) \
+        {                                                                                     \
+            return NULL;                                                                      \
+        }                                                                                     \
+        return &map->entries[map->buckets[position].index].val;                               \
+    }                                                                                         \
+                                                                                              \
+    static h_result h_retrieve_##name(h_map_##name *map, key_type key, val_type *o_val)       \
+    {                                                                                         \
+        h_u64 position = 0;                                                                   \
+        h_result res = find_bucket_##name(map, hash_key_##name(map, &key), &key, &position);  \
+        if (res == NO_ERROR && o_val)                                                         \
+        {                                                                                     \
+            *o_val = map->entries[map->buckets[position].index].val;                          \
+        }                                                                                     \
+        return res;                                                                           \
+    }                                                                                         \
+                                                                                              \
+    /* The entry becomes a tombstone so insertion order survives; tombstones are */           \
+    /* compacted away once they make up half of the entry array. */                           \
+    static h_result h_remove_##name(h_map_##name *map, key_type key, val_type *o_val = 0)     \
+    {                                                                                         \
+        h_u64 position = 0;                                                                   \
+        h_result res = find_bucket_##name(map, hash_key_##name(map, &key), &key, &position);  \
+        if (res != NO_ERROR)                                                                  \
+        {                                                                                     \
+            return res;                                                                       \
+        }                                                                                     \
+        h_u32 index = map->buckets[position].index;                                           \
+        h_entry_##name *entry = &map->entries[index];                                         \
+        if (o_val)                                                                            \
+        {                                                                                     \
+            *o_val = std::move(entry->val);                                                   \
+        }                                                                                     \
+        h_destroy(&entry->key);                                                               \
+        h_destroy(&entry->val);                                                               \
+        if (index == map->n_entries - 1)                                                      \
+        {                                                                                     \
+            map->n_entries--;                                                                 \
+        }                                                                                     \
+        else                                                                                  \
+        {                                                                                     \
+            entry->hash |= H_ENTRY_DEAD;                                                      \
+            map->n_dead++;                                                                    \
+        }                                                                                     \
+                                                                                              \
+        h_u64 next = position + 1;                                                            \
+        h_u64 array_size = bucket_array_size(map->n_buckets);                                 \
+        while (next < array_size && map->buckets[next].index != H_INDEX_EMPTY &&              \
+               (map->buckets[next].meta & H_PSL_MASK) > 0)                                    \
+        {                                                                                     \
+            map->buckets[next - 1] = map->buckets[next];                                      \
+            map->buckets[next - 1].meta--;                                                    \
+            next++;                                                                           \
+        }                                                                                     \
+        map->buckets[next - 1].index = H_INDEX_EMPTY;                                         \
+        map->buckets_used--;                                                                  \
+                                                                                              \
+        /* If the rebuild fails the map is as it was, and the tombstones wait for the next */ \
+        if (map->n_dead > map->n_entries / 2)                                                 \
+        {                                                                                     \
+            rebuild_index_##name(map, map->n_buckets);                                        \
+        }                                                                                     \
+        return NO_ERROR;                                                                      \
+    }                                                                                         \
+                                                                                              \
+    static inline h_u32 h_count_##name(h_map_##name *map)                                     \
+    {                                                                                         \
+        return map->n_entries - map->n_dead;                                                  \
+    }                                                                                         \
+                                                                                              \
+    static h_result h_reserve_##name(h_map_##name *map, h_u32 count)                          \
+    {                                                                                         \
+        h_u32 wanted = compute_next_highest_power_of_two(count);                              \
+        if (!map->buckets)                                                                    \
+        {                                                                                     \
+            if (map->n_buckets < wanted)                                                      \
+            {                                                                                 \
+                map->n_buckets = wanted;                                                      \
+                map->max_psl = max_psl(map->n_buckets);                                       \
+            }                                                                                 \
+            if (map->entries_capacity < wanted)                                               \
+            {                                                                                 \
+                map->entries_capacity = wanted;                                               \
+            }                                                                                 \
+            return NO_ERROR;                                                                  \
+        }                                                                                     \
+        if (map->entries_capacity < count && !resize_entries_##name(map, wanted))             \
+        {                                                                                     \
+            return MAP_FULL;                                                                  \
+        }                                                                                     \
+        if (map->n_buckets < wanted)                                                          \
+        {                                                                                     \
+            return rebuild_index_##name(map, wanted);                                         \
+        }                                                                                     \
+        return NO_ERROR;                                                                      \
+    }                                                                                         \
+                                                                                              \
+    /* Appends src's keys missing from dst in src's order, passing shared keys to */          \
+    /* combine(dst_val, src_val); a NULL combine keeps dst's value. The hashes stored */      \
+    /* in src's entries are reused, so no key is hashed. src is unchanged. Stops at the */    \
+    /* first key that can't be appended and returns why; the keys before it stay. */          \
+    static h_result h_merge_##name(h_map_##name *dst, h_map_##name *src,                      \
+                                   h_combinefunc_##name *combine)                             \
+    {                                                                                         \
+        h_result res = h_reserve_##name(dst, h_count_##name(dst) + h_count_##name(src));      \
+        for (h_u32 i = 0; res == NO_ERROR && i < src->n_entries; i++)                         \
+        {                                                                                     \
+            h_entry_##name *entry = &src->entries[i];                                         \
+            if (entry->hash & H_ENTRY_DEAD)                                                   \
+            {                                                                                 \
+                continue;                                                                     \
+            }                                                                                 \
+            h_u64 position = 0;                                                               \
+            if (find_bucket_##name(dst, entry->hash, &entry->key, &position) == NO_ERROR)     \
+            {                                                                                 \
+                if (combine)                                                                  \
+                {                                                                             \
+                    combine(&dst->entries[dst->buckets[position].index].val, &entry->val);    \
+                }                                                                             \
+                continue;                                                                     \
+            }                                                                                 \
+            key_type key_copy(entry->key);                                                    \
+            val_type val_copy(entry->val);                                                    \
+            res = put_hashed_##name(dst, entry->hash, &key_copy, &val_copy);                  \
+        }                                                                                     \
+        return res;                                                                           \
+    }                                                                                         \
+                                                                                              \
+    /* Walks live entries in insertion order from *cursor = 0; NULL once exhausted. */        \
+    static inline h_entry_##name *h_iterate_##name(h_map_##name *map, h_u32 *cursor)          \
+    {                                                                                         \
+        while (*cursor < map->n_entries)                                                      \
+        {                                                                                     \
+            h_entry_##name *entry = &map->entries[(*cursor)++];                               \
+            if (!(entry->hash & H_ENTRY_DEAD))                                                \
+            {                                                                                 \
+                return entry;                                                                 \
+            }                                                                                 \
+        }                                                                                     \
+        return NULL;                                                                          \
+    }                                                                                         \
+                                                                                              \
+    static inline h_bool h_free_##name(h_map_##name *map)                                     \
+    {                                                                                         \
+        if (!map->buckets)                                                                    \
+        {                                                                                     \
+            return H_FAILURE;                                                                 \
+        }                                                                                     \
+        if (!std::is_trivially_destructible<key_type>::value ||                               \
+            !std::is_trivially_destructible<val_type>::value)                                 \
+        {                                                                                     \
+            for (h_u32 i = 0; i < map->n_entries; i++)                                        \
+            {                                                                                 \
+                if (!(map->entries[i].hash & H_ENTRY_DEAD))                                   \
+                {                                                                             \
+                    h_destroy(&map->entries[i].key);                                          \
+                    h_destroy(&map->entries[i].val);                                          \
+                }                                                                             \
+            }                                                                                 \
+        }                                                                                     \
+        free(map->buckets);                                                                   \
+        free(map->entries);                                                                   \
+        return H_SUCCESS;                                                                     \
+    }                                                                                         \
+                                                                                              \
+    static void h_clear_##name(h_map_##name *map)                                             \
+    {                                                                                         \
+        if (!map->buckets)                                                                    \
+        {                                                                                     \
+            return;                                                                           \
+        }                                                                                     \
+        if (!std::is_trivially_destructible<key_type>::value ||                               \
+            !std::is_trivially_destructible<val_type>::value)                                 \
+        {                                                                                     \
+            for (h_u32 i = 0; i < map->n_entries; i++)                                        \
+            {                                                                                 \
+                if (!(map->entries[i].hash & H_ENTRY_DEAD))                                   \
+                {                                                                             \
+                    h_destroy(&map->entries[i].key);                                          \
+                    h_destroy(&map->entries[i].val);                                          \
+                }                                                                             \
+            }                                                                                 \
+        }                                                                                     \
+        h_u32 array_size = bucket_array_size(map->n_buckets);                                 \
+        memset(map->buckets, 0xFF, sizeof(h_index_bucket) * array_size);                      \
+        map->buckets_used = 0;                                                                \
+        map->n_entries = 0;                                                                   \
+        map->n_dead = 0;                                                                      \
     }
 
-#endif
\ No newline at end of file
+// Multimap: each key's values sit contiguously in one arena shared by the whole map, so
+// keys with many values cost no allocation of their own. Keys live in an ordinary
+// HASHMAP_INIT map (name##_lists) whose values locate their list in the arena.
+#define HASHMAP_MULTI_INIT(name, key_type, val_type, __hash_func, __equals_func)              \
+    HASHMAP_INIT(name##_lists, key_type, h_value_list, __hash_func, __equals_func);           \
+                                                                                              \
+    struct h_span_##name                                                                      \
+    {                                                                                         \
+        val_type *vals;                                                                       \
+        h_u32 count;                                                                          \
+    };                                                                                        \
+                                                                                              \
+    struct h_map_##name                                                                       \
+    {                                                                                         \
+        h_map_##name##_lists lists;                                                           \
+        val_type *arena;                                                                      \
+        h_u32 arena_used;                                                                     \
+        h_u32 arena_capacity;                                                                 \
+        h_u32 arena_dead;                                                                     \
+    };                                                                                        \
+                                                                                              \
+    static inline h_map_##name h_init_##name(h_u32 capacity = HASHMAP_INITIAL_CAPACITY)       \
+    {                                                                                         \
+        h_map_##name ret = {};                                                                \
+        ret.lists = h_init_##name##_lists(capacity);                                          \
+        return ret;                                                                           \
+    }                                                                                         \
+                                                                                              \
+    static inline h_value_list *find_list_##name(h_map_##name *map, key_type *key)            \
+    {                                                                                         \
+        h_u64 index = 0;                                                                      \
+        if (find_index_##name##_lists(&map->lists, key, &index) != NO_ERROR)                  \
+        {                                                                                     \
+            return NULL;                                                                      \
+        }                                                                                     \
+        return val_at_##name##_lists(&map->lists, index);                                     \
+    }                                                                                         \
+                                                                                              \
+    /* Packs every live list to the front of a new arena with room for extra more values. */  \
+    static void regrow_arena_##name(h_map_##name *map, h_u32 extra)                           \
+    {                                                                                         \
+        h_u32 live = map->arena_used - map->arena_dead;                                       \
+        h_u32 new_capacity = compute_next_highest_power_of_two((live + extra) * 2);           \
+        val_type *new_arena = (val_type *)counter_malloc(sizeof(val_type) * new_capacity);    \
+        h_u32 used = 0;                                                                       \
+        h_map_##name##_lists *lists = &map->lists;                                            \
+        h_u32 array_size = lists->fulls ? bucket_array_size(lists->n_buckets) : 0;            \
+        for (h_u32 i = 0; i < array_size; i++)                                                \
+        {                                                                                     \
+            if (lists->fulls[i])                                                              \
+            {                                                                                 \
+                h_value_list *list = &lists->vals[i];                                         \
+                for (h_u32 v = 0; v < list->count; v++)                                       \
+                {                                                                             \
+                    h_relocate(&new_arena[used + v], &map->arena[list->offset + v]);          \
+                }                                                                             \
+                list->offset = used;                                                          \
+                used += list->capacity;                                                       \
+            }                                                                                 \
+        }                                                                                     \
+        free(map->arena);                                                                     \
+        map->arena = new_arena;                                                               \
+        map->arena_used = used;                                                               \
+        map->arena_capacity = new_capacity;                                                   \
+        map->arena_dead = 0;                                                                  \
+    }                                                                                         \
+                                                                                              \
+    /* Doubles a full list: in place if it ends the arena, else by moving it to the end */    \
+    /* and leaving its old slots dead until the next regrow packs them away. */               \
+    static void grow_list_##name(h_map_##name *map, h_value_list *list)                       \
+    {                                                                                         \
+        h_u32 new_capacity = list->capacity * 2;                                              \
+        h_bool at_end = list->offset + list->capacity == map->arena_used;                     \
+        if (map->arena_used + (at_end ? list->capacity : new_capacity) > map->arena_capacity) \
+        {                                                                                     \
+            regrow_arena_##name(map, new_capacity);                                           \
+            at_end = list->offset + list->capacity == map->arena_used;                        \
+        }                                                                                     \
+        if (at_end)                                                                           \
+        {                                                                                     \
+            map->arena_used += list->capacity;                                                \
+        }                                                                                     \
+        else                                                                                  \
+        {                                                                                     \
+            h_u32 new_offset = map->arena_used;                                               \
+            for (h_u32 v = 0; v < list->count; v++)                                           \
+            {                                                                                 \
+                h_relocate(&map->arena[new_offset + v], &map->arena[list->offset + v]);       \
+            }                                                                                 \
+            map->arena_dead += list->capacity;                                                \
+            map->arena_used += new_capacity;                                                  \
+            list->offset = new_offset;                                                        \
+        }                                                                                     \
+        list->capacity = new_capacity;                                                        \
+    }                                                                                         \
+                                                                                              \
+    /* Appends val to key's values; a key can hold any number of them. */                     \
+    static h_result h_put_##name(h_map_##name *map, key_type key, val_type val)               \
+    {                                                                                         \
+        h_value_list *list = find_list_##name(map, &key);                                     \
+        if (!list)                                                                            \
+        {                                                                                     \
+            if (map->arena_used + 1 > map->arena_capacity)                                    \
+            {                                                                                 \
+                regrow_arena_##name(map, 1);                                                  \
+            }                                                                                 \
+            /* The slot is only claimed once the key is in, so MAP_FULL leaks nothing */      \
+            h_value_list empty = {map->arena_used, 0, 1};                                     \
+            h_result res = h_put_##name##_lists(&map->lists, key, empty);                     \
+            if (res != NO_ERROR)                                                              \
+            {                                                                                 \
+                return res;                                                                   \
+            }                                                                                 \
+            map->arena_used++;                                                                \
+            list = find_list_##name(map, &key);                                               \
+        }                                                                                     \
+        if (list->count == list->capacity)                                                    \
+        {                                                                                     \
+            grow_list_##name(map, list);                                                      \
+        }                                                                                     \
+        h_move_construct(&map->arena[list->offset + list->count], &val);                      \
+        list->count++;                                                                        \
+        return NO_ERROR;                                                                      \
+    }                                                                                         \
+                                                                                              \
+    /* All of key's values in insertion order ({NULL, 0} if it has none). The span is */      \
+    /* invalidated by the next h_put. */                                                      \
+    static inline h_span_##name h_retrieve_all_##name(h_map_##name *map, key_type key)        \
+    {                                                                                         \
+        h_span_##name span = {};                                                              \
+        h_value_list *list = find_list_##name(map, &key);                                     \
+        if (list)                                                                             \
+        {                                                                                     \
+            span.vals = &map->arena[list->offset];                                            \
+            span.count = list->count;                                                         \
+        }                                                                                     \
+        return span;                                                                          \
+    }                                                                                         \
+                                                                                              \
+    static h_result h_remove_##name(h_map_##name *map, key_type key)                          \
+    {                                                                                         \
+        h_value_list *list = find_list_##name(map, &key);                                     \
+        if (!list)                                                                            \
+        {                                                                                     \
+            return EMPTY_BUCKET;                                                              \
+        }                                                                                     \
+        for (h_u32 v = 0; v < list->count; v++)                                               \
+        {                                                                                     \
+            h_destroy(&map->arena[list->offset + v]);                                         \
+        }                                                                                     \
+        map->arena_dead += list->capacity;                                                    \
+        return h_remove_##name##_lists(&map->lists, key);                                     \
+    }                                                                                         \
+                                                                                              \
+    static void destroy_values_##name(h_map_##name *map)                                      \
+    {                                                                                         \
+        h_map_##name##_lists *lists = &map->lists;                                            \
+        if (std::is_trivially_destructible<val_type>::value || !lists->fulls)                 \
+        {                                                                                     \
+            return;                                                                           \
+        }                                                                                     \
+        h_u32 array_size = bucket_array_size(lists->n_buckets);                               \
+        for (h_u32 i = 0; i < array_size; i++)                                                \
+        {                                                                                     \
+            if (lists->fulls[i])                                                              \
+            {                                                                                 \
+                for (h_u32 v = 0; v < lists->vals[i].count; v++)                              \
+                {                                                                             \
+                    h_destroy(&map->arena[lists->vals[i].offset + v]);                        \
+                }                                                                             \
+            }                                                                                 \
+        }                                                                                     \
+    }                                                                                         \
+                                                                                              \
+    static inline h_bool h_free_##name(h_map_##name *map)                                     \
+    {                                                                                         \
+        destroy_values_##name(map);                                                           \
+        free(map->arena);                                                                     \
+        return h_free_##name##_lists(&map->lists);                                            \
+    }                                                                                         \
+                                                                                              \
+    static void h_clear_##name(h_map_##name *map)                                             \
+    {                                                                                         \
+        destroy_values_##name(map);                                                           \
+        h_clear_##name##_lists(&map->lists);                                                  \
+        map->arena_used = 0;                                                                  \
+        map->arena_dead = 0;                                                                  \
+    }
+
+// Fixed-capacity cache with CLOCK eviction. Entries live in capacity slots that never move;
+// a HASHMAP_INIT map (name##_index) from key to slot finds them, sized up front at under
+// 50% load and set to fixed capacity so it never grows. Each slot has a referenced bit,
+// set on every hit; eviction sweeps a hand over the slots, clearing set bits and evicting
+// the first slot whose bit is already clear. Keys are stored in both the slot (to remove
+// an evicted entry from the index) and the index.
+#define HASHMAP_CACHE_INIT(name, key_type, val_type, __hash_func, __equals_func)             \
+    HASHMAP_INIT(name##_index, key_type, h_u32, __hash_func, __equals_func);                 \
+                                                                                             \
+    struct h_cache_##name                                                                    \
+    {                                                                                        \
+        h_map_##name##_index index;                                                          \
+        key_type *keys;                                                                      \
+        val_type *vals;                                                                      \
+        h_u64 *referenced;                                                                   \
+        h_u32 capacity;                                                                      \
+        h_u32 used;                                                                          \
+        h_u32 hand;                                                                          \
+        h_u64 hits;                                                                          \
+        h_u64 misses;                                                                        \
+        h_u64 evictions;                                                                     \
+    };                                                                                       \
+                                                                                             \
+    static h_cache_##name h_cache_init_##name(h_u32 capacity)                                \
+    {                                                                                        \
+        h_cache_##name ret = {};                                                             \
+        ret.capacity = capacity ? capacity : 1;                                              \
+        ret.index = h_init_##name##_index(ret.capacity * 2);                                 \
+        h_reserve_##name##_index(&ret.index, ret.capacity * 2);                              \
+        h_set_fixed_capacity_##name##_index(&ret.index, H_TRUE);                             \
+        ret.keys = (key_type *)counter_malloc(sizeof(key_type) * ret.capacity);              \
+        ret.vals = (val_type *)counter_malloc(sizeof(val_type) * ret.capacity);              \
+        h_u32 n_words = (ret.capacity + 63) / 64;                                            \
+        ret.referenced = (h_u64 *)counter_malloc(sizeof(h_u64) * n_words);                   \
+        memset(ret.referenced, 0, sizeof(h_u64) * n_words);                                  \
+                                                                                             \
+        return ret;                                                                          \
+    }                                                                                        \
+                                                                                             \
+    static inline void set_referenced_##name(h_cache_##name *cache, h_u32 slot)              \
+    {                                                                                        \
+        cache->referenced[slot / 64] |= 1ull << (slot % 64);                                 \
+    }                                                                                        \
+                                                                                             \
+    static inline void release_slot_##name(h_cache_##name *cache, h_u32 slot)                \
+    {                                                                                        \
+        h_destroy(&cache->keys[slot]);                                                       \
+        h_destroy(&cache->vals[slot]);                                                       \
+        cache->referenced[slot / 64] &= ~(1ull << (slot % 64));                              \
+    }                                                                                        \
+                                                                                             \
+    /* Advances the hand until it finds a slot not referenced since its last pass, and */    \
+    /* empties that slot. Only called while every slot is occupied. */                       \
+    static h_u32 evict_##name(h_cache_##name *cache)                                         \
+    {                                                                                        \
+        for (;;)                                                                             \
+        {                                                                                    \
+            h_u32 slot = cache->hand;                                                        \
+            cache->hand = cache->hand + 1 == cache->capacity ? 0 : cache->hand + 1;          \
+            h_u64 bit = 1ull << (slot % 64);                                                 \
+            if (cache->referenced[slot / 64] & bit)                                          \
+            {                                                                                \
+                cache->referenced[slot / 64] &= ~bit;                                        \
+                continue;                                                                    \
+            }                                                                                \
+            h_remove_##name##_index(&cache->index, cache->keys[slot]);                       \
+            release_slot_##name(cache, slot);                                                \
+            cache->evictions++;                                                              \
+            return slot;                                                                     \
+        }                                                                                    \
+    }                                                                                        \
+                                                                                             \
+    /* Copies the cached value into *o_val; a miss returns EMPTY_BUCKET. */                  \
+    static h_result h_cache_get_##name(h_cache_##name *cache, key_type key, val_type *o_val) \
+    {                                                                                        \
+        h_u64 index = 0;                                                                     \
+        if (find_index_##name##_index(&cache->index, &key, &index) != NO_ERROR)              \
+        {                                                                                    \
+            cache->misses++;                                                                 \
+            return EMPTY_BUCKET;                                                             \
+        }                                                                                    \
+        h_u32 slot = *val_at_##name##_index(&cache->index, index);                           \
+        set_referenced_##name(cache, slot);                                                  \
+        cache->hits++;                                                                       \
+        if (o_val)                                                                           \
+        {                                                                                    \
+            *o_val = cache->vals[slot];                                                      \
+        }                                                                                    \
+        return NO_ERROR;                                                                     \
+    }                                                                                        \
+                                                                                             \
+    /* Inserts or replaces key's value, evicting an entry if the cache is full. If the */    \
+    /* key's run in the index is already at max_psl, nothing is evicted and the key is */    \
+    /* not cached: that returns MAP_FULL. */                                                 \
+    static h_result h_cache_put_##name(h_cache_##name *cache, key_type key, val_type val)    \
+    {                                                                                        \
+        h_u64 index = 0;                                                                     \
+        if (find_index_##name##_index(&cache->index, &key, &index) == NO_ERROR)              \
+        {                                                                                    \
+            h_u32 slot = *val_at_##name##_index(&cache->index, index);                       \
+            cache->vals[slot] = std::move(val);                                              \
+            set_referenced_##name(cache, slot);                                              \
+            return NO_ERROR;                                                                 \
+        }                                                                                    \
+        /* Checked before evicting, since an eviction only ever shortens runs. The index */  \
+        /* has twice the capacity in buckets, so it always has room for one more entry. */   \
+        h_u64 hash = cache->index.hash_func(&key);                                           \
+        h_u64 home = index_from_hash_##name##_index(&cache->index, hash);                    \
+        h_u32 tag = h_rank_tag(hash);                                                        \
+        if (!insert_fits_##name##_index(&cache->index, home, tag, &key, H_TRUE))             \
+        {                                                                                    \
+            return MAP_FULL;                                                                 \
+        }                                                                                    \
+        h_u32 slot = 0;                                                                      \
+        if (cache->used < cache->capacity)                                                   \
+        {                                                                                    \
+            slot = cache->used++;                                                            \
+        }                                                                                    \
+        else                                                                                 \
+        {                                                                                    \
+            slot = evict_##name(cache);                                                      \
+        }                                                                                    \
+        h_copy_construct(&cache->keys[slot], &key);                                          \
+        h_move_construct(&cache->vals[slot], &val);                                          \
+                                                                                             \
+        h_u32 placed_slot = slot;                                                            \
+        h_result res = put_hashed_##name##_index(&cache->index, hash, &key, &placed_slot);   \
+        H_ASSERT(res == NO_ERROR, "cache index insert failed after its fit check");          \
+        return res;                                                                          \
+    }                                                                                        \
+                                                                                             \
+    static inline float h_cache_hit_rate_##name(h_cache_##name *cache)                       \
+    {                                                                                        \
+        h_u64 lookups = cache->hits + cache->misses;                                         \
+        return lookups ? (float)cache->hits / (float)lookups : 0.0f;                         \
+    }                                                                                        \
+                                                                                             \
+    static void h_cache_free_##name(h_cache_##name *cache)                                   \
+    {                                                                                        \
+        h_u32 array_size = bucket_array_size(cache->index.n_buckets);                        \
+        for (h_u32 i = 0; i < array_size; i++)                                               \
+        {                                                                                    \
+            if (cache->index.fulls[i])                                                       \
+            {                                                                                \
+                release_slot_##name(cache, cache->index.vals[i]);                            \
+            }                                                                                \
+        }                                                                                    \
+        h_free_##name##_index(&cache->index);                                                \
+        free(cache->keys);                                                                   \
+        free(cache->vals);                                                                   \
+        free(cache->referenced);                                                             \
+        *cache = {};                                                                         \
+    }
+
+// Robin Hood map for integer keys. A reserved __empty_key marks empty buckets, so there is
+// no fulls array, keys are compared with == instead of through a function pointer, and
+// PSLs fit in a byte. Lookups don't read PSLs at all: a key can only sit in the max_psl
+// buckets from its home and every bucket before it there is full, so after checking the
+// home bucket they compare H_INT_SCAN_WIDTH keys at a time (with SSE2 for 32-bit keys),
+// stopping at a match or at a chunk containing an empty bucket. The key arrays carry
+// H_INT_SCAN_WIDTH spare empty buckets so the last chunk never reads past the end.
+// __empty_key itself can't be stored: h_put_* returns RESERVED_KEY for it.
+#define HASHMAP_INIT_INT(name, key_type, val_type, __hash_func, __empty_key)                 \
+    typedef key_type h_key_type_##name;                                                      \
+    typedef val_type h_val_type_##name;                                                      \
+    static_assert(std::is_integral<key_type>::value, "HASHMAP_INIT_INT needs integer keys"); \
+                                                                                             \
+    struct h_map_##name                                                                      \
+    {                                                                                        \
+        h_u32 n_buckets;                                                                     \
+        h_u32 max_psl;                                                                       \
+        h_u32 buckets_used;                                                                  \
+        key_type *keys;                                                                      \
+        h_u8 *psls;                                                                          \
+        val_type *vals;                                                                      \
+        /* As in HASHMAP_INIT: the size last reseeded at, and the seed (see h_seed_hash) */  \
+        h_u32 reseeded_size;                                                                 \
+        h_u64 seed;                                                                          \
+    };                                                                                       \
+                                                                                             \
+    static inline h_map_##name h_init_##name(h_u32 capacity = HASHMAP_INITIAL_CAPACITY)      \
+    {                                                                                        \
+        h_map_##name ret = {};                                                               \
+        if (!is_power_of_two(capacity))                                                      \
+        {                                                                                    \
+            capacity = compute_next_highest_power_of_two(capacity);                          \
+        }                                                                                    \
+        ret.n_buckets = capacity;                                                            \
+        ret.max_psl = max_psl(ret.n_buckets);                                                \
+        ret.seed = HASHMAP_SEED_HASHES ? h_random_seed() : 0;                                \
+        return ret;                                                                          \
+    }                                                                                        \
+                                                                                             \
+    /* Returns H_FALSE, with nothing allocated, if any array can't be allocated */           \
+    static inline h_bool allocate_buffers_##name(h_map_##name *map)                          \
+    {                                                                                        \
+        h_u32 array_size = bucket_array_size(map->n_buckets) + H_INT_SCAN_WIDTH;             \
+        map->keys = (key_type *)counter_malloc(sizeof(key_type) * array_size);               \
+        map->psls = (h_u8 *)counter_malloc(sizeof(h_u8) * array_size);                       \
+        map->vals = (val_type *)counter_malloc(sizeof(val_type) * array_size);               \
+        if (!map->keys || !map->psls || !map->vals)                                          \
+        {                                                                                    \
+            free(map->keys);                                                                 \
+            free(map->psls);                                                                 \
+            free(map->vals);                                                                 \
+            map->keys = NULL;                                                                \
+            return H_FALSE;                                                                  \
+        }                                                                                    \
+        for (h_u32 i = 0; i < array_size; i++)                                               \
+        {                                                                                    \
+            map->keys[i] = __empty_key;                                                      \
+        }                                                                                    \
+        return H_TRUE;                                                                       \
+    }                                                                                        \
+                                                                                             \
+    /* Integer hashes are often the identity, which leaves runs of nearby keys in runs */    \
+    /* of buckets, so the index is always mixed, seeded or not. */                           \
+    static inline h_u64 index_from_hash_##name(h_map_##name *map, h_u64 hash)                \
+    {                                                                                        \
+        return (h_fmix64(hash ^ map->seed) & (map->n_buckets - 1));                          \
+    }                                                                                        \
+                                                                                             \
+    /* Robin Hood layout of the keys in old_keys[0, count) in map's freshly cleared */       \
+    /* arrays. Only keys move; origins[i] gets the index in old_keys of the key bucket i */  \
+    /* holds, for its value to follow. Returns H_FALSE as soon as a key would reach */       \
+    /* max_psl, with the old arrays untouched. */                                            \
+    static h_bool plan_layout_##name(h_map_##name *map, key_type *old_keys, h_u32 count,     \
+                                     h_u32 *origins)                                         \
+    {                                                                                        \
+        for (h_u32 j = 0; j < count; j++)                                                    \
+        {                                                                                    \
+            if (old_keys[j] == __empty_key)                                                  \
+            {                                                                                \
+                continue;                                                                    \
+            }                                                                                \
+            key_type key = old_keys[j];                                                      \
+            h_u32 origin = j;                                                                \
+            h_u64 position = index_from_hash_##name(map, __hash_func(&key));                 \
+            h_u32 psl_curr = 0;                                                              \
+            while (map->keys[position] != __empty_key)                                       \
+            {                                                                                \
+                if (map->psls[position] < psl_curr)                                          \
+                {                                                                            \
+                    key_type resident = map->keys[position];                                 \
+                    h_u32 resident_psl = map->psls[position];                                \
+                    h_u32 resident_origin = origins[position];                               \
+                    map->keys[position] = key;                                               \
+                    map->psls[position] = (h_u8)psl_curr;                                    \
+                    origins[position] = origin;                                              \
+                    key = resident;                                                          \
+                    psl_curr = resident_psl;                                                 \
+                    origin = resident_origin;                                                \
+                }                                                                            \
+                position++;                                                                  \
+                if (++psl_curr >= map->max_psl)                                              \
+                {                                                                            \
+                    return H_FALSE;                                                          \
+                }                                                                            \
+            }                                                                                \
+            map->keys[position] = key;                                                       \
+            map->psls[position] = (h_u8)psl_curr;                                            \
+            origins[position] = origin;                                                      \
+        }                                                                                    \
+        return H_TRUE;                                                                       \
+    }                                                                                        \
+                                                                                             \
+    /* Rebuilds the table in new_n_buckets buckets under the current seed. The layout */     \
+    /* is planned before any value moves, so if the new arrays can't be allocated or a */    \
+    /* key wouldn't fit, this returns MAP_FULL with the map as it was. */                    \
+    static h_result rehash_map_##name(h_map_##name *map, h_u32 new_n_buckets)                \
+    {                                                                                        \
+        h_u32 prev_n_buckets = map->n_buckets;                                               \
+        h_u32 prev_size = bucket_array_size(map->n_buckets);                                 \
+        key_type *old_keys = map->keys;                                                      \
+        h_u8 *old_psls = map->psls;                                                          \
+        val_type *old_vals = map->vals;                                                      \
+                                                                                             \
+        map->n_buckets = new_n_buckets;                                                      \
+        map->max_psl = max_psl(map->n_buckets);                                              \
+        h_u32 array_size = bucket_array_size(map->n_buckets);                                \
+        h_u32 *origins = (h_u32 *)counter_malloc(sizeof(h_u32) * array_size);                \
+        h_bool allocated = origins && allocate_buffers_##name(map);                          \
+        if (!allocated || !plan_layout_##name(map, old_keys, prev_size, origins))            \
+        {                                                                                    \
+            if (allocated)                                                                   \
+            {                                                                                \
+                free(map->keys);                                                             \
+                free(map->psls);                                                             \
+                free(map->vals);                                                             \
+            }                                                                                \
+            free(origins);                                                                   \
+            map->n_buckets = prev_n_buckets;                                                 \
+            map->max_psl = max_psl(map->n_buckets);                                          \
+            map->keys = old_keys;                                                            \
+            map->psls = old_psls;                                                            \
+            map->vals = old_vals;                                                            \
+            return MAP_FULL;                                                                 \
+        }                                                                                    \
+        for (h_u32 i = 0; i < array_size; i++)                                               \
+        {                                                                                    \
+            if (map->keys[i] != __empty_key)                                                 \
+            {                                                                                \
+                h_relocate(&map->vals[i], &old_vals[origins[i]]);                            \
+            }                                                                                \
+        }                                                                                    \
+        free(origins);                                                                       \
+        free(old_keys);                                                                      \
+        free(old_psls);                                                                      \
+        free(old_vals);                                                                      \
+        return NO_ERROR;                                                                     \
+    }                                                                                        \
+                                                                                             \
+    static h_result grow_map_##name(h_map_##name *map)                                       \
+    {                                                                                        \
+        return rehash_map_##name(map, map->n_buckets * 2);                                   \
+    }                                                                                        \
+                                                                                             \
+    static inline h_bool is_sparse_##name(h_map_##name *map)                                 \
+    {                                                                                        \
+        return map->n_buckets >= HASHMAP_RESEED_MIN_BUCKETS &&                               \
+               (h_u64)map->buckets_used * 100 <                                              \
+                   (h_u64)map->n_buckets * HASHMAP_RESEED_LOAD_PCT;                          \
+    }                                                                                        \
+                                                                                             \
+    static h_result reseed_map_##name(h_map_##name *map)                                     \
+    {                                                                                        \
+        h_u64 prev_seed = map->seed;                                                         \
+        map->seed = h_random_seed();                                                         \
+        map->reseeded_size = map->n_buckets;                                                 \
+        h_result res = rehash_map_##name(map, map->n_buckets);                               \
+        if (res != NO_ERROR)                                                                 \
+        {                                                                                    \
+            map->seed = prev_seed;                                                           \
+        }                                                                                    \
+        return res;                                                                          \
+    }                                                                                        \
+                                                                                             \
+    /* As make_room_* in HASHMAP_INIT: a sparse table is reseeded once per size, any */      \
+    /* other doubles, and a sparse table already reseeded at this size gets MAP_FULL. */     \
+    static h_result make_room_##name(h_map_##name *map)                                      \
+    {                                                                                        \
+        if (!is_sparse_##name(map))                                                          \
+        {                                                                                    \
+            return grow_map_##name(map);                                                     \
+        }                                                                                    \
+        if (map->reseeded_size == map->n_buckets)                                            \
+        {                                                                                    \
+            return MAP_FULL;                                                                 \
+        }                                                                                    \
+        return reseed_map_##name(map);                                                       \
+    }                                                                                        \
+                                                                                             \
+    /* Robin Hood insert from position, the key's home. The key passes every entry at */     \
+    /* least as far from its home as the key would be (the key itself can only be one */     \
+    /* of those) and the rest of the run shifts along by one. A shift that would take an */  \
+    /* entry to max_psl is undone, so MAP_FULL leaves the map as it was. */                  \
+    static h_result probe_##name(h_map_##name *map, h_u64 position, key_type key,            \
+                                 val_type *val)                                              \
+    {                                                                                        \
+        h_u32 psl_curr = 0;                                                                  \
+        while (map->keys[position] != __empty_key && map->psls[position] >= psl_curr)        \
+        {                                                                                    \
+            if (map->keys[position] == key)                                                  \
+            {                                                                                \
+                return SAME_KEY;                                                             \
+            }                                                                                \
+            position++;                                                                      \
+            if (++psl_curr >= map->max_psl)                                                  \
+            {                                                                                \
+                return MAP_FULL;                                                             \
+            }                                                                                \
+        }                                                                                    \
+        h_u64 array_size = bucket_array_size(map->n_buckets);                                \
+        h_u64 end = position;                                                                \
+        while (end < array_size && map->keys[end] != __empty_key)                            \
+        {                                                                                    \
+            end++;                                                                           \
+        }                                                                                    \
+        if (end == array_size || map->buckets_used >= map->n_buckets)                        \
+        {                                                                                    \
+            return MAP_FULL;                                                                 \
+        }                                                                                    \
+        for (h_u64 j = end; j > position; j--)                                               \
+        {                                                                                    \
+            if (map->psls[j - 1] + 1u >= map->max_psl)                                       \
+            {                                                                                \
+                for (h_u64 k = j + 1; k <= end; k++)                                         \
+                {                                                                            \
+                    map->keys[k - 1] = map->keys[k];                                         \
+                    map->psls[k - 1] = map->psls[k] - 1;                                     \
+                    h_relocate(&map->vals[k - 1], &map->vals[k]);                            \
+                }                                                                            \
+                map->keys[end] = __empty_key;                                                \
+                return MAP_FULL;                                                             \
+            }                                                                                \
+            map->keys[j] = map->keys[j - 1];                                                 \
+            map->psls[j] = map->psls[j - 1] + 1;                                             \
+            h_relocate(&map->vals[j], &map->vals[j - 1]);                                    \
+        }                                                                                    \
+        map->keys[position] = key;                                                           \
+        map->psls[position] = (h_u8)psl_curr;                                                \
+        h_move_construct(&map->vals[position], val);                                         \
+        map->buckets_used++;                                                                 \
+        return NO_ERROR;                                                                     \
+    }                                                                                        \
+                                                                                             \
+    static h_result h_put_##name(h_map_##name *map, key_type key, val_type val)              \
+    {                                                                                        \
+        if (key == __empty_key)                                                              \
+        {                                                                                    \
+            return RESERVED_KEY;                                                             \
+        }                                                                                    \
+        if (!map->keys && !allocate_buffers_##name(map))                                     \
+        {                                                                                    \
+            return MAP_FULL;                                                                 \
+        }                                                                                    \
+        h_u64 hash = __hash_func(&key);                                                      \
+        h_result res = probe_##name(map, index_from_hash_##name(map, hash), key, &val);      \
+        if (res != MAP_FULL)                                                                 \
+        {                                                                                    \
+            return res;                                                                      \
+        }                                                                                    \
+        res = make_room_##name(map);                                                         \
+        if (res != NO_ERROR)                                                                 \
+        {                                                                                    \
+            return res;                                                                      \
+        }                                                                                    \
+        return probe_##name(map, index_from_hash_##name(map, hash), key, &val);              \
+    }                                                                                        \
+                                                                                             \
+    static h_result find_index_##name(h_map_##name *map, key_type key, h_u64 *o_index)       \
+    {                                                                                        \
+        /* __empty_key is never stored, and searching for it would match an empty bucket */  \
+        if (!map->keys || key == __empty_key)                                                \
+        {                                                                                    \
+            return EMPTY_BUCKET;                                                             \
+        }                                                                                    \
+        h_u64 home = index_from_hash_##name(map, __hash_func(&key));                         \
+        key_type *keys = map->keys + home;                                                   \
+        if (keys[0] == key)                                                                  \
+        {                                                                                    \
+            *o_index = home;                                                                 \
+            return NO_ERROR;                                                                 \
+        }                                                                                    \
+        for (h_u32 base = 0; base < map->max_psl; base += H_INT_SCAN_WIDTH)                  \
+        {                                                                                    \
+            h_u32 matches = h_int_lane_mask(keys + base, key);                               \
+            if (matches)                                                                     \
+            {                                                                                \
+                *o_index = home + base + h_lowest_lane(matches);                             \
+                return NO_ERROR;                                                             \
+            }                                                                                \
+            if (h_int_lane_mask(keys + base, (key_type)__empty_key))                         \
+            {                                                                                \
+                return EMPTY_BUCKET;                                                         \
+            }                                                                                \
+        }                                                                                    \
+        return EXCEEDED_MAP_BOUNDS;                                                          \
+    }                                                                                        \
+                                                                                             \
+    static h_result h_retrieve_##name(h_map_##name *map, key_type key, val_type *o_val)      \
+    {                                                                                        \
+        h_u64 index = 0;                                                                     \
+        h_result res = find_index_##name(map, key, &index);                                  \
+        if (res == NO_ERROR && o_val)                                                        \
+        {                                                                                    \
+            *o_val = map->vals[index];                                                       \
+        }                                                                                    \
+        return res;                                                                          \
+    }                                                                                        \
+                                                                                             \
+    static h_result h_remove_##name(h_map_##name *map, key_type key, val_type *o_val = 0)    \
+    {                                                                                        \
+        h_u64 index = 0;                                                                     \
+        h_result res = find_index_##name(map, key, &index);                                  \
+        if (res != NO_ERROR)                                                                 \
+        {                                                                                    \
+            return res;                                                                      \
+        }                                                                                    \
+        if (o_val)                                                                           \
+        {                                                                                    \
+            *o_val = std::move(map->vals[index]);                                            \
+        }                                                                                    \
+        h_destroy(&map->vals[index]);                                                        \
+        h_u64 next = index + 1;                                                              \
+        h_u64 array_size = bucket_array_size(map->n_buckets);                                \
+        while (next < array_size && map->keys[next] != __empty_key && map->psls[next] > 0)   \
+        {                                                                                    \
+            map->keys[next - 1] = map->keys[next];                                           \
+            map->psls[next - 1] = map->psls[next] - 1;                                       \
+            h_relocate(&map->vals[next - 1], &map->vals[next]);                              \
+            next++;                                                                          \
+        }                                                                                    \
+        map->keys[next - 1] = __empty_key;                                                   \
+        map->buckets_used--;                                                                 \
+        return NO_ERROR;                                                                     \
+    }                                                                                        \
+                                                                                             \
+    static void destroy_vals_##name(h_map_##name *map)                                       \
+    {                                                                                        \
+        if (std::is_trivially_destructible<val_type>::value || !map->keys)                   \
+        {                                                                                    \
+            return;                                                                          \
+        }                                                                                    \
+        h_u32 array_size = bucket_array_size(map->n_buckets);                                \
+        for (h_u32 i = 0; i < array_size; i++)                                               \
+        {                                                                                    \
+            if (map->keys[i] != __empty_key)                                                 \
+            {                                                                                \
+                h_destroy(&map->vals[i]);                                                    \
+            }                                                                                \
+        }                                                                                    \
+    }                                                                                        \
+                                                                                             \
+    static inline h_bool h_free_##name(h_map_##name *map)                                    \
+    {                                                                                        \
+        if (!map->keys)                                                                      \
+        {                                                                                    \
+            return H_FAILURE;                                                                \
+        }                                                                                    \
+        destroy_vals_##name(map);                                                            \
+        free(map->keys);                                                                     \
+        free(map->psls);                                                                     \
+        free(map->vals);                                                                     \
+        return H_SUCCESS;                                                                    \
+    }                                                                                        \
+                                                                                             \
+    static void h_clear_##name(h_map_##name *map)                                            \
+    {                                                                                        \
+        destroy_vals_##name(map);                                                            \
+        if (map->keys)                                                                       \
+        {                                                                                    \
+            h_u32 array_size = bucket_array_size(map->n_buckets);                            \
+            for (h_u32 i = 0; i < array_size; i++)                                           \
+            {                                                                                \
+                map->keys[i] = __empty_key;                                                  \
+            }                                                                                \
+        }                                                                                    \
+        map->buckets_used = 0;                                                               \
+    }
+
+// Robin Hood map from strings to val_type, for large string-keyed maps where a len_string
+// key's pointer, length and separate allocation cost more than the string. Keys are
+// h_compact_key: short strings live in the bucket itself, so comparing them is a 16 byte
+// compare with no pointer chased, and longer ones are front coded into one arena per map,
+// sharing their prefix with the last restart string appended. Like HASHMAP_INIT_INT, a
+// tag in the key marks empty buckets and PSLs fit in a byte. __hash_func hashes a string
+// given as pointer and length, h_u64 (const char *str, h_u32 len).
+#define HASHMAP_INIT_STRING(name, val_type, __hash_func)                                      \
+    typedef h_compact_key h_key_type_##name;                                                  \
+    typedef val_type h_val_type_##name;                                                       \
+                                                                                              \
+    struct h_map_##name                                                                       \
+    {                                                                                         \
+        h_u32 n_buckets;                                                                      \
+        h_u32 max_psl;                                                                        \
+        h_u32 buckets_used;                                                                   \
+        h_compact_key *keys;                                                                  \
+        h_u8 *psls;                                                                           \
+        val_type *vals;                                                                       \
+        char *arena;                                                                          \
+        h_u32 arena_used;                                                                     \
+        h_u32 arena_capacity;                                                                 \
+        h_u32 arena_dead;                                                                     \
+        h_u32 restart;                                                                        \
+        h_u32 restart_len;                                                                    \
+        /* As in HASHMAP_INIT: the size last reseeded at, and the seed (see h_seed_hash) */   \
+        h_u32 reseeded_size;                                                                  \
+        h_u64 seed;                                                                           \
+    };                                                                                        \
+                                                                                              \
+    static inline h_map_##name h_init_##name(h_u32 capacity = HASHMAP_INITIAL_CAPACITY)       \
+    {                                                                                         \
+        h_map_##name ret = {};                                                                \
+        if (!is_power_of_two(capacity))                                                       \
+        {                                                                                     \
+            capacity = compute_next_highest_power_of_two(capacity);                           \
+        }                                                                                     \
+        ret.n_buckets = capacity;                                                             \
+        ret.max_psl = max_psl(ret.n_buckets);                                                 \
+        ret.restart = H_INDEX_EMPTY;                                                          \
+        ret.seed = HASHMAP_SEED_HASHES ? h_random_seed() : 0;                                 \
+        return ret;                                                                           \
+    }                                                                                         \
+                                                                                              \
+    /* Returns H_FALSE, with nothing allocated, if any array can't be allocated */            \
+    static inline h_bool allocate_buffers_##name(h_map_##name *map)                           \
+    {                                                                                         \
+        h_u32 array_size = bucket_array_size(map->n_buckets);                                 \
+        map->keys = (h_compact_key *)counter_malloc(sizeof(h_compact_key) * array_size);      \
+        map->psls = (h_u8 *)counter_malloc(sizeof(h_u8) * array_size);                        \
+        map->vals = (val_type *)counter_malloc(sizeof(val_type) * array_size);                \
+        if (!map->keys || !map->psls || !map->vals)                                           \
+        {                                                                                     \
+            free(map->keys);                                                                  \
+            free(map->psls);                                                                  \
+            free(map->vals);                                                                  \
+            map->keys = NULL;                                                                 \
+            return H_FALSE;                                                                   \
+        }                                                                                     \
+        for (h_u32 i = 0; i < array_size; i++)                                                \
+        {                                                                                     \
+            map->keys[i].bytes[15] = H_STR_TAG_EMPTY;                                         \
+        }                                                                                     \
+        return H_TRUE;                                                                        \
+    }                                                                                         \
+                                                                                              \
+    /* Arena keys keep only H_STR_HASH_MASK of their hash, so every key is indexed by */      \
+    /* those bits. They are mixed with the seed before masking, seeded or not: string */      \
+    /* hashes like djb2 leave the low bits of similar keys clustered. */                      \
+    static inline h_u64 index_from_hash_##name(h_map_##name *map, h_u64 hash)                 \
+    {                                                                                         \
+        return (h_fmix64((hash & H_STR_HASH_MASK) ^ map->seed) & (map->n_buckets - 1));       \
+    }                                                                                         \
+                                                                                              \
+    static inline h_u64 key_hash_##name(h_compact_key *key)                                   \
+    {                                                                                         \
+        h_u8 tag = h_compact_tag(key);                                                        \
+        if (tag == H_STR_TAG_ARENA)                                                           \
+        {                                                                                     \
+            return h_compact_hash(key);                                                       \
+        }                                                                                     \
+        return __hash_func((const char *)key->bytes, tag);                                    \
+    }                                                                                         \
+                                                                                              \
+    /* Copies an arena string into out, which must hold its length */                         \
+    static void decode_key_##name(h_map_##name *map, h_compact_key *key, char *out)           \
+    {                                                                                         \
+        h_u32 len = h_compact_u32(key, 4);                                                    \
+        const char *record = map->arena + h_compact_u32(key, 0);                              \
+        h_u32 restart, shared;                                                                \
+        memcpy(&restart, record, sizeof(restart));                                            \
+        memcpy(&shared, record + 4, sizeof(shared));                                          \
+        memcpy(out, map->arena + restart + H_STR_RECORD_HEADER, shared);                      \
+        memcpy(out + shared, record + H_STR_RECORD_HEADER, len - shared);                     \
+    }                                                                                         \
+                                                                                              \
+    static h_bool arena_equals_##name(h_map_##name *map, h_compact_key *key, const char *str, \
+                                      h_u32 len)                                              \
+    {                                                                                         \
+        const char *record = map->arena + h_compact_u32(key, 0);                              \
+        h_u32 restart, shared;                                                                \
+        memcpy(&restart, record, sizeof(restart));                                            \
+        memcpy(&shared, record + 4, sizeof(shared));                                          \
+        return memcmp(map->arena + restart + H_STR_RECORD_HEADER, str, shared) == 0 &&        \
+               memcmp(record + H_STR_RECORD_HEADER, str + shared, len - shared) == 0;         \
+    }                                                                                         \
+                                                                                              \
+    /* Appends str front coded against the last restart string and points key at it */        \
+    static void arena_append_##name(h_map_##name *map, h_compact_key *key, const char *str,   \
+                                    h_u32 len)                                                \
+    {                                                                                         \
+        h_u32 shared = 0;                                                                     \
+        if (map->restart != H_INDEX_EMPTY)                                                    \
+        {                                                                                     \
+            const char *restart = map->arena + map->restart + H_STR_RECORD_HEADER;            \
+            h_u32 limit = len < map->restart_len ? len : map->restart_len;                    \
+            while (shared < limit && restart[shared] == str[shared])                          \
+            {                                                                                 \
+                shared++;                                                                     \
+            }                                                                                 \
+        }                                                                                     \
+        if (shared < H_STR_MIN_SHARED)                                                        \
+        {                                                                                     \
+            shared = 0;                                                                       \
+        }                                                                                     \
+        h_u32 size = H_STR_RECORD_HEADER + len - shared;                                      \
+        if (map->arena_used + size > map->arena_capacity)                                     \
+        {                                                                                     \
+            h_u32 capacity = map->arena_capacity ? map->arena_capacity : 4096;                \
+            while (capacity < map->arena_used + size)                                         \
+            {                                                                                 \
+                capacity *= 2;                                                                \
+            }                                                                                 \
+            char *arena = (char *)counter_malloc(capacity);                                   \
+            if (map->arena)                                                                   \
+            {                                                                                 \
+                memcpy(arena, map->arena, map->arena_used);                                   \
+                free(map->arena);                                                             \
+            }                                                                                 \
+            map->arena = arena;                                                               \
+            map->arena_capacity = capacity;                                                   \
+        }                                                                                     \
+        h_u32 offset = map->arena_used;                                                       \
+        h_u32 restart = shared ? map->restart : offset;                                       \
+        if (!shared)                                                                          \
+        {                                                                                     \
+            map->restart = offset;                                                            \
+            map->restart_len = len;                                                           \
+        }                                                                                     \
+        char *record = map->arena + offset;                                                   \
+        memcpy(record, &restart, sizeof(restart));                                            \
+        memcpy(record + 4, &shared, sizeof(shared));                                          \
+        memcpy(record + H_STR_RECORD_HEADER, str + shared, len - shared);                     \
+        map->arena_used += size;                                                              \
+        memcpy(key->bytes, &offset, sizeof(offset));                                          \
+    }                                                                                         \
+                                                                                              \
+    /* Re-encodes the live arena strings into a fresh arena, dropping removed ones */         \
+    static void compact_arena_##name(h_map_##name *map)                                       \
+    {                                                                                         \
+        h_map_##name old = *map;                                                              \
+        map->arena = NULL;                                                                    \
+        map->arena_used = 0;                                                                  \
+        map->arena_capacity = 0;                                                              \
+        map->arena_dead = 0;                                                                  \
+        map->restart = H_INDEX_EMPTY;                                                         \
+        char *scratch = NULL;                                                                 \
+        h_u32 scratch_len = 0;                                                                \
+        h_u32 array_size = bucket_array_size(map->n_buckets);                                 \
+        for (h_u32 i = 0; i < array_size; i++)                                                \
+        {                                                                                     \
+            if (h_compact_tag(&map->keys[i]) == H_STR_TAG_ARENA)                              \
+            {                                                                                 \
+                h_u32 len = h_compact_u32(&map->keys[i], 4);                                  \
+                if (len > scratch_len)                                                        \
+                {                                                                             \
+                    free(scratch);                                                            \
+                    scratch = (char *)counter_malloc(len);                                    \
+                    scratch_len = len;                                                        \
+                }                                                                             \
+                decode_key_##name(&old, &map->keys[i], scratch);                              \
+                arena_append_##name(map, &map->keys[i], scratch, len);                        \
+            }                                                                                 \
+        }                                                                                     \
+        free(scratch);                                                                        \
+        free(old.arena);                                                                      \
+    }                                                                                         \
+                                                                                              \
+    /* Whether a new key fits at position without any entry passing max_psl: there is a */    \
+    /* free bucket, the buckets it passes are below max_psl, and so is every entry it */      \
+    /* shifts along by one. */                                                                \
+    static h_bool insert_fits_##name(h_map_##name *map, h_u64 position)                       \
+    {                                                                                         \
+        if (map->buckets_used >= map->n_buckets)                                              \
+        {                                                                                     \
+            return H_FALSE;                                                                   \
+        }                                                                                     \
+        h_u64 array_size = bucket_array_size(map->n_buckets);                                 \
+        h_u32 psl_curr = 0;                                                                   \
+        while (h_compact_tag(&map->keys[position]) != H_STR_TAG_EMPTY &&                      \
+               map->psls[position] >= psl_curr)                                               \
+        {                                                                                     \
+            position++;                                                                       \
+            if (++psl_curr >= map->max_psl)                                                   \
+            {                                                                                 \
+                return H_FALSE;                                                               \
+            }                                                                                 \
+        }                                                                                     \
+        for (; position < array_size &&                                                       \
+               h_compact_tag(&map->keys[position]) != H_STR_TAG_EMPTY;                        \
+             position++)                                                                      \
+        {                                                                                     \
+            if (map->psls[position] + 1u >= map->max_psl)                                     \
+            {                                                                                 \
+                return H_FALSE;                                                               \
+            }                                                                                 \
+        }                                                                                     \
+        return position < array_size;                                                         \
+    }                                                                                         \
+                                                                                              \
+    /* Robin Hood insert of a key known not to be in the map and to fit at position (see */   \
+    /* insert_fits_*): it passes every entry at least as far from its home as it would */     \
+    /* be, and the rest of the run shifts along by one. */                                    \
+    static void probe_##name(h_map_##name *map, h_u64 position, h_compact_key key,            \
+                             val_type *val)                                                   \
+    {                                                                                         \
+        h_u32 psl_curr = 0;                                                                   \
+        while (h_compact_tag(&map->keys[position]) != H_STR_TAG_EMPTY &&                      \
+               map->psls[position] >= psl_curr)                                               \
+        {                                                                                     \
+            position++;                                                                       \
+            psl_curr++;                                                                       \
+        }                                                                                     \
+        h_u64 end = position;                                                                 \
+        while (h_compact_tag(&map->keys[end]) != H_STR_TAG_EMPTY)                             \
+        {                                                                                     \
+            end++;                                                                            \
+        }                                                                                     \
+        for (h_u64 j = end; j > position; j--)                                                \
+        {                                                                                     \
+            map->keys[j] = map->keys[j - 1];                                                  \
+            map->psls[j] = map->psls[j - 1] + 1;                                              \
+            h_relocate(&map->vals[j], &map->vals[j - 1]);                                     \
+        }                                                                                     \
+        map->keys[position] = key;                                                            \
+        map->psls[position] = (h_u8)psl_curr;                                                 \
+        h_move_construct(&map->vals[position], val);                                          \
+        map->buckets_used++;                                                                  \
+    }                                                                                         \
+                                                                                              \
+    /* Robin Hood layout of the keys in old_keys[0, count) in map's freshly cleared */        \
+    /* arrays. Only keys move; origins[i] gets the index in old_keys of the key bucket i */   \
+    /* holds, for its value to follow. Returns H_FALSE as soon as a key would reach */        \
+    /* max_psl, with the old arrays untouched. */                                             \
+    static h_bool plan_layout_##name(h_map_##name *map, h_compact_key *old_keys, h_u32 count, \
+                                     h_u32 *origins)                                          \
+    {                                                                                         \
+        for (h_u32 j = 0; j < count; j++)                                                     \
+        {                                                                                     \
+            if (h_compact_tag(&old_keys[j]) == H_STR_TAG_EMPTY)                               \
+            {                                                                                 \
+                continue;                                                                     \
+            }                                                                                 \
+            h_compact_key key = old_keys[j];                                                  \
+            h_u32 origin = j;                                                                 \
+            h_u64 position = index_from_hash_##name(map, key_hash_##name(&key));              \
+            h_u32 psl_curr = 0;                                                               \
+            while (h_compact_tag(&map->keys[position]) != H_STR_TAG_EMPTY)                    \
+            {                                                                                 \
+                if (map->psls[position] < psl_curr)                                           \
+                {                                                                             \
+                    h_compact_key resident = map->keys[position];                             \
+                    h_u32 resident_psl = map->psls[position];                                 \
+                    h_u32 resident_origin = origins[position];                                \
+                    map->keys[position] = key;                                                \
+                    map->psls[position] = (h_u8)psl_curr;                                     \
+                    origins[position] = origin;                                               \
+                    key = resident;                                                           \
+                    psl_curr = resident_psl;                                                  \
+                    origin = resident_origin;                                                 \
+                }                                                                             \
+                position++;                                                                   \
+                if (++psl_curr >= map->max_psl)                                               \
+                {                                                                             \
+                    return H_FALSE;                                                           \
+                }                                                                             \
+            }                                                                                 \
+            map->keys[position] = key;                                                        \
+            map->psls[position] = (h_u8)psl_curr;                                             \
+            origins[position] = origin;                                                       \
+        }                                                                                     \
+        return H_TRUE;                                                                        \
+    }                                                                                         \
+                                                                                              \
+    /* Rebuilds the table in new_n_buckets buckets under the current seed. The layout */      \
+    /* is planned before any value moves, so if the new arrays can't be allocated or a */     \
+    /* key wouldn't fit, this returns MAP_FULL with the map as it was. */                     \
+    static h_result rehash_map_##name(h_map_##name *map, h_u32 new_n_buckets)                 \
+    {                                                                                         \
+        h_u32 prev_n_buckets = map->n_buckets;                                                \
+        h_u32 prev_size = bucket_array_size(map->n_buckets);                                  \
+        h_compact_key *old_keys = map->keys;                                                  \
+        h_u8 *old_psls = map->psls;                                                           \
+        val_type *old_vals = map->vals;                                                       \
+                                                                                              \
+        map->n_buckets = new_n_buckets;                                                       \
+        map->max_psl = max_psl(map->n_buckets);                                               \
+        h_u32 array_size = bucket_array_size(map->n_buckets);                                 \
+        h_u32 *origins = (h_u32 *)counter_malloc(sizeof(h_u32) * array_size);                 \
+        h_bool allocated = origins && allocate_buffers_##name(map);                           \
+        if (!allocated || !plan_layout_##name(map, old_keys, prev_size, origins))             \
+        {                                                                                     \
+            if (allocated)                                                                    \
+            {                                                                                 \
+                free(map->keys);                                                              \
+                free(map->psls);                                                              \
+                free(map->vals);                                                              \
+            }                                                                                 \
+            free(origins);                                                                    \
+            map->n_buckets = prev_n_buckets;                                                  \
+            map->max_psl = max_psl(map->n_buckets);                                           \
+            map->keys = old_keys;                                                             \
+            map->psls = old_psls;                                                             \
+            map->vals = old_vals;                                                             \
+            return MAP_FULL;                                                                  \
+        }                                                                                     \
+        for (h_u32 i = 0; i < array_size; i++)                                                \
+        {                                                                                     \
+            if (h_compact_tag(&map->keys[i]) != H_STR_TAG_EMPTY)                              \
+            {                                                                                 \
+                h_relocate(&map->vals[i], &old_vals[origins[i]]);                             \
+            }                                                                                 \
+        }                                                                                     \
+        free(origins);                                                                        \
+        free(old_keys);                                                                       \
+        free(old_psls);                                                                       \
+        free(old_vals);                                                                       \
+        return NO_ERROR;                                                                      \
+    }                                                                                         \
+                                                                                              \
+    static h_result grow_map_##name(h_map_##name *map)                                        \
+    {                                                                                         \
+        return rehash_map_##name(map, map->n_buckets * 2);                                    \
+    }                                                                                         \
+                                                                                              \
+    static inline h_bool is_sparse_##name(h_map_##name *map)                                  \
+    {                                                                                         \
+        return map->n_buckets >= HASHMAP_RESEED_MIN_BUCKETS &&                                \
+               (h_u64)map->buckets_used * 100 <                                               \
+                   (h_u64)map->n_buckets * HASHMAP_RESEED_LOAD_PCT;                           \
+    }                                                                                         \
+                                                                                              \
+    /* As make_room_* in HASHMAP_INIT: a sparse table is reseeded once per size, any */       \
+    /* other doubles, and a sparse table already reseeded at this size gets MAP_FULL. */      \
+    static h_result make_room_##name(h_map_##name *map)                                       \
+    {                                                                                         \
+        if (!is_sparse_##name(map))                                                           \
+        {                                                                                     \
+            return grow_map_##name(map);                                                      \
+        }                                                                                     \
+        if (map->reseeded_size == map->n_buckets)                                             \
+        {                                                                                     \
+            return MAP_FULL;                                                                  \
+        }                                                                                     \
+        h_u64 prev_seed = map->seed;                                                          \
+        map->seed = h_random_seed();                                                          \
+        map->reseeded_size = map->n_buckets;                                                  \
+        h_result res = rehash_map_##name(map, map->n_buckets);                                \
+        if (res != NO_ERROR)                                                                  \
+        {                                                                                     \
+            map->seed = prev_seed;                                                            \
+        }                                                                                     \
+        return res;                                                                           \
+    }                                                                                         \
+                                                                                              \
+    static h_result find_index_##name(h_map_##name *map, const char *str, h_u32 len,          \
+                                      h_u64 hash, h_u64 *o_index)                             \
+    {                                                                                         \
+        if (!map->keys)                                                                       \
+        {                                                                                     \
+            return EMPTY_BUCKET;                                                              \
+        }                                                                                     \
+        h_compact_key wanted = h_compact_key_make(str, len, hash);                            \
+        h_u64 position = index_from_hash_##name(map, hash);                                   \
+        for (h_u32 psl = 0; psl < map->max_psl; psl++, position++)                            \
+        {                                                                                     \
+            h_compact_key *key = &map->keys[position];                                        \
+            if (h_compact_tag(key) == H_STR_TAG_EMPTY || map->psls[position] < psl)           \
+            {                                                                                 \
+                return EMPTY_BUCKET;                                                          \
+            }                                                                                 \
+            if (len <= H_STR_INLINE_MAX)                                                      \
+            {                                                                                 \
+                if (memcmp(key->bytes, wanted.bytes, sizeof(wanted.bytes)) == 0)              \
+                {                                                                             \
+                    *o_index = position;                                                      \
+                    return NO_ERROR;                                                          \
+                }                                                                             \
+            }                                                                                 \
+            else if (memcmp(key->bytes + 4, wanted.bytes + 4, 12) == 0 &&                     \
+                     arena_equals_##name(map, key, str, len))                                 \
+            {                                                                                 \
+                *o_index = position;                                                          \
+                return NO_ERROR;                                                              \
+            }                                                                                 \
+        }                                                                                     \
+        return EXCEEDED_MAP_BOUNDS;                                                           \
+    }                                                                                         \
+                                                                                              \
+    static h_result h_put_##name(h_map_##name *map, const char *str, h_u32 len, val_type val) \
+    {                                                                                         \
+        h_u64 hash = __hash_func(str, len);                                                   \
+        h_u64 index = 0;                                                                      \
+        if (find_index_##name(map, str, len, hash, &index) == NO_ERROR)                       \
+        {                                                                                     \
+            return SAME_KEY;                                                                  \
+        }                                                                                     \
+        if (!map->keys && !allocate_buffers_##name(map))                                      \
+        {                                                                                     \
+            return MAP_FULL;                                                                  \
+        }                                                                                     \
+        /* The fit is settled before the string goes into the arena, so MAP_FULL leaves */    \
+        /* nothing behind; make_room_* runs at most once. */                                  \
+        index = index_from_hash_##name(map, hash);                                            \
+        if (!insert_fits_##name(map, index))                                                  \
+        {                                                                                     \
+            h_result room = make_room_##name(map);                                            \
+            if (room != NO_ERROR)                                                             \
+            {                                                                                 \
+                return room;                                                                  \
+            }                                                                                 \
+            index = index_from_hash_##name(map, hash);                                        \
+            if (!insert_fits_##name(map, index))                                              \
+            {                                                                                 \
+                return MAP_FULL;                                                              \
+            }                                                                                 \
+        }                                                                                     \
+        h_compact_key key = h_compact_key_make(str, len, hash);                               \
+        if (len > H_STR_INLINE_MAX)                                                           \
+        {                                                                                     \
+            /* Removed strings stay in the arena until they are half of it. Compacting */     \
+            /* here, with no key in flight, means no offset goes stale under a probe. */      \
+            if (map->arena_dead > map->arena_used / 2)                                        \
+            {                                                                                 \
+                compact_arena_##name(map);                                                    \
+            }                                                                                 \
+            arena_append_##name(map, &key, str, len);                                         \
+        }                                                                                     \
+        probe_##name(map, index, key, &val);                                                  \
+        return NO_ERROR;                                                                      \
+    }                                                                                         \
+                                                                                              \
+    static h_result h_retrieve_##name(h_map_##name *map, const char *str, h_u32 len,          \
+                                      val_type *o_val)                                        \
+    {                                                                                         \
+        h_u64 index = 0;                                                                      \
+        h_result res = find_index_##name(map, str, len, __hash_func(str, len), &index);       \
+        if (res == NO_ERROR && o_val)                                                         \
+        {                                                                                     \
+            *o_val = map->vals[index];                                                        \
+        }                                                                                     \
+        return res;                                                                           \
+    }                                                                                         \
+                                                                                              \
+    static h_result h_remove_##name(h_map_##name *map, const char *str, h_u32 len,            \
+                                    val_type *o_val = 0)                                      \
+    {                                                                                         \
+        h_u64 index = 0;                                                                      \
+        h_result res = find_index_##name(map, str, len, __hash_func(str, len), &index);       \
+        if (res != NO_ERROR)                                                                  \
+        {                                                                                     \
+            return res;                                                                       \
+        }                                                                                     \
+        if (o_val)                                                                            \
+        {                                                                                     \
+            *o_val = std::move(map->vals[index]);                                             \
+        }                                                                                     \
+        h_destroy(&map->vals[index]);                                                         \
+        if (len > H_STR_INLINE_MAX)                                                           \
+        {                                                                                     \
+            const char *record = map->arena + h_compact_u32(&map->keys[index], 0);            \
+            h_u32 shared;                                                                     \
+            memcpy(&shared, record + 4, sizeof(shared));                                      \
+            map->arena_dead += H_STR_RECORD_HEADER + len - shared;                            \
+        }                                                                                     \
+        h_u64 next = index + 1;                                                               \
+        h_u64 array_size = bucket_array_size(map->n_buckets);                                 \
+        while (next < array_size && h_compact_tag(&map->keys[next]) != H_STR_TAG_EMPTY &&     \
+               map->psls[next] > 0)                                                           \
+        {                                                                                     \
+            map->keys[next - 1] = map->keys[next];                                            \
+            map->psls[next - 1] = map->psls[next] - 1;                                        \
+            h_relocate(&map->vals[next - 1], &map->vals[next]);                               \
+            next++;                                                                           \
+        }                                                                                     \
+        map->keys[next - 1].bytes[15] = H_STR_TAG_EMPTY;                                      \
+        map->buckets_used--;                                                                  \
+        return NO_ERROR;                                                                      \
+    }                                                                                         \
+                                                                                              \
+    static void destroy_vals_##name(h_map_##name *map)                                        \
+    {                                                                                         \
+        if (std::is_trivially_destructible<val_type>::value || !map->keys)                    \
+        {                                                                                     \
+            return;                                                                           \
+        }                                                                                     \
+        h_u32 array_size = bucket_array_size(map->n_buckets);                                 \
+        for (h_u32 i = 0; i < array_size; i++)                                                \
+        {                                                                                     \
+            if (h_compact_tag(&map->keys[i]) != H_STR_TAG_EMPTY)                              \
+            {                                                                                 \
+                h_destroy(&map->vals[i]);                                                     \
+            }                                                                                 \
+        }                                                                                     \
+    }                                                                                         \
+                                                                                              \
+    static inline h_bool h_free_##name(h_map_##name *map)                                     \
+    {                                                                                         \
+        if (!map->keys)                                                                       \
+        {                                                                                     \
+            return H_FAILURE;                                                                 \
+        }                                                                                     \
+        destroy_vals_##name(map);                                                             \
+        free(map->keys);                                                                      \
+        free(map->psls);                                                                      \
+        free(map->vals);                                                                      \
+        free(map->arena);                                                                     \
+        return H_SUCCESS;                                                                     \
+    }                                                                                         \
+                                                                                              \
+    static void h_clear_##name(h_map_##name *map)                                             \
+    {                                                                                         \
+        destroy_vals_##name(map);                                                             \
+        if (map->keys)                                                                        \
+        {                                                                                     \
+            h_u32 array_size = bucket_array_size(map->n_buckets);                             \
+            for (h_u32 i = 0; i < array_size; i++)                                            \
+            {                                                                                 \
+                map->keys[i].bytes[15] = H_STR_TAG_EMPTY;                                     \
+            }                                                                                 \
+        }                                                                                     \
+        map->buckets_used = 0;                                                                \
+        map->arena_used = 0;                                                                  \
+        map->arena_dead = 0;                                                                  \
+        map->restart = H_INDEX_EMPTY;                                                         \
+    }
+
+#endif
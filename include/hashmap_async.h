@@ -0,0 +1,286 @@
+#ifndef HASHMAP_ASYNC_H
+#define HASHMAP_ASYNC_H
+
+#include "hashmap.h"
+#include <atomic>
+#include <thread>
+
+// Tables smaller than this still grow inline: rehashing them costs less than starting a
+// thread
+#define H_ASYNC_MIN_BUCKETS (64 * 1024)
+// The overflow table gets n_buckets >> H_ASYNC_OVERFLOW_SHIFT buckets of the table being
+// rehashed; if it fills before the rehash is done the put waits for the rest of it
+#define H_ASYNC_OVERFLOW_SHIFT 2
+// Overflow buckets each operation moves into the new table (or skips, if empty) once the
+// rehash is done
+#define H_ASYNC_DRAIN_BUCKETS 32
+
+enum h_async_state
+{
+    H_ASYNC_IDLE,
+    H_ASYNC_REHASHING,
+    H_ASYNC_DRAINING
+};
+
+// A HASHMAP_INIT map that grows on a background thread instead of inside h_put_*. Its
+// table is fixed capacity, so when probe_* would grow it (on load or on a run reaching
+// max_psl) the put gets MAP_FULL back with the table untouched, and hands the rehash to a
+// worker thread that copies the table and grows the copy. Until the worker is done the
+// old table is only read, by both threads: new keys go to a small overflow table, and
+// lookups check both. Once it is done the next operation swaps the new table in, and the
+// overflow drains into it a few buckets per operation, so no single put pays for moving
+// everything.
+//
+// Removing a key still in the old table while the worker runs waits for the rehash to
+// finish, as the old table can't change under the worker. h_finish_rehash_* waits for any
+// rehash and drain in progress.
+#define HASHMAP_ASYNC_REHASH(name)                                                              \
+    struct h_async_worker_##name                                                                \
+    {                                                                                           \
+        std::thread thread;                                                                     \
+        std::atomic<h_bool> done;                                                               \
+        h_map_##name fresh;                                                                     \
+    };                                                                                          \
+                                                                                                \
+    struct h_async_##name                                                                       \
+    {                                                                                           \
+        h_async_state state;                                                                    \
+        h_map_##name map;                                                                       \
+        h_map_##name overflow;                                                                  \
+        h_u32 drain_cursor;                                                                     \
+        h_async_worker_##name *worker;                                                          \
+    };                                                                                          \
+                                                                                                \
+    static h_async_##name h_init_async_##name(h_u32 capacity = HASHMAP_INITIAL_CAPACITY)        \
+    {                                                                                           \
+        h_async_##name ret = {};                                                                \
+        ret.map = h_init_##name(capacity);                                                      \
+        h_reserve_##name(&ret.map, ret.map.n_buckets);                                          \
+        h_set_fixed_capacity_##name(&ret.map, H_TRUE);                                          \
+        return ret;                                                                             \
+    }                                                                                           \
+                                                                                                \
+    static inline h_result find_hashed_##name(h_map_##name *map, h_u64 hash,                    \
+                                              h_key_type_##name *key, h_u64 *o_index)           \
+    {                                                                                           \
+        return find_index_from_##name(map, index_from_hash_##name(map, hash), h_rank_tag(hash), \
+                                      key, map->equal_func, o_index);                           \
+    }                                                                                           \
+                                                                                                \
+    /* The worker reads the old table through a copy of its struct, so async itself can */      \
+    /* still be moved while it runs. */                                                         \
+    static void start_rehash_##name(h_async_##name *async)                                      \
+    {                                                                                           \
+        h_u32 overflow_buckets = async->map.n_buckets >> H_ASYNC_OVERFLOW_SHIFT;                \
+        async->overflow = h_init_##name(overflow_buckets);                                      \
+        h_reserve_##name(&async->overflow, overflow_buckets);                                   \
+        h_set_fixed_capacity_##name(&async->overflow, H_TRUE);                                  \
+                                                                                                \
+        void *memory = counter_malloc(sizeof(h_async_worker_##name));                           \
+        h_async_worker_##name *worker = new (memory) h_async_worker_##name();                   \
+        worker->done.store(H_FALSE, std::memory_order_relaxed);                                 \
+        h_map_##name old = async->map;                                                          \
+        worker->thread = std::thread([worker, old]() mutable {                                  \
+            worker->fresh = h_copy_##name(&old);                                                \
+            h_set_fixed_capacity_##name(&worker->fresh, H_FALSE);                               \
+            grow_map_##name(&worker->fresh);                                                    \
+            h_set_fixed_capacity_##name(&worker->fresh, H_TRUE);                                \
+            worker->done.store(H_TRUE, std::memory_order_release);                              \
+        });                                                                                     \
+        async->worker = worker;                                                                 \
+        async->state = H_ASYNC_REHASHING;                                                       \
+    }                                                                                           \
+                                                                                                \
+    /* Swaps in the worker's table once it is done, or straight away after waiting for it */    \
+    static void poll_rehash_##name(h_async_##name *async, h_bool wait)                          \
+    {                                                                                           \
+        h_async_worker_##name *worker = async->worker;                                          \
+        if (async->state != H_ASYNC_REHASHING ||                                                \
+            (!wait && !worker->done.load(std::memory_order_acquire)))                           \
+        {                                                                                       \
+            return;                                                                             \
+        }                                                                                       \
+        worker->thread.join();                                                                  \
+        h_free_##name(&async->map);                                                             \
+        async->map = worker->fresh;                                                             \
+        worker->~h_async_worker_##name();                                                       \
+        free(worker);                                                                           \
+        async->worker = NULL;                                                                   \
+        async->drain_cursor = 0;                                                                \
+        async->state = H_ASYNC_DRAINING;                                                        \
+    }                                                                                           \
+                                                                                                \
+    /* Moves overflow entries into the new table, looking at up to budget buckets. Removing */  \
+    /* an entry shifts the rest of its run back onto the cursor, so the cursor only moves */    \
+    /* past empty buckets, and every bucket before it stays empty. An entry the new table */    \
+    /* can't take stays in the overflow, where lookups still find it, and its error is */       \
+    /* returned. */                                                                             \
+    static h_result drain_overflow_##name(h_async_##name *async, h_u32 budget)                  \
+    {                                                                                           \
+        h_map_##name *map = &async->map;                                                        \
+        h_map_##name *overflow = &async->overflow;                                              \
+        h_u32 array_size = bucket_array_size(overflow->n_buckets);                              \
+        for (; budget && async->drain_cursor < array_size; budget--)                            \
+        {                                                                                       \
+            h_u32 i = async->drain_cursor;                                                      \
+            if (!overflow->fulls[i])                                                            \
+            {                                                                                   \
+                async->drain_cursor++;                                                          \
+                continue;                                                                       \
+            }                                                                                   \
+            h_key_type_##name *key = &overflow->keys[i];                                        \
+            h_val_type_##name *val = h_val_slot(overflow->vals, i);                             \
+            h_u64 hash = overflow->hash_func(key);                                              \
+            h_result res = put_hashed_##name(map, hash, key, val);                              \
+            if (res == MAP_FULL)                                                                \
+            {                                                                                   \
+                /* The new table filled up before the overflow emptied; grow it inline */       \
+                h_set_fixed_capacity_##name(map, H_FALSE);                                      \
+                res = put_hashed_##name(map, hash, key, val);                                   \
+                h_set_fixed_capacity_##name(map, H_TRUE);                                       \
+            }                                                                                   \
+            if (res != NO_ERROR)                                                                \
+            {                                                                                   \
+                return res;                                                                     \
+            }                                                                                   \
+            remove_at_index_##name(overflow, i, NULL);                                          \
+        }                                                                                       \
+        if (async->drain_cursor >= array_size)                                                  \
+        {                                                                                       \
+            h_free_##name(overflow);                                                            \
+            async->state = H_ASYNC_IDLE;                                                        \
+        }                                                                                       \
+        return NO_ERROR;                                                                        \
+    }                                                                                           \
+                                                                                                \
+    /* Returns the error of an overflow entry the new table couldn't take, leaving the */       \
+    /* map draining */                                                                          \
+    static h_result h_finish_rehash_##name(h_async_##name *async)                               \
+    {                                                                                           \
+        poll_rehash_##name(async, H_TRUE);                                                      \
+        if (async->state == H_ASYNC_DRAINING)                                                   \
+        {                                                                                       \
+            return drain_overflow_##name(async, 0xFFFFFFFF);                                    \
+        }                                                                                       \
+        return NO_ERROR;                                                                        \
+    }                                                                                           \
+                                                                                                \
+    static h_result h_put_##name(h_async_##name *async, h_key_type_##name key,                  \
+                                 h_val_type_##name val)                                         \
+    {                                                                                           \
+        poll_rehash_##name(async, H_FALSE);                                                     \
+        if (async->state == H_ASYNC_DRAINING)                                                   \
+        {                                                                                       \
+            /* An entry that doesn't drain stays in the overflow and is retried; it is no */    \
+            /* reason to fail this put, and h_finish_rehash_* reports it */                     \
+            drain_overflow_##name(async, H_ASYNC_DRAIN_BUCKETS);                                \
+        }                                                                                       \
+        h_map_##name *map = &async->map;                                                        \
+        h_u64 hash = map->hash_func(&key);                                                      \
+        h_u64 index = 0;                                                                        \
+        if (async->state == H_ASYNC_DRAINING &&                                                 \
+            find_hashed_##name(&async->overflow, hash, &key, &index) == NO_ERROR)               \
+        {                                                                                       \
+            return SAME_KEY;                                                                    \
+        }                                                                                       \
+        if (async->state != H_ASYNC_REHASHING)                                                  \
+        {                                                                                       \
+            h_result res = put_hashed_##name(map, hash, &key, &val);                            \
+            if (res != MAP_FULL)                                                                \
+            {                                                                                   \
+                return res;                                                                     \
+            }                                                                                   \
+            if (map->n_buckets < H_ASYNC_MIN_BUCKETS)                                           \
+            {                                                                                   \
+                h_set_fixed_capacity_##name(map, H_FALSE);                                      \
+                res = put_hashed_##name(map, hash, &key, &val);                                 \
+                h_set_fixed_capacity_##name(map, H_TRUE);                                       \
+                return res;                                                                     \
+            }                                                                                   \
+            /* A drain that fails leaves entries in the overflow a new rehash would drop */     \
+            res = h_finish_rehash_##name(async);                                                \
+            if (res != NO_ERROR)                                                                \
+            {                                                                                   \
+                return res;                                                                     \
+            }                                                                                   \
+            start_rehash_##name(async);                                                         \
+        }                                                                                       \
+        if (find_hashed_##name(map, hash, &key, &index) == NO_ERROR)                            \
+        {                                                                                       \
+            return SAME_KEY;                                                                    \
+        }                                                                                       \
+        h_result res = put_hashed_##name(&async->overflow, hash, &key, &val);                   \
+        if (res == MAP_FULL)                                                                    \
+        {                                                                                       \
+            /* Inserts outran the worker; wait for it rather than grow the overflow, then */    \
+            /* insert inline rather than start another rehash */                                \
+            res = h_finish_rehash_##name(async);                                                \
+            if (res != NO_ERROR)                                                                \
+            {                                                                                   \
+                return res;                                                                     \
+            }                                                                                   \
+            h_set_fixed_capacity_##name(map, H_FALSE);                                          \
+            res = put_hashed_##name(map, hash, &key, &val);                                     \
+            h_set_fixed_capacity_##name(map, H_TRUE);                                           \
+        }                                                                                       \
+        return res;                                                                             \
+    }                                                                                           \
+                                                                                                \
+    static h_result h_retrieve_##name(h_async_##name *async, h_key_type_##name key,             \
+                                      h_val_type_##name *o_val)                                 \
+    {                                                                                           \
+        poll_rehash_##name(async, H_FALSE);                                                     \
+        h_map_##name *map = &async->map;                                                        \
+        h_u64 hash = map->hash_func(&key);                                                      \
+        h_u64 index = 0;                                                                        \
+        if (find_hashed_##name(map, hash, &key, &index) != NO_ERROR)                            \
+        {                                                                                       \
+            map = &async->overflow;                                                             \
+            if (async->state == H_ASYNC_IDLE ||                                                 \
+                find_hashed_##name(map, hash, &key, &index) != NO_ERROR)                        \
+            {                                                                                   \
+                return EMPTY_BUCKET;                                                            \
+            }                                                                                   \
+        }                                                                                       \
+        if (o_val)                                                                              \
+        {                                                                                       \
+            *o_val = *val_at_##name(map, index);                                                \
+        }                                                                                       \
+        return NO_ERROR;                                                                        \
+    }                                                                                           \
+                                                                                                \
+    static h_result h_remove_##name(h_async_##name *async, h_key_type_##name key,               \
+                                    h_val_type_##name *o_val = 0)                               \
+    {                                                                                           \
+        poll_rehash_##name(async, H_FALSE);                                                     \
+        h_u64 hash = async->map.hash_func(&key);                                                \
+        h_u64 index = 0;                                                                        \
+        if (async->state != H_ASYNC_IDLE &&                                                     \
+            find_hashed_##name(&async->overflow, hash, &key, &index) == NO_ERROR)               \
+        {                                                                                       \
+            return remove_at_index_##name(&async->overflow, index, o_val);                      \
+        }                                                                                       \
+        if (find_hashed_##name(&async->map, hash, &key, &index) != NO_ERROR)                    \
+        {                                                                                       \
+            return EMPTY_BUCKET;                                                                \
+        }                                                                                       \
+        if (async->state == H_ASYNC_REHASHING)                                                  \
+        {                                                                                       \
+            poll_rehash_##name(async, H_TRUE);                                                  \
+            find_hashed_##name(&async->map, hash, &key, &index);                                \
+        }                                                                                       \
+        return remove_at_index_##name(&async->map, index, o_val);                               \
+    }                                                                                           \
+                                                                                                \
+    static inline h_bool h_free_##name(h_async_##name *async)                                   \
+    {                                                                                           \
+        poll_rehash_##name(async, H_TRUE);                                                      \
+        if (async->state == H_ASYNC_DRAINING)                                                   \
+        {                                                                                       \
+            h_free_##name(&async->overflow);                                                    \
+        }                                                                                       \
+        async->state = H_ASYNC_IDLE;                                                            \
+        return h_free_##name(&async->map);                                                      \
+    }
+
+#endif
@@ -0,0 +1,1127 @@
+#ifndef HASHMAP_ENGINES_H
+#define HASHMAP_ENGINES_H
+
+#include "hashmap.h"
+
+// Alternative collision strategies with the same h_init / h_put / h_retrieve / h_remove /
+// h_clear / h_free API as HASHMAP_INIT, so a map can switch engine by changing only the
+// macro that declares it. As a rough guide:
+//  - HASHMAP_INIT (Robin Hood): the default; short probes and cheap misses at high load.
+//  - HASHMAP_SWISS_INIT: read heavy maps with expensive key compares. A group of 16
+//    one-byte tags is checked at once, so most lookups compare at most one key.
+//  - HASHMAP_CUCKOO_INIT: lookup latency matters more than insert cost. A key is always
+//    in one of two buckets or a small stash, but inserts may evict long chains.
+//  - HASHMAP_HOPSCOTCH_INIT: mixed read/write loads. A key is always within
+//    H_HOP_RANGE slots of its home, found from a bitmap without touching other keys.
+// None of them support the inline storage, views, merging or fixed capacity of the core.
+// As in the core, a put that finds no room after one grow or reseed returns MAP_FULL.
+
+#define H_GROUP_WIDTH 16
+#define H_CTRL_EMPTY 0x80
+#define H_CTRL_DELETED 0xFE
+#define H_CUCKOO_SLOTS 4
+#define H_CUCKOO_STASH 8
+#define H_CUCKOO_MAX_KICKS 128
+#define H_HOP_RANGE 32
+
+// The hash xor the map's seed through h_fmix64, which leaves each bit of the result
+// depending on every bit of the hash. The engines take positions and tags from different
+// bits of it, and identity hashes of small integers otherwise leave the high bits empty.
+static inline h_u64 h_mix_hash(h_u64 hash, h_u64 seed)
+{
+    return h_fmix64(hash ^ seed);
+}
+
+// Swiss table control bytes: H_CTRL_EMPTY, H_CTRL_DELETED, or the top 7 bits of the mixed
+// hash for a full slot. The rest of the mixed hash picks the group.
+static inline h_u8 h_swiss_tag(h_u64 mixed)
+{
+    return (h_u8)(mixed >> 57);
+}
+
+static inline h_u64 h_swiss_group(h_u64 mixed)
+{
+    return mixed >> 7;
+}
+
+// Bit i set where ctrl[i] == byte, for the H_GROUP_WIDTH control bytes at ctrl
+static inline h_u32 h_group_match(const h_u8 *ctrl, h_u8 byte)
+{
+#if H_HAS_SSE2
+    __m128i group = _mm_loadu_si128((const __m128i *)ctrl);
+    return (h_u32)_mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8((char)byte)));
+#else
+    h_u32 mask = 0;
+    for (h_u32 i = 0; i < H_GROUP_WIDTH; i++)
+    {
+        mask |= (h_u32)(ctrl[i] == byte) << i;
+    }
+    return mask;
+#endif
+}
+
+// Bit i set where ctrl[i] is empty or deleted, the two bytes with the top bit set
+static inline h_u32 h_group_match_free(const h_u8 *ctrl)
+{
+#if H_HAS_SSE2
+    return (h_u32)_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)ctrl));
+#else
+    h_u32 mask = 0;
+    for (h_u32 i = 0; i < H_GROUP_WIDTH; i++)
+    {
+        mask |= (h_u32)(ctrl[i] >> 7) << i;
+    }
+    return mask;
+#endif
+}
+
+// Swiss table: slots are split into groups of H_GROUP_WIDTH, each with a control byte per
+// slot. A lookup visits groups in triangular order (which reaches every group of a power
+// of two table), compares keys only where the control byte matches the key's tag, and
+// stops at the first group with an empty slot. Removal leaves a tombstone unless the
+// group has an empty slot; tombstones count towards the 7/8 load at which it rehashes.
+#define HASHMAP_SWISS_INIT(name, key_type, val_type, __hash_func, __equals_func)               \
+    typedef HASH_FUNCTION(h_hashfunc_##name, key_type);                                        \
+    typedef HASH_EQUALS(h_equalfunc_##name, key_type);                                         \
+    typedef key_type h_key_type_##name;                                                        \
+    typedef val_type h_val_type_##name;                                                        \
+                                                                                               \
+    struct h_map_##name                                                                        \
+    {                                                                                          \
+        h_u32 n_slots;                                                                         \
+        h_u32 buckets_used;                                                                    \
+        h_u32 tombstones;                                                                      \
+        h_u64 seed; /* Mixed into every hash; see h_mix_hash */                                \
+        h_u8 *ctrl;                                                                            \
+        key_type *keys;                                                                        \
+        val_type *vals;                                                                        \
+        h_hashfunc_##name *hash_func;                                                          \
+        h_equalfunc_##name *equal_func;                                                        \
+    };                                                                                         \
+                                                                                               \
+    static inline h_map_##name h_init_##name(h_u32 capacity = HASHMAP_INITIAL_CAPACITY)        \
+    {                                                                                          \
+        h_map_##name ret = {};                                                                 \
+        if (!is_power_of_two(capacity))                                                        \
+        {                                                                                      \
+            capacity = compute_next_highest_power_of_two(capacity);                            \
+        }                                                                                      \
+        ret.n_slots = capacity;                                                                \
+        if (ret.n_slots < H_GROUP_WIDTH)                                                       \
+        {                                                                                      \
+            ret.n_slots = H_GROUP_WIDTH;                                                       \
+        }                                                                                      \
+        ret.seed = HASHMAP_SEED_HASHES ? h_random_seed() : 0;                                  \
+        ret.hash_func = __hash_func;                                                           \
+        ret.equal_func = __equals_func;                                                        \
+        return ret;                                                                            \
+    }                                                                                          \
+                                                                                               \
+    static inline h_bool allocate_buffers_##name(h_map_##name *map)                            \
+    {                                                                                          \
+        map->ctrl = (h_u8 *)counter_malloc(map->n_slots);                                      \
+        map->keys = (key_type *)counter_malloc(sizeof(key_type) * map->n_slots);               \
+        map->vals = (val_type *)counter_malloc(sizeof(val_type) * map->n_slots);               \
+        if (!map->ctrl || !map->keys || !map->vals)                                            \
+        {                                                                                      \
+            free(map->ctrl);                                                                   \
+            free(map->keys);                                                                   \
+            free(map->vals);                                                                   \
+            map->ctrl = NULL;                                                                  \
+            return H_FALSE;                                                                    \
+        }                                                                                      \
+        memset(map->ctrl, H_CTRL_EMPTY, map->n_slots);                                         \
+        return H_TRUE;                                                                         \
+    }                                                                                          \
+                                                                                               \
+    static h_result find_slot_##name(h_map_##name *map, key_type *key, h_u64 hash,             \
+                                     h_u64 *o_slot)                                            \
+    {                                                                                          \
+        h_u64 mixed = h_mix_hash(hash, map->seed);                                             \
+        h_u32 group_mask = map->n_slots / H_GROUP_WIDTH - 1;                                   \
+        h_u32 group = h_swiss_group(mixed) & group_mask;                                       \
+        h_u8 tag = h_swiss_tag(mixed);                                                         \
+        for (h_u32 step = 1; step <= group_mask + 1; step++)                                   \
+        {                                                                                      \
+            h_u8 *ctrl = map->ctrl + group * H_GROUP_WIDTH;                                    \
+            for (h_u32 matches = h_group_match(ctrl, tag); matches; matches &= matches - 1)    \
+            {                                                                                  \
+                h_u64 slot = group * H_GROUP_WIDTH + h_lowest_lane(matches);                   \
+                if (map->equal_func(&map->keys[slot], key))                                    \
+                {                                                                              \
+                    *o_slot = slot;                                                            \
+                    return NO_ERROR;                                                           \
+                }                                                                              \
+            }                                                                                  \
+            if (h_group_match(ctrl, H_CTRL_EMPTY))                                             \
+            {                                                                                  \
+                return EMPTY_BUCKET;                                                           \
+            }                                                                                  \
+            group = (group + step) & group_mask;                                               \
+        }                                                                                      \
+        return EXCEEDED_MAP_BOUNDS;                                                            \
+    }                                                                                          \
+                                                                                               \
+    /* Places a key known to be absent in the first empty or deleted slot on its probe */      \
+    /* sequence. The table always has an empty slot, since it grows at 7/8 full. */            \
+    static void place_##name(h_map_##name *map, h_u64 hash, key_type *key, val_type *val)      \
+    {                                                                                          \
+        h_u64 mixed = h_mix_hash(hash, map->seed);                                             \
+        h_u32 group_mask = map->n_slots / H_GROUP_WIDTH - 1;                                   \
+        h_u32 group = h_swiss_group(mixed) & group_mask;                                       \
+        for (h_u32 step = 1;; step++)                                                          \
+        {                                                                                      \
+            h_u8 *ctrl = map->ctrl + group * H_GROUP_WIDTH;                                    \
+            h_u32 free_slots = h_group_match_free(ctrl);                                       \
+            if (free_slots)                                                                    \
+            {                                                                                  \
+                h_u64 slot = group * H_GROUP_WIDTH + h_lowest_lane(free_slots);                \
+                map->tombstones -= map->ctrl[slot] == H_CTRL_DELETED;                          \
+                map->ctrl[slot] = h_swiss_tag(mixed);                                          \
+                h_move_construct(&map->keys[slot], key);                                       \
+                h_move_construct(&map->vals[slot], val);                                       \
+                map->buckets_used++;                                                           \
+                return;                                                                        \
+            }                                                                                  \
+            group = (group + step) & group_mask;                                               \
+        }                                                                                      \
+    }                                                                                          \
+                                                                                               \
+    /* Returns MAP_FULL, leaving the map as it was, if the new table can't be allocated */     \
+    static h_result rehash_map_##name(h_map_##name *map, h_u32 new_n_slots)                    \
+    {                                                                                          \
+        h_u32 old_n_slots = map->n_slots;                                                      \
+        h_u8 *old_ctrl = map->ctrl;                                                            \
+        key_type *old_keys = map->keys;                                                        \
+        val_type *old_vals = map->vals;                                                        \
+        map->n_slots = new_n_slots;                                                            \
+        if (!allocate_buffers_##name(map))                                                     \
+        {                                                                                      \
+            map->n_slots = old_n_slots;                                                        \
+            map->ctrl = old_ctrl;                                                              \
+            map->keys = old_keys;                                                              \
+            map->vals = old_vals;                                                              \
+            return MAP_FULL;                                                                   \
+        }                                                                                      \
+        map->buckets_used = 0;                                                                 \
+        map->tombstones = 0;                                                                   \
+        for (h_u32 i = 0; i < old_n_slots; i++)                                                \
+        {                                                                                      \
+            if (!(old_ctrl[i] & H_CTRL_EMPTY))                                                 \
+            {                                                                                  \
+                place_##name(map, map->hash_func(&old_keys[i]), &old_keys[i], &old_vals[i]);   \
+                h_destroy(&old_keys[i]);                                                       \
+                h_destroy(&old_vals[i]);                                                       \
+            }                                                                                  \
+        }                                                                                      \
+        free(old_ctrl);                                                                        \
+        free(old_keys);                                                                        \
+        free(old_vals);                                                                        \
+        return NO_ERROR;                                                                       \
+    }                                                                                          \
+                                                                                               \
+    static h_result h_put_##name(h_map_##name *map, key_type key, val_type val)                \
+    {                                                                                          \
+        if (!map->ctrl && !allocate_buffers_##name(map))                                       \
+        {                                                                                      \
+            return MAP_FULL;                                                                   \
+        }                                                                                      \
+        h_u64 hash = map->hash_func(&key);                                                     \
+        h_u64 slot = 0;                                                                        \
+        if (find_slot_##name(map, &key, hash, &slot) == NO_ERROR)                              \
+        {                                                                                      \
+            return SAME_KEY;                                                                   \
+        }                                                                                      \
+        /* Tombstones count towards the load; a table mostly full of them is only rebuilt */   \
+        if ((h_u64)(map->buckets_used + map->tombstones + 1) * 8 > (h_u64)map->n_slots * 7)    \
+        {                                                                                      \
+            h_bool crowded = (h_u64)map->buckets_used * 16 >= (h_u64)map->n_slots * 7;         \
+            h_result res = rehash_map_##name(map, crowded ? map->n_slots * 2 : map->n_slots);  \
+            if (res != NO_ERROR)                                                               \
+            {                                                                                  \
+                return res;                                                                    \
+            }                                                                                  \
+        }                                                                                      \
+        place_##name(map, hash, &key, &val);                                                   \
+        return NO_ERROR;                                                                       \
+    }                                                                                          \
+                                                                                               \
+    static h_result h_retrieve_##name(h_map_##name *map, key_type key, val_type *o_val)        \
+    {                                                                                          \
+        h_u64 slot = 0;                                                                        \
+        if (!map->ctrl)                                                                        \
+        {                                                                                      \
+            return EMPTY_BUCKET;                                                               \
+        }                                                                                      \
+        h_result res = find_slot_##name(map, &key, map->hash_func(&key), &slot);               \
+        if (res == NO_ERROR && o_val)                                                          \
+        {                                                                                      \
+            *o_val = map->vals[slot];                                                          \
+        }                                                                                      \
+        return res;                                                                            \
+    }                                                                                          \
+                                                                                               \
+    /* A slot whose group still has an empty slot can go straight back to empty, since */      \
+    /* every probe through that group stops there anyway; otherwise it becomes a tombstone. */ \
+    static h_result h_remove_##name(h_map_##name *map, key_type key, val_type *o_val = 0)      \
+    {                                                                                          \
+        h_u64 slot = 0;                                                                        \
+        if (!map->ctrl)                                                                        \
+        {                                                                                      \
+            return EMPTY_BUCKET;                                                               \
+        }                                                                                      \
+        h_result res = find_slot_##name(map, &key, map->hash_func(&key), &slot);               \
+        if (res != NO_ERROR)                                                                   \
+        {                                                                                      \
+            return res;                                                                        \
+        }                                                                                      \
+        if (o_val)                                                                             \
+        {                                                                                      \
+            *o_val = std::move(map->vals[slot]);                                               \
+        }                                                                                      \
+        h_destroy(&map->keys[slot]);                                                           \
+        h_destroy(&map->vals[slot]);                                                           \
+        h_u8 *group = map->ctrl + (slot & ~(h_u64)(H_GROUP_WIDTH - 1));                        \
+        if (h_group_match(group, H_CTRL_EMPTY))                                                \
+        {                                                                                      \
+            map->ctrl[slot] = H_CTRL_EMPTY;                                                    \
+        }                                                                                      \
+        else                                                                                   \
+        {                                                                                      \
+            map->ctrl[slot] = H_CTRL_DELETED;                                                  \
+            map->tombstones++;                                                                 \
+        }                                                                                      \
+        map->buckets_used--;                                                                   \
+        return NO_ERROR;                                                                       \
+    }                                                                                          \
+                                                                                               \
+    static void destroy_entries_##name(h_map_##name *map)                                      \
+    {                                                                                          \
+        if (std::is_trivially_destructible<key_type>::value &&                                 \
+            std::is_trivially_destructible<val_type>::value)                                   \
+        {                                                                                      \
+            return;                                                                            \
+        }                                                                                      \
+        for (h_u32 i = 0; i < map->n_slots; i++)                                               \
+        {                                                                                      \
+            if (!(map->ctrl[i] & H_CTRL_EMPTY))                                                \
+            {                                                                                  \
+                h_destroy(&map->keys[i]);                                                      \
+                h_destroy(&map->vals[i]);                                                      \
+            }                                                                                  \
+        }                                                                                      \
+    }                                                                                          \
+                                                                                               \
+    static inline h_bool h_free_##name(h_map_##name *map)                                      \
+    {                                                                                          \
+        if (!map->ctrl)                                                                        \
+        {                                                                                      \
+            return H_FAILURE;                                                                  \
+        }                                                                                      \
+        destroy_entries_##name(map);                                                           \
+        free(map->ctrl);                                                                       \
+        free(map->keys);                                                                       \
+        free(map->vals);                                                                       \
+        return H_SUCCESS;                                                                      \
+    }                                                                                          \
+                                                                                               \
+    static void h_clear_##name(h_map_##name *map)                                              \
+    {                                                                                          \
+        if (map->ctrl)                                                                         \
+        {                                                                                      \
+            destroy_entries_##name(map);                                                       \
+            memset(map->ctrl, H_CTRL_EMPTY, map->n_slots);                                     \
+        }                                                                                      \
+        map->buckets_used = 0;                                                                 \
+        map->tombstones = 0;                                                                   \
+    }
+
+// Bucketized cuckoo hashing: every key lives in one of two buckets of H_CUCKOO_SLOTS
+// slots, or in a stash of H_CUCKOO_STASH slots that is only searched while non-empty.
+// Each slot keeps its full hash, so eviction finds a resident's other bucket without
+// rehashing it and most mismatches are rejected without a key compare.
+#define HASHMAP_CUCKOO_INIT(name, key_type, val_type, __hash_func, __equals_func)             \
+    typedef HASH_FUNCTION(h_hashfunc_##name, key_type);                                       \
+    typedef HASH_EQUALS(h_equalfunc_##name, key_type);                                        \
+    typedef key_type h_key_type_##name;                                                       \
+    typedef val_type h_val_type_##name;                                                       \
+                                                                                              \
+    /* Slot arrays hold n_buckets * H_CUCKOO_SLOTS table slots followed by the stash */       \
+    struct h_map_##name                                                                       \
+    {                                                                                         \
+        h_u32 n_buckets;                                                                      \
+        h_u32 buckets_used;                                                                   \
+        h_u32 stash_used;                                                                     \
+        h_u32 kicks;                                                                          \
+        /* As in HASHMAP_INIT: the size last reseeded at, and the seed (see h_mix_hash) */    \
+        h_u32 reseeded_size;                                                                  \
+        h_u64 seed;                                                                           \
+        h_bool *fulls;                                                                        \
+        h_u64 *hashes;                                                                        \
+        key_type *keys;                                                                       \
+        val_type *vals;                                                                       \
+        h_hashfunc_##name *hash_func;                                                         \
+        h_equalfunc_##name *equal_func;                                                       \
+    };                                                                                        \
+                                                                                              \
+    static inline h_map_##name h_init_##name(h_u32 capacity = HASHMAP_INITIAL_CAPACITY)       \
+    {                                                                                         \
+        h_map_##name ret = {};                                                                \
+        if (!is_power_of_two(capacity))                                                       \
+        {                                                                                     \
+            capacity = compute_next_highest_power_of_two(capacity);                           \
+        }                                                                                     \
+        ret.n_buckets = capacity / H_CUCKOO_SLOTS > 2 ? capacity / H_CUCKOO_SLOTS : 2;        \
+        ret.seed = HASHMAP_SEED_HASHES ? h_random_seed() : 0;                                 \
+        ret.hash_func = __hash_func;                                                          \
+        ret.equal_func = __equals_func;                                                       \
+        return ret;                                                                           \
+    }                                                                                         \
+                                                                                              \
+    static inline h_u32 slot_count_##name(h_map_##name *map)                                  \
+    {                                                                                         \
+        return map->n_buckets * H_CUCKOO_SLOTS + H_CUCKOO_STASH;                              \
+    }                                                                                         \
+                                                                                              \
+    static inline h_bool allocate_buffers_##name(h_map_##name *map)                           \
+    {                                                                                         \
+        h_u32 n_slots = slot_count_##name(map);                                               \
+        map->fulls = (h_bool *)counter_malloc(sizeof(h_bool) * n_slots);                      \
+        map->hashes = (h_u64 *)counter_malloc(sizeof(h_u64) * n_slots);                       \
+        map->keys = (key_type *)counter_malloc(sizeof(key_type) * n_slots);                   \
+        map->vals = (val_type *)counter_malloc(sizeof(val_type) * n_slots);                   \
+        if (!map->fulls || !map->hashes || !map->keys || !map->vals)                          \
+        {                                                                                     \
+            free(map->fulls);                                                                 \
+            free(map->hashes);                                                                \
+            free(map->keys);                                                                  \
+            free(map->vals);                                                                  \
+            map->fulls = NULL;                                                                \
+            return H_FALSE;                                                                   \
+        }                                                                                     \
+        memset(map->fulls, 0, sizeof(h_bool) * n_slots);                                      \
+        return H_TRUE;                                                                        \
+    }                                                                                         \
+                                                                                              \
+    /* The two candidate buckets, from the low and high halves of the mixed hash; the */      \
+    /* second never equals the first. */                                                      \
+    static inline h_u64 first_bucket_##name(h_map_##name *map, h_u64 hash)                    \
+    {                                                                                         \
+        return h_mix_hash(hash, map->seed) & (map->n_buckets - 1);                            \
+    }                                                                                         \
+                                                                                              \
+    static inline h_u64 second_bucket_##name(h_map_##name *map, h_u64 hash)                   \
+    {                                                                                         \
+        h_u64 mixed = h_mix_hash(hash, map->seed);                                            \
+        h_u64 first = mixed & (map->n_buckets - 1);                                           \
+        h_u64 second = (mixed >> 32) & (map->n_buckets - 1);                                  \
+        return second == first ? first ^ 1 : second;                                          \
+    }                                                                                         \
+                                                                                              \
+    static h_result find_slot_##name(h_map_##name *map, key_type *key, h_u64 hash,            \
+                                     h_u64 *o_slot)                                           \
+    {                                                                                         \
+        h_u64 buckets[2] = {first_bucket_##name(map, hash), second_bucket_##name(map, hash)}; \
+        for (h_u32 b = 0; b < 2; b++)                                                         \
+        {                                                                                     \
+            h_u64 slot = buckets[b] * H_CUCKOO_SLOTS;                                         \
+            for (h_u32 i = 0; i < H_CUCKOO_SLOTS; i++, slot++)                                \
+            {                                                                                 \
+                if (map->fulls[slot] && map->hashes[slot] == hash &&                          \
+                    map->equal_func(&map->keys[slot], key))                                   \
+                {                                                                             \
+                    *o_slot = slot;                                                           \
+                    return NO_ERROR;                                                          \
+                }                                                                             \
+            }                                                                                 \
+        }                                                                                     \
+        if (map->stash_used)                                                                  \
+        {                                                                                     \
+            h_u64 slot = (h_u64)map->n_buckets * H_CUCKOO_SLOTS;                              \
+            for (h_u32 i = 0; i < H_CUCKOO_STASH; i++, slot++)                                \
+            {                                                                                 \
+                if (map->fulls[slot] && map->hashes[slot] == hash &&                          \
+                    map->equal_func(&map->keys[slot], key))                                   \
+                {                                                                             \
+                    *o_slot = slot;                                                           \
+                    return NO_ERROR;                                                          \
+                }                                                                             \
+            }                                                                                 \
+        }                                                                                     \
+        return EMPTY_BUCKET;                                                                  \
+    }                                                                                         \
+                                                                                              \
+    /* An entry being placed is either a key and value (a put) or, with origins set, */       \
+    /* just origin: its slot in the old arrays during a rehash, which moves only hashes */    \
+    /* and origins until the layout is known to fit. */                                       \
+    static inline void fill_slot_##name(h_map_##name *map, h_u64 slot, h_u64 hash,            \
+                                        key_type *key, val_type *val, h_u32 *origins,         \
+                                        h_u32 origin)                                         \
+    {                                                                                         \
+        map->fulls[slot] = 1;                                                                 \
+        map->hashes[slot] = hash;                                                             \
+        if (origins)                                                                          \
+        {                                                                                     \
+            origins[slot] = origin;                                                           \
+        }                                                                                     \
+        else                                                                                  \
+        {                                                                                     \
+            h_move_construct(&map->keys[slot], key);                                          \
+            h_move_construct(&map->vals[slot], val);                                          \
+        }                                                                                     \
+        map->buckets_used++;                                                                  \
+    }                                                                                         \
+                                                                                              \
+    static inline void swap_slot_##name(h_map_##name *map, h_u64 slot, h_u64 *hash,           \
+                                        key_type *key, val_type *val, h_u32 *origins,         \
+                                        h_u32 *origin)                                        \
+    {                                                                                         \
+        h_swap(&map->hashes[slot], hash);                                                     \
+        if (origins)                                                                          \
+        {                                                                                     \
+            h_swap(&origins[slot], origin);                                                   \
+        }                                                                                     \
+        else                                                                                  \
+        {                                                                                     \
+            h_swap(&map->keys[slot], key);                                                    \
+            h_swap(&map->vals[slot], val);                                                    \
+        }                                                                                     \
+    }                                                                                         \
+                                                                                              \
+    static h_bool place_in_bucket_##name(h_map_##name *map, h_u64 bucket, h_u64 hash,         \
+                                         key_type *key, val_type *val, h_u32 *origins,        \
+                                         h_u32 origin)                                        \
+    {                                                                                         \
+        h_u64 slot = bucket * H_CUCKOO_SLOTS;                                                 \
+        for (h_u32 i = 0; i < H_CUCKOO_SLOTS; i++, slot++)                                    \
+        {                                                                                     \
+            if (!map->fulls[slot])                                                            \
+            {                                                                                 \
+                fill_slot_##name(map, slot, hash, key, val, origins, origin);                 \
+                return H_TRUE;                                                                \
+            }                                                                                 \
+        }                                                                                     \
+        return H_FALSE;                                                                       \
+    }                                                                                         \
+                                                                                              \
+    /* Places an entry known to be absent (see fill_slot_*). With both buckets full it */     \
+    /* evicts a resident and moves that to its other bucket, for up to */                     \
+    /* H_CUCKOO_MAX_KICKS evictions; the entry left over then goes to the stash. With */      \
+    /* the stash full too, the evictions are undone in reverse and this returns H_FALSE */    \
+    /* with the table and the entry as they were. */                                          \
+    static h_bool place_##name(h_map_##name *map, h_u64 hash, key_type *key, val_type *val,   \
+                               h_u32 *origins, h_u32 origin)                                  \
+    {                                                                                         \
+        h_u64 bucket = first_bucket_##name(map, hash);                                        \
+        if (place_in_bucket_##name(map, bucket, hash, key, val, origins, origin))             \
+        {                                                                                     \
+            return H_TRUE;                                                                    \
+        }                                                                                     \
+        bucket = second_bucket_##name(map, hash);                                             \
+        h_u64 victims[H_CUCKOO_MAX_KICKS];                                                    \
+        h_u32 kick = 0;                                                                       \
+        for (; kick < H_CUCKOO_MAX_KICKS; kick++)                                             \
+        {                                                                                     \
+            if (place_in_bucket_##name(map, bucket, hash, key, val, origins, origin))         \
+            {                                                                                 \
+                return H_TRUE;                                                                \
+            }                                                                                 \
+            h_u64 victim = bucket * H_CUCKOO_SLOTS + (map->kicks++ % H_CUCKOO_SLOTS);         \
+            victims[kick] = victim;                                                           \
+            swap_slot_##name(map, victim, &hash, key, val, origins, &origin);                 \
+            h_u64 first = first_bucket_##name(map, hash);                                     \
+            bucket = bucket == first ? second_bucket_##name(map, hash) : first;               \
+        }                                                                                     \
+        if (map->stash_used < H_CUCKOO_STASH)                                                 \
+        {                                                                                     \
+            h_u64 slot = (h_u64)map->n_buckets * H_CUCKOO_SLOTS;                              \
+            while (map->fulls[slot])                                                          \
+            {                                                                                 \
+                slot++;                                                                       \
+            }                                                                                 \
+            fill_slot_##name(map, slot, hash, key, val, origins, origin);                     \
+            map->stash_used++;                                                                \
+            return H_TRUE;                                                                    \
+        }                                                                                     \
+        while (kick > 0)                                                                      \
+        {                                                                                     \
+            swap_slot_##name(map, victims[--kick], &hash, key, val, origins, &origin);        \
+        }                                                                                     \
+        return H_FALSE;                                                                       \
+    }                                                                                         \
+                                                                                              \
+    /* Rebuilds the table in new_n_buckets buckets under the current seed. The layout */      \
+    /* is planned with hashes and origins before any key or value moves, so if the new */     \
+    /* arrays can't be allocated or an entry doesn't fit, this returns MAP_FULL with the */   \
+    /* map as it was. */                                                                      \
+    static h_result rehash_map_##name(h_map_##name *map, h_u32 new_n_buckets)                 \
+    {                                                                                         \
+        h_u32 old_n_buckets = map->n_buckets;                                                 \
+        h_u32 old_buckets_used = map->buckets_used;                                           \
+        h_u32 old_stash_used = map->stash_used;                                               \
+        h_u32 old_n_slots = slot_count_##name(map);                                           \
+        h_bool *old_fulls = map->fulls;                                                       \
+        h_u64 *old_hashes = map->hashes;                                                      \
+        key_type *old_keys = map->keys;                                                       \
+        val_type *old_vals = map->vals;                                                       \
+        map->n_buckets = new_n_buckets;                                                       \
+        map->buckets_used = 0;                                                                \
+        map->stash_used = 0;                                                                  \
+        h_u32 n_slots = slot_count_##name(map);                                               \
+        h_u32 *origins = (h_u32 *)counter_malloc(sizeof(h_u32) * n_slots);                    \
+        h_bool allocated = origins && allocate_buffers_##name(map);                           \
+        h_bool placed = allocated;                                                            \
+        for (h_u32 i = 0; placed && i < old_n_slots; i++)                                     \
+        {                                                                                     \
+            placed = !old_fulls[i] || place_##name(map, old_hashes[i], 0, 0, origins, i);     \
+        }                                                                                     \
+        if (!placed)                                                                          \
+        {                                                                                     \
+            if (allocated)                                                                    \
+            {                                                                                 \
+                free(map->fulls);                                                             \
+                free(map->hashes);                                                            \
+                free(map->keys);                                                              \
+                free(map->vals);                                                              \
+            }                                                                                 \
+            free(origins);                                                                    \
+            map->n_buckets = old_n_buckets;                                                   \
+            map->buckets_used = old_buckets_used;                                             \
+            map->stash_used = old_stash_used;                                                 \
+            map->fulls = old_fulls;                                                           \
+            map->hashes = old_hashes;                                                         \
+            map->keys = old_keys;                                                             \
+            map->vals = old_vals;                                                             \
+            return MAP_FULL;                                                                  \
+        }                                                                                     \
+        for (h_u32 i = 0; i < n_slots; i++)                                                   \
+        {                                                                                     \
+            if (map->fulls[i])                                                                \
+            {                                                                                 \
+                h_relocate(&map->keys[i], &old_keys[origins[i]]);                             \
+                h_relocate(&map->vals[i], &old_vals[origins[i]]);                             \
+            }                                                                                 \
+        }                                                                                     \
+        free(origins);                                                                        \
+        free(old_fulls);                                                                      \
+        free(old_hashes);                                                                     \
+        free(old_keys);                                                                       \
+        free(old_vals);                                                                       \
+        return NO_ERROR;                                                                      \
+    }                                                                                         \
+                                                                                              \
+    static inline h_bool is_sparse_##name(h_map_##name *map)                                  \
+    {                                                                                         \
+        h_u64 table_slots = (h_u64)map->n_buckets * H_CUCKOO_SLOTS;                           \
+        return table_slots >= HASHMAP_RESEED_MIN_BUCKETS &&                                   \
+               (h_u64)map->buckets_used * 100 < table_slots * HASHMAP_RESEED_LOAD_PCT;        \
+    }                                                                                         \
+                                                                                              \
+    /* As make_room_* in HASHMAP_INIT: a sparse table is reseeded once per size, any */       \
+    /* other doubles, and a sparse table already reseeded at this size gets MAP_FULL. */      \
+    /* Keys with the same full hash share both buckets whatever the seed, so past */          \
+    /* 2 * H_CUCKOO_SLOTS + H_CUCKOO_STASH of them this is where they stop. */                \
+    static h_result make_room_##name(h_map_##name *map)                                       \
+    {                                                                                         \
+        if (!is_sparse_##name(map))                                                           \
+        {                                                                                     \
+            return rehash_map_##name(map, map->n_buckets * 2);                                \
+        }                                                                                     \
+        if (map->reseeded_size == map->n_buckets)                                             \
+        {                                                                                     \
+            return MAP_FULL;                                                                  \
+        }                                                                                     \
+        h_u64 prev_seed = map->seed;                                                          \
+        map->seed = h_random_seed();                                                          \
+        map->reseeded_size = map->n_buckets;                                                  \
+        h_result res = rehash_map_##name(map, map->n_buckets);                                \
+        if (res != NO_ERROR)                                                                  \
+        {                                                                                     \
+            map->seed = prev_seed;                                                            \
+        }                                                                                     \
+        return res;                                                                           \
+    }                                                                                         \
+                                                                                              \
+    static h_result h_put_##name(h_map_##name *map, key_type key, val_type val)               \
+    {                                                                                         \
+        if (!map->fulls && !allocate_buffers_##name(map))                                     \
+        {                                                                                     \
+            return MAP_FULL;                                                                  \
+        }                                                                                     \
+        h_u64 hash = map->hash_func(&key);                                                    \
+        h_u64 slot = 0;                                                                       \
+        if (find_slot_##name(map, &key, hash, &slot) == NO_ERROR)                             \
+        {                                                                                     \
+            return SAME_KEY;                                                                  \
+        }                                                                                     \
+        /* Past this load eviction chains get long; growing early is cheaper */               \
+        if ((h_u64)map->buckets_used * 100 >= (h_u64)map->n_buckets * H_CUCKOO_SLOTS * 90)    \
+        {                                                                                     \
+            h_result res = rehash_map_##name(map, map->n_buckets * 2);                        \
+            if (res != NO_ERROR)                                                              \
+            {                                                                                 \
+                return res;                                                                   \
+            }                                                                                 \
+        }                                                                                     \
+        if (place_##name(map, hash, &key, &val, 0, 0))                                        \
+        {                                                                                     \
+            return NO_ERROR;                                                                  \
+        }                                                                                     \
+        h_result room = make_room_##name(map);                                                \
+        if (room != NO_ERROR)                                                                 \
+        {                                                                                     \
+            return room;                                                                      \
+        }                                                                                     \
+        return place_##name(map, hash, &key, &val, 0, 0) ? NO_ERROR : MAP_FULL;               \
+    }                                                                                         \
+                                                                                              \
+    static h_result h_retrieve_##name(h_map_##name *map, key_type key, val_type *o_val)       \
+    {                                                                                         \
+        h_u64 slot = 0;                                                                       \
+        if (!map->fulls)                                                                      \
+        {                                                                                     \
+            return EMPTY_BUCKET;                                                              \
+        }                                                                                     \
+        h_result res = find_slot_##name(map, &key, map->hash_func(&key), &slot);              \
+        if (res == NO_ERROR && o_val)                                                         \
+        {                                                                                     \
+            *o_val = map->vals[slot];                                                         \
+        }                                                                                     \
+        return res;                                                                           \
+    }                                                                                         \
+                                                                                              \
+    static h_result h_remove_##name(h_map_##name *map, key_type key, val_type *o_val = 0)     \
+    {                                                                                         \
+        h_u64 slot = 0;                                                                       \
+        if (!map->fulls)                                                                      \
+        {                                                                                     \
+            return EMPTY_BUCKET;                                                              \
+        }                                                                                     \
+        h_result res = find_slot_##name(map, &key, map->hash_func(&key), &slot);              \
+        if (res != NO_ERROR)                                                                  \
+        {                                                                                     \
+            return res;                                                                       \
+        }                                                                                     \
+        if (o_val)                                                                            \
+        {                                                                                     \
+            *o_val = std::move(map->vals[slot]);                                              \
+        }                                                                                     \
+        h_destroy(&map->keys[slot]);                                                          \
+        h_destroy(&map->vals[slot]);                                                          \
+        map->fulls[slot] = 0;                                                                 \
+        map->buckets_used--;                                                                  \
+        if (slot >= (h_u64)map->n_buckets * H_CUCKOO_SLOTS)                                   \
+        {                                                                                     \
+            map->stash_used--;                                                                \
+        }                                                                                     \
+        return NO_ERROR;                                                                      \
+    }                                                                                         \
+                                                                                              \
+    static void destroy_entries_##name(h_map_##name *map)                                     \
+    {                                                                                         \
+        if (std::is_trivially_destructible<key_type>::value &&                                \
+            std::is_trivially_destructible<val_type>::value)                                  \
+        {                                                                                     \
+            return;                                                                           \
+        }                                                                                     \
+        h_u32 n_slots = slot_count_##name(map);                                               \
+        for (h_u32 i = 0; i < n_slots; i++)                                                   \
+        {                                                                                     \
+            if (map->fulls[i])                                                                \
+            {                                                                                 \
+                h_destroy(&map->keys[i]);                                                     \
+                h_destroy(&map->vals[i]);                                                     \
+            }                                                                                 \
+        }                                                                                     \
+    }                                                                                         \
+                                                                                              \
+    static inline h_bool h_free_##name(h_map_##name *map)                                     \
+    {                                                                                         \
+        if (!map->fulls)                                                                      \
+        {                                                                                     \
+            return H_FAILURE;                                                                 \
+        }                                                                                     \
+        destroy_entries_##name(map);                                                          \
+        free(map->fulls);                                                                     \
+        free(map->hashes);                                                                    \
+        free(map->keys);                                                                      \
+        free(map->vals);                                                                      \
+        return H_SUCCESS;                                                                     \
+    }                                                                                         \
+                                                                                              \
+    static void h_clear_##name(h_map_##name *map)                                             \
+    {                                                                                         \
+        if (map->fulls)                                                                       \
+        {                                                                                     \
+            destroy_entries_##name(map);                                                      \
+            memset(map->fulls, 0, sizeof(h_bool) * slot_count_##name(map));                   \
+        }                                                                                     \
+        map->buckets_used = 0;                                                                \
+        map->stash_used = 0;                                                                  \
+    }
+
+// Hopscotch hashing: every key lives within H_HOP_RANGE slots of its home bucket, and each
+// home keeps a bitmap of which of those slots hold its keys, so a lookup compares only
+// keys that share its home. Inserts move entries back towards their homes to make room.
+#define HASHMAP_HOPSCOTCH_INIT(name, key_type, val_type, __hash_func, __equals_func)            \
+    typedef HASH_FUNCTION(h_hashfunc_##name, key_type);                                         \
+    typedef HASH_EQUALS(h_equalfunc_##name, key_type);                                          \
+    typedef key_type h_key_type_##name;                                                         \
+    typedef val_type h_val_type_##name;                                                         \
+                                                                                                \
+    /* hops[home] has bit d set when slot home + d holds a key whose home is home. As in */     \
+    /* the Robin Hood core, slots run H_HOP_RANGE past n_buckets so nothing wraps. */           \
+    struct h_map_##name                                                                         \
+    {                                                                                           \
+        h_u32 n_buckets;                                                                        \
+        h_u32 buckets_used;                                                                     \
+        /* As in HASHMAP_INIT: the size last reseeded at, and the seed (see h_mix_hash) */      \
+        h_u32 reseeded_size;                                                                    \
+        h_u64 seed;                                                                             \
+        h_u32 *hops;                                                                            \
+        h_bool *fulls;                                                                          \
+        key_type *keys;                                                                         \
+        val_type *vals;                                                                         \
+        h_hashfunc_##name *hash_func;                                                           \
+        h_equalfunc_##name *equal_func;                                                         \
+    };                                                                                          \
+                                                                                                \
+    static inline h_map_##name h_init_##name(h_u32 capacity = HASHMAP_INITIAL_CAPACITY)         \
+    {                                                                                           \
+        h_map_##name ret = {};                                                                  \
+        if (!is_power_of_two(capacity))                                                         \
+        {                                                                                       \
+            capacity = compute_next_highest_power_of_two(capacity);                             \
+        }                                                                                       \
+        ret.n_buckets = capacity;                                                               \
+        ret.seed = HASHMAP_SEED_HASHES ? h_random_seed() : 0;                                   \
+        ret.hash_func = __hash_func;                                                            \
+        ret.equal_func = __equals_func;                                                         \
+        return ret;                                                                             \
+    }                                                                                           \
+                                                                                                \
+    static inline h_bool allocate_buffers_##name(h_map_##name *map)                             \
+    {                                                                                           \
+        h_u32 n_slots = map->n_buckets + H_HOP_RANGE;                                           \
+        map->hops = (h_u32 *)counter_malloc(sizeof(h_u32) * map->n_buckets);                    \
+        map->fulls = (h_bool *)counter_malloc(sizeof(h_bool) * n_slots);                        \
+        map->keys = (key_type *)counter_malloc(sizeof(key_type) * n_slots);                     \
+        map->vals = (val_type *)counter_malloc(sizeof(val_type) * n_slots);                     \
+        if (!map->hops || !map->fulls || !map->keys || !map->vals)                              \
+        {                                                                                       \
+            free(map->hops);                                                                    \
+            free(map->fulls);                                                                   \
+            free(map->keys);                                                                    \
+            free(map->vals);                                                                    \
+            map->fulls = NULL;                                                                  \
+            return H_FALSE;                                                                     \
+        }                                                                                       \
+        memset(map->hops, 0, sizeof(h_u32) * map->n_buckets);                                   \
+        memset(map->fulls, 0, sizeof(h_bool) * n_slots);                                        \
+        return H_TRUE;                                                                          \
+    }                                                                                           \
+                                                                                                \
+    static inline h_u64 home_##name(h_map_##name *map, h_u64 hash)                              \
+    {                                                                                           \
+        return h_mix_hash(hash, map->seed) & (map->n_buckets - 1);                              \
+    }                                                                                           \
+                                                                                                \
+    static h_result find_slot_##name(h_map_##name *map, key_type *key, h_u64 home,              \
+                                     h_u64 *o_slot)                                             \
+    {                                                                                           \
+        for (h_u32 hops = map->hops[home]; hops; hops &= hops - 1)                              \
+        {                                                                                       \
+            h_u64 slot = home + h_lowest_lane(hops);                                            \
+            if (map->equal_func(&map->keys[slot], key))                                         \
+            {                                                                                   \
+                *o_slot = slot;                                                                 \
+                return NO_ERROR;                                                                \
+            }                                                                                   \
+        }                                                                                       \
+        return EMPTY_BUCKET;                                                                    \
+    }                                                                                           \
+                                                                                                \
+    /* An entry being placed is either a key and value (a put) or, with origins set, */         \
+    /* just origin: its slot in the old arrays during a rehash, which moves only origins */     \
+    /* until the layout is known to fit. */                                                     \
+    static inline void move_slot_##name(h_map_##name *map, h_u64 to, h_u64 from,                \
+                                        h_u32 *origins)                                         \
+    {                                                                                           \
+        if (origins)                                                                            \
+        {                                                                                       \
+            origins[to] = origins[from];                                                        \
+        }                                                                                       \
+        else                                                                                    \
+        {                                                                                       \
+            h_relocate(&map->keys[to], &map->keys[from]);                                       \
+            h_relocate(&map->vals[to], &map->vals[from]);                                       \
+        }                                                                                       \
+    }                                                                                           \
+                                                                                                \
+    /* Takes the nearest free slot after home, then while it is out of home's */                \
+    /* neighbourhood swaps it backwards with an entry that may live there instead. If no */     \
+    /* entry can move this returns H_FALSE with the entry not placed; the entries moved */      \
+    /* so far all stay in their own neighbourhoods. */                                          \
+    static h_bool place_##name(h_map_##name *map, h_u64 home, key_type *key, val_type *val,     \
+                               h_u32 *origins, h_u32 origin)                                    \
+    {                                                                                           \
+        h_u64 n_slots = (h_u64)map->n_buckets + H_HOP_RANGE;                                    \
+        h_u64 free_slot = home;                                                                 \
+        while (free_slot < n_slots && map->fulls[free_slot])                                    \
+        {                                                                                       \
+            free_slot++;                                                                        \
+        }                                                                                       \
+        while (free_slot < n_slots && free_slot - home >= H_HOP_RANGE)                          \
+        {                                                                                       \
+            h_u64 moved_to = free_slot;                                                         \
+            h_u64 first = free_slot - (H_HOP_RANGE - 1);                                        \
+            for (h_u64 candidate = first; candidate < free_slot && moved_to == free_slot;       \
+                 candidate++)                                                                   \
+            {                                                                                   \
+                h_u32 hops = candidate < map->n_buckets ? map->hops[candidate] : 0;             \
+                hops &= (1u << (free_slot - candidate)) - 1;                                    \
+                if (hops)                                                                       \
+                {                                                                               \
+                    h_u32 distance = h_lowest_lane(hops);                                       \
+                    h_u64 slot = candidate + distance;                                          \
+                    move_slot_##name(map, free_slot, slot, origins);                            \
+                    map->fulls[free_slot] = 1;                                                  \
+                    map->fulls[slot] = 0;                                                       \
+                    map->hops[candidate] ^= (1u << distance) | (1u << (free_slot - candidate)); \
+                    moved_to = slot;                                                            \
+                }                                                                               \
+            }                                                                                   \
+            if (moved_to == free_slot)                                                          \
+            {                                                                                   \
+                break;                                                                          \
+            }                                                                                   \
+            free_slot = moved_to;                                                               \
+        }                                                                                       \
+        if (free_slot >= n_slots || free_slot - home >= H_HOP_RANGE)                            \
+        {                                                                                       \
+            return H_FALSE;                                                                     \
+        }                                                                                       \
+        map->fulls[free_slot] = 1;                                                              \
+        if (origins)                                                                            \
+        {                                                                                       \
+            origins[free_slot] = origin;                                                        \
+        }                                                                                       \
+        else                                                                                    \
+        {                                                                                       \
+            h_move_construct(&map->keys[free_slot], key);                                       \
+            h_move_construct(&map->vals[free_slot], val);                                       \
+        }                                                                                       \
+        map->hops[home] |= 1u << (free_slot - home);                                            \
+        map->buckets_used++;                                                                    \
+        return H_TRUE;                                                                          \
+    }                                                                                           \
+                                                                                                \
+    /* Rebuilds the table in new_n_buckets buckets under the current seed. The layout */        \
+    /* is planned with origins before any key or value moves, so if the new arrays */           \
+    /* can't be allocated or a key doesn't fit, this returns MAP_FULL with the map as it */     \
+    /* was. */                                                                                  \
+    static h_result rehash_map_##name(h_map_##name *map, h_u32 new_n_buckets)                   \
+    {                                                                                           \
+        h_u32 old_n_buckets = map->n_buckets;                                                   \
+        h_u32 old_buckets_used = map->buckets_used;                                             \
+        h_u32 old_n_slots = map->n_buckets + H_HOP_RANGE;                                       \
+        h_u32 *old_hops = map->hops;                                                            \
+        h_bool *old_fulls = map->fulls;                                                         \
+        key_type *old_keys = map->keys;                                                         \
+        val_type *old_vals = map->vals;                                                         \
+        map->n_buckets = new_n_buckets;                                                         \
+        map->buckets_used = 0;                                                                  \
+        h_u32 n_slots = map->n_buckets + H_HOP_RANGE;                                           \
+        h_u32 *origins = (h_u32 *)counter_malloc(sizeof(h_u32) * n_slots);                      \
+        h_bool allocated = origins && allocate_buffers_##name(map);                             \
+        h_bool placed = allocated;                                                              \
+        for (h_u32 i = 0; placed && i < old_n_slots; i++)                                       \
+        {                                                                                       \
+            if (old_fulls[i])                                                                   \
+            {                                                                                   \
+                h_u64 home = home_##name(map, map->hash_func(&old_keys[i]));                    \
+                placed = place_##name(map, home, 0, 0, origins, i);                             \
+            }                                                                                   \
+        }                                                                                       \
+        if (!placed)                                                                            \
+        {                                                                                       \
+            if (allocated)                                                                      \
+            {                                                                                   \
+                free(map->hops);                                                                \
+                free(map->fulls);                                                               \
+                free(map->keys);                                                                \
+                free(map->vals);                                                                \
+            }                                                                                   \
+            free(origins);                                                                      \
+            map->n_buckets = old_n_buckets;                                                     \
+            map->buckets_used = old_buckets_used;                                               \
+            map->hops = old_hops;                                                               \
+            map->fulls = old_fulls;                                                             \
+            map->keys = old_keys;                                                               \
+            map->vals = old_vals;                                                               \
+            return MAP_FULL;                                                                    \
+        }                                                                                       \
+        for (h_u32 i = 0; i < n_slots; i++)                                                     \
+        {                                                                                       \
+            if (map->fulls[i])                                                                  \
+            {                                                                                   \
+                h_relocate(&map->keys[i], &old_keys[origins[i]]);                               \
+                h_relocate(&map->vals[i], &old_vals[origins[i]]);                               \
+            }                                                                                   \
+        }                                                                                       \
+        free(origins);                                                                          \
+        free(old_hops);                                                                         \
+        free(old_fulls);                                                                        \
+        free(old_keys);                                                                         \
+        free(old_vals);                                                                         \
+        return NO_ERROR;                                                                        \
+    }                                                                                           \
+                                                                                                \
+    static inline h_bool is_sparse_##name(h_map_##name *map)                                    \
+    {                                                                                           \
+        return map->n_buckets >= HASHMAP_RESEED_MIN_BUCKETS &&                                  \
+               (h_u64)map->buckets_used * 100 <                                                 \
+                   (h_u64)map->n_buckets * HASHMAP_RESEED_LOAD_PCT;                             \
+    }                                                                                           \
+                                                                                                \
+    /* As make_room_* in HASHMAP_INIT: a sparse table is reseeded once per size, any */         \
+    /* other doubles, and a sparse table already reseeded at this size gets MAP_FULL. */        \
+    static h_result make_room_##name(h_map_##name *map)                                         \
+    {                                                                                           \
+        if (!is_sparse_##name(map))                                                             \
+        {                                                                                       \
+            return rehash_map_##name(map, map->n_buckets * 2);                                  \
+        }                                                                                       \
+        if (map->reseeded_size == map->n_buckets)                                               \
+        {                                                                                       \
+            return MAP_FULL;                                                                    \
+        }                                                                                       \
+        h_u64 prev_seed = map->seed;                                                            \
+        map->seed = h_random_seed();                                                            \
+        map->reseeded_size = map->n_buckets;                                                    \
+        h_result res = rehash_map_##name(map, map->n_buckets);                                  \
+        if (res != NO_ERROR)                                                                    \
+        {                                                                                       \
+            map->seed = prev_seed;                                                              \
+        }                                                                                       \
+        return res;                                                                             \
+    }                                                                                           \
+                                                                                                \
+    static h_result h_put_##name(h_map_##name *map, key_type key, val_type val)                 \
+    {                                                                                           \
+        if (!map->fulls && !allocate_buffers_##name(map))                                       \
+        {                                                                                       \
+            return MAP_FULL;                                                                    \
+        }                                                                                       \
+        h_u64 hash = map->hash_func(&key);                                                      \
+        h_u64 slot = 0;                                                                         \
+        if (find_slot_##name(map, &key, home_##name(map, hash), &slot) == NO_ERROR)             \
+        {                                                                                       \
+            return SAME_KEY;                                                                    \
+        }                                                                                       \
+        if ((h_u64)map->buckets_used * 100 >= (h_u64)map->n_buckets * 90)                       \
+        {                                                                                       \
+            h_result res = rehash_map_##name(map, map->n_buckets * 2);                          \
+            if (res != NO_ERROR)                                                                \
+            {                                                                                   \
+                return res;                                                                     \
+            }                                                                                   \
+        }                                                                                       \
+        if (place_##name(map, home_##name(map, hash), &key, &val, 0, 0))                        \
+        {                                                                                       \
+            return NO_ERROR;                                                                    \
+        }                                                                                       \
+        h_result room = make_room_##name(map);                                                  \
+        if (room != NO_ERROR)                                                                   \
+        {                                                                                       \
+            return room;                                                                        \
+        }                                                                                       \
+        h_u64 home = home_##name(map, hash);                                                    \
+        return place_##name(map, home, &key, &val, 0, 0) ? NO_ERROR : MAP_FULL;                 \
+    }                                                                                           \
+                                                                                                \
+    static h_result h_retrieve_##name(h_map_##name *map, key_type key, val_type *o_val)         \
+    {                                                                                           \
+        h_u64 slot = 0;                                                                         \
+        if (!map->fulls)                                                                        \
+        {                                                                                       \
+            return EMPTY_BUCKET;                                                                \
+        }                                                                                       \
+        h_u64 home = home_##name(map, map->hash_func(&key));                                    \
+        h_result res = find_slot_##name(map, &key, home, &slot);                                \
+        if (res == NO_ERROR && o_val)                                                           \
+        {                                                                                       \
+            *o_val = map->vals[slot];                                                           \
+        }                                                                                       \
+        return res;                                                                             \
+    }                                                                                           \
+                                                                                                \
+    static h_result h_remove_##name(h_map_##name *map, key_type key, val_type *o_val = 0)       \
+    {                                                                                           \
+        h_u64 slot = 0;                                                                         \
+        if (!map->fulls)                                                                        \
+        {                                                                                       \
+            return EMPTY_BUCKET;                                                                \
+        }                                                                                       \
+        h_u64 home = home_##name(map, map->hash_func(&key));                                    \
+        h_result res = find_slot_##name(map, &key, home, &slot);                                \
+        if (res != NO_ERROR)                                                                    \
+        {                                                                                       \
+            return res;                                                                         \
+        }                                                                                       \
+        if (o_val)                                                                              \
+        {                                                                                       \
+            *o_val = std::move(map->vals[slot]);                                                \
+        }                                                                                       \
+        h_destroy(&map->keys[slot]);                                                            \
+        h_destroy(&map->vals[slot]);                                                            \
+        map->fulls[slot] = 0;                                                                   \
+        map->hops[home] &= ~(1u << (slot - home));                                              \
+        map->buckets_used--;                                                                    \
+        return NO_ERROR;                                                                        \
+    }                                                                                           \
+                                                                                                \
+    static void destroy_entries_##name(h_map_##name *map)                                       \
+    {                                                                                           \
+        if (std::is_trivially_destructible<key_type>::value &&                                  \
+            std::is_trivially_destructible<val_type>::value)                                    \
+        {                                                                                       \
+            return;                                                                             \
+        }                                                                                       \
+        h_u32 n_slots = map->n_buckets + H_HOP_RANGE;                                           \
+        for (h_u32 i = 0; i < n_slots; i++)                                                     \
+        {                                                                                       \
+            if (map->fulls[i])                                                                  \
+            {                                                                                   \
+                h_destroy(&map->keys[i]);                                                       \
+                h_destroy(&map->vals[i]);                                                       \
+            }                                                                                   \
+        }                                                                                       \
+    }                                                                                           \
+                                                                                                \
+    static inline h_bool h_free_##name(h_map_##name *map)                                       \
+    {                                                                                           \
+        if (!map->fulls)                                                                        \
+        {                                                                                       \
+            return H_FAILURE;                                                                   \
+        }                                                                                       \
+        destroy_entries_##name(map);                                                            \
+        free(map->hops);                                                                        \
+        free(map->fulls);                                                                       \
+        free(map->keys);                                                                        \
+        free(map->vals);                                                                        \
+        return H_SUCCESS;                                                                       \
+    }                                                                                           \
+                                                                                                \
+    static void h_clear_##name(h_map_##name *map)                                               \
+    {                                                                                           \
+        if (map->fulls)                                                                         \
+        {                                                                                       \
+            destroy_entries_##name(map);                                                        \
+            memset(map->hops, 0, sizeof(h_u32) * map->n_buckets);                               \
+            memset(map->fulls, 0, sizeof(h_bool) * (map->n_buckets + H_HOP_RANGE));             \
+        }                                                                                       \
+        map->buckets_used = 0;                                                                  \
+    }
+
+#endif
@@ -0,0 +1,194 @@
+#ifndef HASHMAP_NUMA_H
+#define HASHMAP_NUMA_H
+
+#include "hashmap.h"
+#include <thread>
+
+#if defined(__linux__)
+#include <sched.h>
+#endif
+
+#define H_NUMA_MAX_NODES 8
+#define H_NUMA_MAX_CPUS 1024
+
+// Which node each CPU belongs to, read once from /sys. Anything but Linux, or a box with a
+// single node, reports one node, and the replicated maps below degenerate to one copy.
+struct h_numa_topology
+{
+    h_u32 n_nodes;
+    h_u32 cpu_node[H_NUMA_MAX_CPUS];
+};
+
+#if defined(__linux__)
+// Parses a sysfs cpulist such as "0-7,16-23"
+static void h_numa_read_cpulist(h_numa_topology *topology, h_u32 node, FILE *file)
+{
+    unsigned int first = 0;
+    while (fscanf(file, "%u", &first) == 1)
+    {
+        unsigned int last = first;
+        int separator = fgetc(file);
+        if (separator == '-')
+        {
+            if (fscanf(file, "%u", &last) != 1)
+            {
+                return;
+            }
+            separator = fgetc(file);
+        }
+        for (unsigned int cpu = first; cpu <= last && cpu < H_NUMA_MAX_CPUS; cpu++)
+        {
+            topology->cpu_node[cpu] = node;
+        }
+        if (separator != ',')
+        {
+            return;
+        }
+    }
+}
+#endif
+
+static h_numa_topology h_numa_read_topology()
+{
+    h_numa_topology ret = {};
+    ret.n_nodes = 1;
+#if defined(__linux__)
+    for (h_u32 node = 0; node < H_NUMA_MAX_NODES; node++)
+    {
+        char path[64];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%u/cpulist", node);
+        FILE *file = fopen(path, "r");
+        if (!file)
+        {
+            break;
+        }
+        h_numa_read_cpulist(&ret, node, file);
+        fclose(file);
+        ret.n_nodes = node + 1;
+    }
+#endif
+    return ret;
+}
+
+static inline h_numa_topology *h_numa_topology_get()
+{
+    static h_numa_topology topology = h_numa_read_topology();
+    return &topology;
+}
+
+// Asking the kernel for the current CPU costs more than a cached lookup, so each thread
+// only re-checks its node every 1024 calls; a migration is noticed soon enough.
+static inline h_u32 h_numa_current_node()
+{
+#if defined(__linux__)
+    h_numa_topology *topology = h_numa_topology_get();
+    if (topology->n_nodes == 1)
+    {
+        return 0;
+    }
+    static thread_local h_u32 node = 0;
+    static thread_local h_u32 calls = 0;
+    if ((calls++ & 1023) == 0)
+    {
+        int cpu = sched_getcpu();
+        node = (cpu >= 0 && cpu < H_NUMA_MAX_CPUS) ? topology->cpu_node[cpu] : 0;
+    }
+    return node;
+#else
+    return 0;
+#endif
+}
+
+// Restricts the calling thread to node's CPUs
+static inline void h_numa_pin_to_node(h_u32 node)
+{
+#if defined(__linux__)
+    h_numa_topology *topology = h_numa_topology_get();
+    if (topology->n_nodes == 1)
+    {
+        return;
+    }
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    for (h_u32 cpu = 0; cpu < H_NUMA_MAX_CPUS; cpu++)
+    {
+        if (topology->cpu_node[cpu] == node)
+        {
+            CPU_SET(cpu, &cpus);
+        }
+    }
+    sched_setaffinity(0, sizeof(cpus), &cpus);
+#endif
+}
+
+// Runs fn on a thread pinned to node, so memory it touches first is placed on that node.
+// With a single node it just runs fn on the calling thread.
+template <typename F>
+static void h_numa_run_on_node(h_u32 node, F fn)
+{
+    if (h_numa_topology_get()->n_nodes == 1)
+    {
+        fn();
+        return;
+    }
+    std::thread thread([=]() {
+        h_numa_pin_to_node(node);
+        fn();
+    });
+    thread.join();
+}
+
+// Read-mostly replication of a HASHMAP_INIT map: one copy per NUMA node, and lookups through
+// the replica set go to the copy on the caller's node. Writes go to the source map, which
+// is replicated again with h_replicate_*.
+#define HASHMAP_NUMA_REPLICAS(name)                                                           \
+    struct h_replicas_##name                                                                  \
+    {                                                                                         \
+        h_u32 n_nodes;                                                                        \
+        h_map_##name replicas[H_NUMA_MAX_NODES];                                              \
+    };                                                                                        \
+                                                                                              \
+    /* Each copy is built by a thread pinned to its node, so first-touch places its bucket */ \
+    /* arrays in that node's memory. map itself is left as it is. */                          \
+    static h_replicas_##name h_replicate_##name(h_map_##name *map)                            \
+    {                                                                                         \
+        h_replicas_##name ret = {};                                                           \
+        ret.n_nodes = h_numa_topology_get()->n_nodes;                                         \
+        for (h_u32 node = 0; node < ret.n_nodes; node++)                                      \
+        {                                                                                     \
+            h_map_##name *replica = &ret.replicas[node];                                      \
+            h_numa_run_on_node(node, [=]() { *replica = h_copy_##name(map); });               \
+        }                                                                                     \
+        return ret;                                                                           \
+    }                                                                                         \
+                                                                                              \
+    static inline h_map_##name *h_local_replica_##name(h_replicas_##name *replicas)           \
+    {                                                                                         \
+        h_u32 node = h_numa_current_node();                                                   \
+        if (node >= replicas->n_nodes)                                                        \
+        {                                                                                     \
+            node = 0;                                                                         \
+        }                                                                                     \
+        return &replicas->replicas[node];                                                     \
+    }                                                                                         \
+                                                                                              \
+    static inline h_result h_retrieve_##name(h_replicas_##name *replicas,                     \
+                                             h_key_type_##name key, h_val_type_##name *o_val) \
+    {                                                                                         \
+        return h_retrieve_##name(h_local_replica_##name(replicas), key, o_val);               \
+    }                                                                                         \
+                                                                                              \
+    static inline h_bool h_free_##name(h_replicas_##name *replicas)                           \
+    {                                                                                         \
+        h_bool ret = H_SUCCESS;                                                               \
+        for (h_u32 node = 0; node < replicas->n_nodes; node++)                                \
+        {                                                                                     \
+            if (!h_free_##name(&replicas->replicas[node]))                                    \
+            {                                                                                 \
+                ret = H_FAILURE;                                                              \
+            }                                                                                 \
+        }                                                                                     \
+        return ret;                                                                           \
+    }
+
+#endif
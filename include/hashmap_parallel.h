@@ -0,0 +1,199 @@
+#ifndef HASHMAP_PARALLEL_H
+#define HASHMAP_PARALLEL_H
+
+#include "hashmap.h"
+#include <thread>
+
+#ifndef H_PREFETCH
+#if defined(_MSC_VER)
+#include <xmmintrin.h>
+#define H_PREFETCH(ptr) _mm_prefetch((const char *)(ptr), _MM_HINT_T0)
+#else
+#define H_PREFETCH(ptr) __builtin_prefetch(ptr)
+#endif
+#endif
+
+// Keys each thread hashes and prefetches the home buckets of before probing any of them
+#define H_PARALLEL_BATCH 16
+// Below this many keys per thread, starting a thread costs more than it saves
+#define H_PARALLEL_MIN_KEYS (64 * 1024)
+
+// Threads used for count keys when the caller passes 0: one per hardware thread, but never
+// so many that a thread gets fewer than H_PARALLEL_MIN_KEYS
+static inline h_u32 h_parallel_threads(h_u64 count, h_u32 n_threads)
+{
+    if (!n_threads)
+    {
+        n_threads = std::thread::hardware_concurrency();
+    }
+    h_u64 useful = count / H_PARALLEL_MIN_KEYS;
+    if (n_threads > useful)
+    {
+        n_threads = (h_u32)useful;
+    }
+    return n_threads ? n_threads : 1;
+}
+
+// Splits [0, count) into n_threads contiguous ranges and runs fn(thread, begin, end) on
+// each, the last on the calling thread, returning once all are done
+template <typename F>
+static void h_parallel_ranges(h_u64 count, h_u32 n_threads, F fn)
+{
+    std::thread *threads = n_threads > 1 ? new std::thread[n_threads - 1] : 0;
+    h_u64 per_thread = count / n_threads;
+    for (h_u32 t = 0; t + 1 < n_threads; t++)
+    {
+        threads[t] = std::thread(fn, t, per_thread * t, per_thread * (t + 1));
+    }
+    fn(n_threads - 1, per_thread * (n_threads - 1), count);
+    for (h_u32 t = 0; t + 1 < n_threads; t++)
+    {
+        threads[t].join();
+    }
+    delete[] threads;
+}
+
+// Batch lookups over a HASHMAP_INIT map that nothing is writing to: keys are split into one
+// contiguous range per thread, and each thread hashes H_PARALLEL_BATCH keys and prefetches
+// their home buckets before probing for any of them, so the misses of a batch overlap.
+// The map is only read, so threads share it without locking.
+#define HASHMAP_PARALLEL(name)                                                                \
+    /* Calls found(thread, i, val) for each of keys[begin, end) in the map */                 \
+    template <typename F>                                                                     \
+    static void lookup_range_##name(h_map_##name *map, h_key_type_##name *keys, h_u64 begin,  \
+                                    h_u64 end, h_u32 thread, F found)                         \
+    {                                                                                         \
+        if (is_inline_##name(map))                                                            \
+        {                                                                                     \
+            for (h_u64 i = begin; i < end; i++)                                               \
+            {                                                                                 \
+                h_u64 index = 0;                                                              \
+                if (find_index_##name(map, &keys[i], &index) == NO_ERROR)                     \
+                {                                                                             \
+                    found(thread, i, val_at_##name(map, index));                              \
+                }                                                                             \
+            }                                                                                 \
+            return;                                                                           \
+        }                                                                                     \
+        h_u64 homes[H_PARALLEL_BATCH];                                                        \
+        h_u32 tags[H_PARALLEL_BATCH];                                                         \
+        for (h_u64 batch = begin; batch < end; batch += H_PARALLEL_BATCH)                     \
+        {                                                                                     \
+            h_u64 left = end - batch;                                                         \
+            h_u32 count = left < H_PARALLEL_BATCH ? (h_u32)left : H_PARALLEL_BATCH;           \
+            for (h_u32 j = 0; j < count; j++)                                                 \
+            {                                                                                 \
+                h_u64 hash = map->hash_func(&keys[batch + j]);                                \
+                homes[j] = index_from_hash_##name(map, hash);                                 \
+                tags[j] = h_rank_tag(hash);                                                   \
+                H_PREFETCH(&map->psls[homes[j]]);                                             \
+                H_PREFETCH(&map->keys[homes[j]]);                                             \
+            }                                                                                 \
+            for (h_u32 j = 0; j < count; j++)                                                 \
+            {                                                                                 \
+                h_u64 index = 0;                                                              \
+                if (find_index_from_##name(map, homes[j], tags[j], &keys[batch + j],          \
+                                           map->equal_func, &index) == NO_ERROR)              \
+                {                                                                             \
+                    found(thread, batch + j, val_at_##name(map, index));                      \
+                }                                                                             \
+            }                                                                                 \
+        }                                                                                     \
+    }                                                                                         \
+                                                                                              \
+    /* Copies the value of each key found to o_vals[i]; the slots of missing keys are left */ \
+    /* as they are, and o_found[i], if given, says which. Returns the number found. */        \
+    static h_u64 h_parallel_retrieve_##name(h_map_##name *map, h_key_type_##name *keys,       \
+                                            h_u64 count, h_val_type_##name *o_vals,           \
+                                            h_bool *o_found = 0, h_u32 n_threads = 0)         \
+    {                                                                                         \
+        n_threads = h_parallel_threads(count, n_threads);                                     \
+        h_u64 *found = (h_u64 *)counter_malloc(sizeof(h_u64) * n_threads);                    \
+        h_parallel_ranges(count, n_threads, [=](h_u32 thread, h_u64 begin, h_u64 end) {       \
+            if (o_found)                                                                      \
+            {                                                                                 \
+                memset(o_found + begin, 0, sizeof(h_bool) * (end - begin));                   \
+            }                                                                                 \
+            h_u64 n_found = 0;                                                                \
+            lookup_range_##name(map, keys, begin, end, thread,                                \
+                                [&](h_u32, h_u64 i, h_val_type_##name *val) {                 \
+                                    o_vals[i] = *val;                                         \
+                                    if (o_found)                                              \
+                                    {                                                         \
+                                        o_found[i] = H_TRUE;                                  \
+                                    }                                                         \
+                                    n_found++;                                                \
+                                });                                                           \
+            found[thread] = n_found;                                                          \
+        });                                                                                   \
+        h_u64 ret = 0;                                                                        \
+        for (h_u32 t = 0; t < n_threads; t++)                                                 \
+        {                                                                                     \
+            ret += found[t];                                                                  \
+        }                                                                                     \
+        free(found);                                                                          \
+        return ret;                                                                           \
+    }                                                                                         \
+                                                                                              \
+    /* Number of keys, counting repeats, that are in the map */                               \
+    static h_u64 h_parallel_count_##name(h_map_##name *map, h_key_type_##name *keys,          \
+                                         h_u64 count, h_u32 n_threads = 0)                    \
+    {                                                                                         \
+        n_threads = h_parallel_threads(count, n_threads);                                     \
+        h_u64 *found = (h_u64 *)counter_malloc(sizeof(h_u64) * n_threads);                    \
+        h_parallel_ranges(count, n_threads, [=](h_u32 thread, h_u64 begin, h_u64 end) {       \
+            h_u64 n_found = 0;                                                                \
+            lookup_range_##name(map, keys, begin, end, thread,                                \
+                                [&](h_u32, h_u64, h_val_type_##name *) { n_found++; });       \
+            found[thread] = n_found;                                                          \
+        });                                                                                   \
+        h_u64 ret = 0;                                                                        \
+        for (h_u32 t = 0; t < n_threads; t++)                                                 \
+        {                                                                                     \
+            ret += found[t];                                                                  \
+        }                                                                                     \
+        free(found);                                                                          \
+        return ret;                                                                           \
+    }                                                                                         \
+                                                                                              \
+    /* For a map from keys to group numbers below n_groups: adds weights[i] to */             \
+    /* o_sums[group of keys[i]] for each key in the map, skipping the rest. Each thread */    \
+    /* sums into its own n_groups array, and these are added into o_sums at the end. */       \
+    template <typename sum_type>                                                              \
+    static void h_parallel_group_sum_##name(h_map_##name *map, h_key_type_##name *keys,       \
+                                            sum_type *weights, h_u64 count, sum_type *o_sums, \
+                                            h_u32 n_groups, h_u32 n_threads = 0)              \
+    {                                                                                         \
+        n_threads = h_parallel_threads(count, n_threads);                                     \
+        /* Allocated here as counter_malloc isn't thread safe */                              \
+        sum_type **partials = (sum_type **)counter_malloc(sizeof(sum_type *) * n_threads);    \
+        for (h_u32 t = 0; t < n_threads; t++)                                                 \
+        {                                                                                     \
+            partials[t] = (sum_type *)counter_malloc(sizeof(sum_type) * n_groups);            \
+        }                                                                                     \
+        h_parallel_ranges(count, n_threads, [=](h_u32 thread, h_u64 begin, h_u64 end) {       \
+            sum_type *sums = partials[thread];                                                \
+            for (h_u32 g = 0; g < n_groups; g++)                                              \
+            {                                                                                 \
+                sums[g] = sum_type();                                                         \
+            }                                                                                 \
+            lookup_range_##name(map, keys, begin, end, thread,                                \
+                                [=](h_u32, h_u64 i, h_val_type_##name *group) {               \
+                                    if ((h_u64)*group < n_groups)                             \
+                                    {                                                         \
+                                        sums[(h_u64)*group] += weights[i];                    \
+                                    }                                                         \
+                                });                                                           \
+        });                                                                                   \
+        for (h_u32 t = 0; t < n_threads; t++)                                                 \
+        {                                                                                     \
+            for (h_u32 g = 0; g < n_groups; g++)                                              \
+            {                                                                                 \
+                o_sums[g] += partials[t][g];                                                  \
+            }                                                                                 \
+            free(partials[t]);                                                                \
+        }                                                                                     \
+        free(partials);                                                                       \
+    }
+
+#endif
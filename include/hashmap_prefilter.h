@@ -0,0 +1,199 @@
+#ifndef HASHMAP_PREFILTER_H
+#define HASHMAP_PREFILTER_H
+
+#include "hashmap.h"
+
+// Filter bits per table bucket. With the table at most full this is at least 8 bits a key,
+// which with H_FILTER_PROBES bits a key lets through roughly 3% of misses.
+#define H_FILTER_BITS_PER_BUCKET 8
+#define H_FILTER_PROBES 3
+
+// A blocked Bloom filter where each block is one 64 bit word: a key sets H_FILTER_PROBES
+// bits of a single word, so a lookup costs one cache miss whatever the probe count.
+struct h_filter
+{
+    h_u64 *words;
+    h_u64 word_mask;
+};
+
+// Keys are filtered by the home bucket and rank tag the table already stores, not by their
+// hash, so the filter for a grown table is rebuilt from its buckets without rehashing keys
+static inline h_u64 h_filter_mix(h_u64 home, h_u32 tag)
+{
+    h_u64 x = (home ^ ((h_u64)tag << 40)) * 0xFF51AFD7ED558CCDull;
+    return x ^ (x >> 29);
+}
+
+static inline h_u64 h_filter_bits(h_u64 mix)
+{
+    h_u64 bits = 0;
+    for (h_u32 i = 0; i < H_FILTER_PROBES; i++)
+    {
+        bits |= 1ull << ((mix >> (6 * i)) & 63);
+    }
+    return bits;
+}
+
+static inline h_u64 *h_filter_word(h_filter *filter, h_u64 mix)
+{
+    return &filter->words[(mix >> (6 * H_FILTER_PROBES)) & filter->word_mask];
+}
+
+static inline void h_filter_add(h_filter *filter, h_u64 home, h_u32 tag)
+{
+    h_u64 mix = h_filter_mix(home, tag);
+    *h_filter_word(filter, mix) |= h_filter_bits(mix);
+}
+
+static inline h_bool h_filter_may_contain(h_filter *filter, h_u64 home, h_u32 tag)
+{
+    h_u64 mix = h_filter_mix(home, tag);
+    h_u64 bits = h_filter_bits(mix);
+    return (*h_filter_word(filter, mix) & bits) == bits;
+}
+
+// Empties the filter, resizing it for a table of n_buckets
+static void h_filter_reset(h_filter *filter, h_u64 n_buckets)
+{
+    h_u64 n_words = n_buckets * H_FILTER_BITS_PER_BUCKET / 64;
+    n_words = n_words ? n_words : 1;
+    if (filter->word_mask + 1 != n_words || !filter->words)
+    {
+        free(filter->words);
+        filter->words = (h_u64 *)counter_malloc(sizeof(h_u64) * n_words);
+        filter->word_mask = n_words - 1;
+    }
+    memset(filter->words, 0, sizeof(h_u64) * n_words);
+}
+
+// A HASHMAP_INIT map with a Bloom prefilter in front of its lookups, for workloads where
+// most lookups miss: a miss the filter rules out costs one word read instead of a walk of
+// up to max_psl buckets. The filter is updated on each put and rebuilt from the table after
+// any put or remove that resized or reseeded it. Removed keys stay in the filter, only
+// costing false positives, until as many keys have been removed as are left, when it is
+// rebuilt. Maps still holding their entries inline skip the filter.
+#define HASHMAP_PREFILTER(name)                                                                \
+    struct h_filtered_##name                                                                   \
+    {                                                                                          \
+        h_map_##name map;                                                                      \
+        h_filter filter;                                                                       \
+        h_u64 filter_buckets;                                                                  \
+        h_u64 filter_seed;                                                                     \
+        h_u64 removed;                                                                         \
+    };                                                                                         \
+                                                                                               \
+    /* Each full bucket's home is its index less its PSL, and its tag is the rest of its */    \
+    /* rank, so this is one pass over psls */                                                  \
+    static void rebuild_filter_##name(h_filtered_##name *filtered)                             \
+    {                                                                                          \
+        h_map_##name *map = &filtered->map;                                                    \
+        h_filter_reset(&filtered->filter, map->n_buckets);                                     \
+        h_u64 array_size = bucket_array_size(map->n_buckets);                                  \
+        for (h_u64 i = 0; i < array_size; i++)                                                 \
+        {                                                                                      \
+            if (map->fulls[i])                                                                 \
+            {                                                                                  \
+                h_u32 rank = map->psls[i];                                                     \
+                h_filter_add(&filtered->filter, i - h_rank_psl(rank), rank & H_RANK_TAG_MASK); \
+            }                                                                                  \
+        }                                                                                      \
+        filtered->filter_buckets = map->n_buckets;                                             \
+        filtered->filter_seed = map->seed;                                                     \
+        filtered->removed = 0;                                                                 \
+    }                                                                                          \
+                                                                                               \
+    /* Growing or reseeding the table moves every key's home */                                \
+    static inline h_bool filter_stale_##name(h_filtered_##name *filtered)                      \
+    {                                                                                          \
+        return filtered->map.n_buckets != filtered->filter_buckets ||                          \
+               filtered->map.seed != filtered->filter_seed;                                    \
+    }                                                                                          \
+                                                                                               \
+    static h_filtered_##name h_init_filtered_##name(h_u32 capacity = HASHMAP_INITIAL_CAPACITY) \
+    {                                                                                          \
+        h_filtered_##name ret = {};                                                            \
+        ret.map = h_init_##name(capacity);                                                     \
+        return ret;                                                                            \
+    }                                                                                          \
+                                                                                               \
+    static h_result h_put_##name(h_filtered_##name *filtered, h_key_type_##name key,           \
+                                 h_val_type_##name val)                                        \
+    {                                                                                          \
+        h_map_##name *map = &filtered->map;                                                    \
+        h_result res = NO_ERROR;                                                               \
+        if (is_inline_##name(map))                                                             \
+        {                                                                                      \
+            res = h_put_##name(map, std::move(key), std::move(val));                           \
+        }                                                                                      \
+        else                                                                                   \
+        {                                                                                      \
+            h_u64 hash = map->hash_func(&key);                                                 \
+            res = put_hashed_##name(map, hash, &key, &val);                                    \
+            if (res == NO_ERROR && !filter_stale_##name(filtered))                             \
+            {                                                                                  \
+                h_filter_add(&filtered->filter, index_from_hash_##name(map, hash),             \
+                             h_rank_tag(hash));                                                \
+            }                                                                                  \
+        }                                                                                      \
+        if (!is_inline_##name(map) && filter_stale_##name(filtered))                           \
+        {                                                                                      \
+            rebuild_filter_##name(filtered);                                                   \
+        }                                                                                      \
+        return res;                                                                            \
+    }                                                                                          \
+                                                                                               \
+    static h_result h_retrieve_##name(h_filtered_##name *filtered, h_key_type_##name key,      \
+                                      h_val_type_##name *o_val)                                \
+    {                                                                                          \
+        h_map_##name *map = &filtered->map;                                                    \
+        if (is_inline_##name(map))                                                             \
+        {                                                                                      \
+            return h_retrieve_##name(map, std::move(key), o_val);                              \
+        }                                                                                      \
+        h_u64 hash = map->hash_func(&key);                                                     \
+        h_u64 home = index_from_hash_##name(map, hash);                                        \
+        h_u32 tag = h_rank_tag(hash);                                                          \
+        if (!h_filter_may_contain(&filtered->filter, home, tag))                               \
+        {                                                                                      \
+            return EMPTY_BUCKET;                                                               \
+        }                                                                                      \
+        h_u64 index = 0;                                                                       \
+        h_result res = find_index_from_##name(map, home, tag, &key, map->equal_func, &index);  \
+        if (res == NO_ERROR && o_val)                                                          \
+        {                                                                                      \
+            *o_val = *val_at_##name(map, index);                                               \
+        }                                                                                      \
+        return res;                                                                            \
+    }                                                                                          \
+                                                                                               \
+    static h_result h_remove_##name(h_filtered_##name *filtered, h_key_type_##name key,        \
+                                    h_val_type_##name *o_val = 0)                              \
+    {                                                                                          \
+        h_map_##name *map = &filtered->map;                                                    \
+        h_result res = h_remove_##name(map, std::move(key), o_val);                            \
+        if (res != NO_ERROR)                                                                   \
+        {                                                                                      \
+            return res;                                                                        \
+        }                                                                                      \
+        if (is_inline_##name(map))                                                             \
+        {                                                                                      \
+            /* Keys put while inline never reach the filter, so promotion has to rebuild it */ \
+            filtered->filter_buckets = 0;                                                      \
+        }                                                                                      \
+        else if (filter_stale_##name(filtered) || ++filtered->removed > map->buckets_used)     \
+        {                                                                                      \
+            /* Shrinking through the low water mark moves every home, as growing does */       \
+            rebuild_filter_##name(filtered);                                                   \
+        }                                                                                      \
+        return res;                                                                            \
+    }                                                                                          \
+                                                                                               \
+    static inline h_bool h_free_##name(h_filtered_##name *filtered)                            \
+    {                                                                                          \
+        free(filtered->filter.words);                                                          \
+        filtered->filter = {};                                                                 \
+        filtered->filter_buckets = 0;                                                          \
+        return h_free_##name(&filtered->map);                                                  \
+    }
+
+#endif
@@ -0,0 +1,227 @@
+#ifndef HASHMAP_STREAM_H
+#define HASHMAP_STREAM_H
+
+#include "hashmap.h"
+#include <thread>
+
+#if defined(_MSC_VER)
+#include <xmmintrin.h>
+#define H_PREFETCH(ptr) _mm_prefetch((const char *)(ptr), _MM_HINT_T0)
+#else
+#define H_PREFETCH(ptr) __builtin_prefetch(ptr)
+#endif
+
+#define H_STREAM_CHUNK_SIZE (4 * 1024 * 1024)
+#define H_STREAM_MAX_RECORD (64 * 1024)
+#define H_STREAM_BATCH 32
+
+// Parses one line of a delimited text file (without its line ending) into a key and value.
+// Anything but NO_ERROR skips the line.
+#define HASH_RECORD_PARSER(name, key_type, val_type) \
+    h_result name(const char *line, h_u32 line_len, key_type *key, val_type *val)
+
+static inline h_u64 h_stream_file_size(FILE *file)
+{
+#if defined(_WIN32)
+    _fseeki64(file, 0, SEEK_END);
+    h_u64 size = (h_u64)_ftelli64(file);
+    _fseeki64(file, 0, SEEK_SET);
+#else
+    fseeko(file, 0, SEEK_END);
+    h_u64 size = (h_u64)ftello(file);
+    fseeko(file, 0, SEEK_SET);
+#endif
+    return size;
+}
+
+// Feeds a file through consume(data, len, last) in H_STREAM_CHUNK_SIZE chunks, using two
+// buffers so the next chunk is read on another thread while the current one is consumed.
+// consume returns how many bytes it used; the rest (a record split across chunks, at most
+// H_STREAM_MAX_RECORD bytes) is carried to the front of the next chunk. The final call has
+// last set and must use everything. Memory use is bounded by the two buffers whatever the
+// size of the file.
+template <typename F>
+static h_result h_stream_chunks(FILE *file, F consume)
+{
+    const h_u64 buffer_size = H_STREAM_MAX_RECORD + H_STREAM_CHUNK_SIZE;
+    char *buffers[2];
+    buffers[0] = (char *)counter_malloc(buffer_size);
+    buffers[1] = (char *)counter_malloc(buffer_size);
+
+    h_result ret = NO_ERROR;
+    h_u32 current = 0;
+    h_u64 carry = 0;
+    h_u64 n_read = fread(buffers[0] + H_STREAM_MAX_RECORD, 1, H_STREAM_CHUNK_SIZE, file);
+    for (;;)
+    {
+        h_u64 next_read = 0;
+        char *next = buffers[current ^ 1];
+        std::thread reader;
+        if (n_read)
+        {
+            reader = std::thread([&next_read, next, file]() {
+                next_read = fread(next + H_STREAM_MAX_RECORD, 1, H_STREAM_CHUNK_SIZE, file);
+            });
+        }
+
+        char *data = buffers[current] + H_STREAM_MAX_RECORD - carry;
+        h_u64 len = carry + n_read;
+        h_u64 used = consume(data, len, (h_bool)(n_read == 0));
+        carry = len - used;
+
+        if (reader.joinable())
+        {
+            reader.join();
+        }
+        if (!n_read)
+        {
+            break;
+        }
+        if (carry > H_STREAM_MAX_RECORD)
+        {
+            ret = UNKNOWN_ERROR;
+            break;
+        }
+        memcpy(next + H_STREAM_MAX_RECORD - carry, data + used, carry);
+        current ^= 1;
+        n_read = next_read;
+    }
+    free(buffers[0]);
+    free(buffers[1]);
+    return ret;
+}
+
+// Bulk loaders for a HASHMAP_INIT map. Both reserve the map up front where they can, then
+// parse a batch of records, hash the whole batch and prefetch every home bucket before
+// inserting, so the bucket misses of a batch overlap instead of being paid one at a time.
+// Existing keys are left as they are, as with h_put_*.
+#define HASHMAP_STREAM_LOADER(name)                                                            \
+    typedef HASH_RECORD_PARSER(h_record_parser_##name, h_key_type_##name, h_val_type_##name);  \
+                                                                                               \
+    static h_u64 insert_batch_##name(h_map_##name *map, h_key_type_##name *keys,               \
+                                     h_val_type_##name *vals, h_u32 count)                     \
+    {                                                                                          \
+        h_u64 inserted = 0;                                                                    \
+        if (is_inline_##name(map))                                                             \
+        {                                                                                      \
+            for (h_u32 i = 0; i < count; i++)                                                  \
+            {                                                                                  \
+                h_result res = h_put_##name(map, std::move(keys[i]), std::move(vals[i]));      \
+                inserted += res == NO_ERROR;                                                   \
+            }                                                                                  \
+            return inserted;                                                                   \
+        }                                                                                      \
+        h_u64 hashes[H_STREAM_BATCH];                                                          \
+        for (h_u32 i = 0; i < count; i++)                                                      \
+        {                                                                                      \
+            hashes[i] = map->hash_func(&keys[i]);                                              \
+            h_u64 index = index_from_hash_##name(map, hashes[i]);                              \
+            H_PREFETCH(&map->fulls[index]);                                                    \
+            H_PREFETCH(&map->keys[index]);                                                     \
+        }                                                                                      \
+        for (h_u32 i = 0; i < count; i++)                                                      \
+        {                                                                                      \
+            inserted += put_hashed_##name(map, hashes[i], &keys[i], &vals[i]) == NO_ERROR;     \
+        }                                                                                      \
+        return inserted;                                                                       \
+    }                                                                                          \
+                                                                                               \
+    /* Records are a key's bytes followed by its value's, with no padding or header. A */      \
+    /* template only so maps with non-trivial keys or values can still use the text loader. */ \
+    template <typename key_type = h_key_type_##name, typename val_type = h_val_type_##name>    \
+    static h_result h_load_binary_##name(h_map_##name *map, const char *path,                  \
+                                         h_u64 *o_loaded = 0)                                  \
+    {                                                                                          \
+        static_assert(std::is_trivially_copyable<key_type>::value &&                           \
+                          std::is_trivially_copyable<val_type>::value,                         \
+                      "binary records are raw key and value bytes");                           \
+        const h_u64 key_size = sizeof(key_type);                                               \
+        const h_u64 record_size = key_size + sizeof(val_type);                                 \
+        FILE *file = fopen(path, "rb");                                                        \
+        if (!file)                                                                             \
+        {                                                                                      \
+            return NULL_PTR;                                                                   \
+        }                                                                                      \
+        h_u64 n_records = h_stream_file_size(file) / record_size;                              \
+        h_reserve_##name(map, (h_u32)(map->buckets_used + n_records));                         \
+        h_u64 loaded = 0;                                                                      \
+        h_result res = h_stream_chunks(file, [&](const char *data, h_u64 len, h_bool last) {   \
+            h_key_type_##name keys[H_STREAM_BATCH];                                            \
+            h_val_type_##name vals[H_STREAM_BATCH];                                            \
+            h_u64 used = 0;                                                                    \
+            while (len - used >= record_size)                                                  \
+            {                                                                                  \
+                h_u32 count = 0;                                                               \
+                for (; count < H_STREAM_BATCH && len - used >= record_size; count++)           \
+                {                                                                              \
+                    memcpy(&keys[count], data + used, key_size);                               \
+                    memcpy(&vals[count], data + used + key_size, record_size - key_size);      \
+                    used += record_size;                                                       \
+                }                                                                              \
+                loaded += insert_batch_##name(map, keys, vals, count);                         \
+            }                                                                                  \
+            /* A trailing partial record can't be completed; drop it */                        \
+            return last ? len : used;                                                          \
+        });                                                                                    \
+        fclose(file);                                                                          \
+        if (o_loaded)                                                                          \
+        {                                                                                      \
+            *o_loaded = loaded;                                                                \
+        }                                                                                      \
+        return res;                                                                            \
+    }                                                                                          \
+                                                                                               \
+    /* One record per line, "\n" or "\r\n" terminated, split into key and value by parser. */  \
+    /* Text gives no record count, so pass expected_count to reserve up front. */              \
+    static h_result h_load_text_##name(h_map_##name *map, const char *path,                    \
+                                       h_record_parser_##name *parser, h_u64 *o_loaded = 0,    \
+                                       h_u32 expected_count = 0)                               \
+    {                                                                                          \
+        FILE *file = fopen(path, "rb");                                                        \
+        if (!file)                                                                             \
+        {                                                                                      \
+            return NULL_PTR;                                                                   \
+        }                                                                                      \
+        h_reserve_##name(map, map->buckets_used + expected_count);                             \
+        h_u64 loaded = 0;                                                                      \
+        h_result res = h_stream_chunks(file, [&](const char *data, h_u64 len, h_bool last) {   \
+            h_key_type_##name keys[H_STREAM_BATCH];                                            \
+            h_val_type_##name vals[H_STREAM_BATCH];                                            \
+            h_u32 count = 0;                                                                   \
+            h_u64 used = 0;                                                                    \
+            while (used < len)                                                                 \
+            {                                                                                  \
+                const char *line = data + used;                                                \
+                const char *end = (const char *)memchr(line, '\n', len - used);                \
+                if (!end && !last)                                                             \
+                {                                                                              \
+                    break;                                                                     \
+                }                                                                              \
+                h_u64 line_len = end ? (h_u64)(end - line) : len - used;                       \
+                used += line_len + (end ? 1 : 0);                                              \
+                if (line_len && line[line_len - 1] == '\r')                                    \
+                {                                                                              \
+                    line_len--;                                                                \
+                }                                                                              \
+                if (line_len && parser(line, (h_u32)line_len, &keys[count], &vals[count]) ==   \
+                                    NO_ERROR)                                                  \
+                {                                                                              \
+                    if (++count == H_STREAM_BATCH)                                             \
+                    {                                                                          \
+                        loaded += insert_batch_##name(map, keys, vals, count);                 \
+                        count = 0;                                                             \
+                    }                                                                          \
+                }                                                                              \
+            }                                                                                  \
+            loaded += insert_batch_##name(map, keys, vals, count);                             \
+            return used;                                                                       \
+        });                                                                                    \
+        fclose(file);                                                                          \
+        if (o_loaded)                                                                          \
+        {                                                                                      \
+            *o_loaded = loaded;                                                                \
+        }                                                                                      \
+        return res;                                                                            \
+    }
+
+#endif
@@ -0,0 +1,479 @@
+#ifndef HASHMAP_VERSIONED_H
+#define HASHMAP_VERSIONED_H
+
+#include "hashmap.h"
+#include <atomic>
+
+// Buckets per copy-on-write chunk. A write to a bucket shared with a snapshot copies the
+// chunk holding it, so this trades the cost of that copy against the size of the chunk
+// table a snapshot's first write has to copy.
+#define H_COW_CHUNK_SHIFT 6
+#define H_COW_CHUNK_BUCKETS (1u << H_COW_CHUNK_SHIFT)
+
+// Copy of the value in a bucket. Sets store no values, so there is nothing to read.
+template <typename T>
+static inline T h_val_copy(T *val)
+{
+    return *val;
+}
+
+static inline h_no_value h_val_copy(h_no_value *val)
+{
+    return h_no_value();
+}
+
+// Versioned HASHMAP_INIT maps. The bucket arrays of h_map_* are cut into chunks of
+// H_COW_CHUNK_BUCKETS buckets, each reference counted, behind a reference counted table of
+// chunk pointers. h_snapshot_* takes one reference on the table, so it is O(1) whatever
+// the size of the map. A put or remove on a version copies the table if another version
+// shares it, then copies each shared chunk it is about to modify; everything else stays
+// shared. Every version, the original included, can then be read and written as an
+// independent map.
+//
+// Only the thread writing a version may take snapshots of it, but once taken a snapshot
+// can be read (and freed) on any thread without locking: no version ever writes to a
+// chunk or table another version can see, so readers never block the writer or each
+// other.
+#define HASHMAP_VERSIONED(name)                                                                \
+    struct h_cow_chunk_##name                                                                  \
+    {                                                                                          \
+        std::atomic<h_u32> refs;                                                               \
+        h_bool fulls[H_COW_CHUNK_BUCKETS];                                                     \
+        h_u32 psls[H_COW_CHUNK_BUCKETS];                                                       \
+        h_inline_array<h_key_type_##name, H_COW_CHUNK_BUCKETS> keys;                           \
+        h_inline_array<h_val_type_##name, H_COW_CHUNK_BUCKETS> vals;                           \
+    };                                                                                         \
+                                                                                               \
+    /* Followed in the same allocation by n_chunks chunk pointers */                           \
+    struct h_cow_table_##name                                                                  \
+    {                                                                                          \
+        std::atomic<h_u32> refs;                                                               \
+        h_u32 n_chunks;                                                                        \
+    };                                                                                         \
+                                                                                               \
+    struct h_versioned_##name                                                                  \
+    {                                                                                          \
+        h_u32 n_buckets;                                                                       \
+        h_u32 max_psl;                                                                         \
+        h_u32 buckets_used;                                                                    \
+        /* As in HASHMAP_INIT: the size last reseeded at, and the seed (see h_seed_hash) */    \
+        h_u32 reseeded_size;                                                                   \
+        h_u64 seed;                                                                            \
+        h_hashfunc_##name *hash_func;                                                          \
+        h_equalfunc_##name *equal_func;                                                        \
+        h_cow_table_##name *table;                                                             \
+    };                                                                                         \
+                                                                                               \
+    static inline h_cow_chunk_##name **chunks_of_##name(h_cow_table_##name *table)             \
+    {                                                                                          \
+        return (h_cow_chunk_##name **)(table + 1);                                             \
+    }                                                                                          \
+                                                                                               \
+    static h_cow_chunk_##name *new_chunk_##name()                                              \
+    {                                                                                          \
+        void *memory = counter_malloc(sizeof(h_cow_chunk_##name));                             \
+        h_cow_chunk_##name *chunk = new (memory) h_cow_chunk_##name;                           \
+        chunk->refs.store(1, std::memory_order_relaxed);                                       \
+        memset(chunk->fulls, 0, sizeof(chunk->fulls));                                         \
+        return chunk;                                                                          \
+    }                                                                                          \
+                                                                                               \
+    static h_cow_table_##name *new_table_##name(h_u32 n_chunks)                                \
+    {                                                                                          \
+        h_u64 size = sizeof(h_cow_table_##name) + sizeof(h_cow_chunk_##name *) * n_chunks;     \
+        h_cow_table_##name *table = new (counter_malloc(size)) h_cow_table_##name;             \
+        table->refs.store(1, std::memory_order_relaxed);                                       \
+        table->n_chunks = n_chunks;                                                            \
+        return table;                                                                          \
+    }                                                                                          \
+                                                                                               \
+    /* The last reference to go destroys the entries; acq_rel so that every read made */       \
+    /* through the other references happens before that. */                                    \
+    static void release_chunk_##name(h_cow_chunk_##name *chunk)                                \
+    {                                                                                          \
+        if (chunk->refs.fetch_sub(1, std::memory_order_acq_rel) != 1)                          \
+        {                                                                                      \
+            return;                                                                            \
+        }                                                                                      \
+        for (h_u32 i = 0; i < H_COW_CHUNK_BUCKETS; i++)                                        \
+        {                                                                                      \
+            if (chunk->fulls[i])                                                               \
+            {                                                                                  \
+                h_destroy(&chunk->keys.get()[i]);                                              \
+                h_destroy(h_val_slot(chunk->vals.get(), i));                                   \
+            }                                                                                  \
+        }                                                                                      \
+        chunk->~h_cow_chunk_##name();                                                          \
+        free(chunk);                                                                           \
+    }                                                                                          \
+                                                                                               \
+    static void release_table_##name(h_cow_table_##name *table)                                \
+    {                                                                                          \
+        if (table->refs.fetch_sub(1, std::memory_order_acq_rel) != 1)                          \
+        {                                                                                      \
+            return;                                                                            \
+        }                                                                                      \
+        h_cow_chunk_##name **chunks = chunks_of_##name(table);                                 \
+        for (h_u32 i = 0; i < table->n_chunks; i++)                                            \
+        {                                                                                      \
+            release_chunk_##name(chunks[i]);                                                   \
+        }                                                                                      \
+        table->~h_cow_table_##name();                                                          \
+        free(table);                                                                           \
+    }                                                                                          \
+                                                                                               \
+    static inline h_cow_chunk_##name *chunk_at_##name(h_versioned_##name *map, h_u64 index)    \
+    {                                                                                          \
+        return chunks_of_##name(map->table)[index >> H_COW_CHUNK_SHIFT];                       \
+    }                                                                                          \
+                                                                                               \
+    /* The chunk holding index, copied first if any other version can see it. A count of */    \
+    /* one can't go back up behind our back, as only this version's writer hands out */        \
+    /* references to what it holds. */                                                         \
+    static h_cow_chunk_##name *writable_chunk_##name(h_versioned_##name *map, h_u64 index)     \
+    {                                                                                          \
+        if (map->table->refs.load(std::memory_order_acquire) != 1)                             \
+        {                                                                                      \
+            h_cow_table_##name *table = new_table_##name(map->table->n_chunks);                \
+            h_cow_chunk_##name **chunks = chunks_of_##name(table);                             \
+            for (h_u32 i = 0; i < table->n_chunks; i++)                                        \
+            {                                                                                  \
+                chunks[i] = chunks_of_##name(map->table)[i];                                   \
+                chunks[i]->refs.fetch_add(1, std::memory_order_relaxed);                       \
+            }                                                                                  \
+            release_table_##name(map->table);                                                  \
+            map->table = table;                                                                \
+        }                                                                                      \
+        h_cow_chunk_##name **slot = &chunks_of_##name(map->table)[index >> H_COW_CHUNK_SHIFT]; \
+        h_cow_chunk_##name *shared = *slot;                                                    \
+        if (shared->refs.load(std::memory_order_acquire) == 1)                                 \
+        {                                                                                      \
+            return shared;                                                                     \
+        }                                                                                      \
+        h_cow_chunk_##name *chunk = new_chunk_##name();                                        \
+        for (h_u32 i = 0; i < H_COW_CHUNK_BUCKETS; i++)                                        \
+        {                                                                                      \
+            if (shared->fulls[i])                                                              \
+            {                                                                                  \
+                chunk->fulls[i] = H_TRUE;                                                      \
+                chunk->psls[i] = shared->psls[i];                                              \
+                h_copy_construct(&chunk->keys.get()[i], &shared->keys.get()[i]);               \
+                h_copy_construct(h_val_slot(chunk->vals.get(), i),                             \
+                                 h_val_slot(shared->vals.get(), i));                           \
+            }                                                                                  \
+        }                                                                                      \
+        release_chunk_##name(shared);                                                          \
+        *slot = chunk;                                                                         \
+        return chunk;                                                                          \
+    }                                                                                          \
+                                                                                               \
+    static h_versioned_##name                                                                  \
+    h_init_versioned_##name(h_u32 capacity = HASHMAP_INITIAL_CAPACITY)                         \
+    {                                                                                          \
+        h_map_##name shape = h_init_##name(capacity);                                          \
+        h_versioned_##name ret = {};                                                           \
+        ret.n_buckets = shape.n_buckets;                                                       \
+        ret.max_psl = shape.max_psl;                                                           \
+        ret.seed = shape.seed;                                                                 \
+        ret.hash_func = shape.hash_func;                                                       \
+        ret.equal_func = shape.equal_func;                                                     \
+        h_u32 array_size = bucket_array_size(ret.n_buckets);                                   \
+        h_u32 n_chunks = (array_size + H_COW_CHUNK_BUCKETS - 1) >> H_COW_CHUNK_SHIFT;          \
+        ret.table = new_table_##name(n_chunks);                                                \
+        for (h_u32 i = 0; i < n_chunks; i++)                                                   \
+        {                                                                                      \
+            chunks_of_##name(ret.table)[i] = new_chunk_##name();                               \
+        }                                                                                      \
+        return ret;                                                                            \
+    }                                                                                          \
+                                                                                               \
+    /* O(1): the snapshot shares every chunk until one side writes to it */                    \
+    static inline h_versioned_##name h_snapshot_##name(h_versioned_##name *map)                \
+    {                                                                                          \
+        map->table->refs.fetch_add(1, std::memory_order_relaxed);                              \
+        return *map;                                                                           \
+    }                                                                                          \
+                                                                                               \
+    static h_result find_versioned_index_##name(h_versioned_##name *map, h_u64 hash,           \
+                                               h_key_type_##name *key, h_u64 *o_index)         \
+    {                                                                                          \
+        h_u64 index = h_seed_hash(hash, map->seed) & (map->n_buckets - 1);                     \
+        h_u32 rank = h_rank_tag(hash);                                                         \
+        for (; h_rank_psl(rank) < map->max_psl; index++, rank += H_RANK_PSL_ONE)               \
+        {                                                                                      \
+            h_cow_chunk_##name *chunk = chunk_at_##name(map, index);                           \
+            h_u32 slot = index & (H_COW_CHUNK_BUCKETS - 1);                                    \
+            if (!chunk->fulls[slot] || chunk->psls[slot] < rank)                               \
+            {                                                                                  \
+                break;                                                                         \
+            }                                                                                  \
+            if (chunk->psls[slot] == rank && map->equal_func(&chunk->keys.get()[slot], key))   \
+            {                                                                                  \
+                *o_index = index;                                                              \
+                return NO_ERROR;                                                               \
+            }                                                                                  \
+        }                                                                                      \
+        return EMPTY_BUCKET;                                                                   \
+    }                                                                                          \
+                                                                                               \
+    static h_result h_retrieve_##name(h_versioned_##name *map, h_key_type_##name key,          \
+                                      h_val_type_##name *o_val)                                \
+    {                                                                                          \
+        h_u64 index = 0;                                                                       \
+        h_result res = find_versioned_index_##name(map, map->hash_func(&key), &key, &index);   \
+        if (res == NO_ERROR && o_val)                                                          \
+        {                                                                                      \
+            h_cow_chunk_##name *chunk = chunk_at_##name(map, index);                           \
+            h_u32 slot = index & (H_COW_CHUNK_BUCKETS - 1);                                    \
+            *o_val = h_val_copy(h_val_slot(chunk->vals.get(), slot));                          \
+        }                                                                                      \
+        return res;                                                                            \
+    }                                                                                          \
+                                                                                               \
+    /* Whether place_versioned_* can insert key without anything reaching max_psl. It */       \
+    /* walks the same swaps without making them: SAME_KEY if key is already there, */          \
+    /* MAP_FULL if the entry in hand would reach max_psl, NO_ERROR if it fits. */              \
+    static h_result check_place_versioned_##name(h_versioned_##name *map, h_u64 hash,          \
+                                                 h_key_type_##name *key)                       \
+    {                                                                                          \
+        h_u64 index = h_seed_hash(hash, map->seed) & (map->n_buckets - 1);                     \
+        h_u32 rank = h_rank_tag(hash);                                                         \
+        h_bool swapped = H_FALSE;                                                              \
+        for (; h_rank_psl(rank) < map->max_psl; index++, rank += H_RANK_PSL_ONE)               \
+        {                                                                                      \
+            h_cow_chunk_##name *chunk = chunk_at_##name(map, index);                           \
+            h_u32 slot = index & (H_COW_CHUNK_BUCKETS - 1);                                    \
+            if (!chunk->fulls[slot])                                                           \
+            {                                                                                  \
+                return NO_ERROR;                                                               \
+            }                                                                                  \
+            h_u32 resident_rank = chunk->psls[slot];                                           \
+            if (!swapped && resident_rank == rank &&                                           \
+                map->equal_func(&chunk->keys.get()[slot], key))                                \
+            {                                                                                  \
+                return SAME_KEY;                                                               \
+            }                                                                                  \
+            if (resident_rank < rank)                                                          \
+            {                                                                                  \
+                rank = resident_rank;                                                          \
+                swapped = H_TRUE;                                                              \
+            }                                                                                  \
+        }                                                                                      \
+        return MAP_FULL;                                                                       \
+    }                                                                                          \
+                                                                                               \
+    /* Robin Hood insert, as probe_* does it on a flat table, of a key that */                 \
+    /* check_place_versioned_* has said fits */                                                \
+    static void place_versioned_##name(h_versioned_##name *map, h_u64 hash,                    \
+                                       h_key_type_##name *key, h_val_type_##name *val)         \
+    {                                                                                          \
+        h_u64 index = h_seed_hash(hash, map->seed) & (map->n_buckets - 1);                     \
+        h_u32 rank = h_rank_tag(hash);                                                         \
+        for (;; index++, rank += H_RANK_PSL_ONE)                                               \
+        {                                                                                      \
+            h_cow_chunk_##name *chunk = chunk_at_##name(map, index);                           \
+            h_u32 slot = index & (H_COW_CHUNK_BUCKETS - 1);                                    \
+            if (!chunk->fulls[slot])                                                           \
+            {                                                                                  \
+                chunk = writable_chunk_##name(map, index);                                     \
+                h_move_construct(&chunk->keys.get()[slot], key);                               \
+                h_move_construct(h_val_slot(chunk->vals.get(), slot), val);                    \
+                chunk->fulls[slot] = H_TRUE;                                                   \
+                chunk->psls[slot] = rank;                                                      \
+                map->buckets_used++;                                                           \
+                return;                                                                        \
+            }                                                                                  \
+            h_u32 resident_rank = chunk->psls[slot];                                           \
+            if (resident_rank < rank)                                                          \
+            {                                                                                  \
+                chunk = writable_chunk_##name(map, index);                                     \
+                h_swap(&chunk->keys.get()[slot], key);                                         \
+                h_swap(h_val_slot(chunk->vals.get(), slot), val);                              \
+                chunk->psls[slot] = rank;                                                      \
+                rank = resident_rank;                                                          \
+            }                                                                                  \
+        }                                                                                      \
+    }                                                                                          \
+                                                                                               \
+    /* Rebuilds this version alone at new_n_buckets under its current seed; other */           \
+    /* versions keep the old chunks. Entries are copied, not moved, so if one doesn't */       \
+    /* fit this returns MAP_FULL with the version as it was. */                                \
+    static h_result rehash_versioned_##name(h_versioned_##name *map, h_u32 new_n_buckets)      \
+    {                                                                                          \
+        h_versioned_##name next = h_init_versioned_##name(new_n_buckets);                      \
+        next.seed = map->seed;                                                                 \
+        next.reseeded_size = map->reseeded_size;                                               \
+        h_u32 array_size = bucket_array_size(map->n_buckets);                                  \
+        for (h_u32 i = 0; i < array_size; i++)                                                 \
+        {                                                                                      \
+            h_cow_chunk_##name *chunk = chunk_at_##name(map, i);                               \
+            h_u32 slot = i & (H_COW_CHUNK_BUCKETS - 1);                                        \
+            if (!chunk->fulls[slot])                                                           \
+            {                                                                                  \
+                continue;                                                                      \
+            }                                                                                  \
+            h_key_type_##name key = chunk->keys.get()[slot];                                   \
+            h_u64 hash = map->hash_func(&key);                                                 \
+            if (check_place_versioned_##name(&next, hash, &key) != NO_ERROR)                   \
+            {                                                                                  \
+                release_table_##name(next.table);                                              \
+                return MAP_FULL;                                                               \
+            }                                                                                  \
+            h_val_type_##name val = h_val_copy(h_val_slot(chunk->vals.get(), slot));           \
+            place_versioned_##name(&next, hash, &key, &val);                                   \
+        }                                                                                      \
+        release_table_##name(map->table);                                                      \
+        *map = next;                                                                           \
+        return NO_ERROR;                                                                       \
+    }                                                                                          \
+                                                                                               \
+    static inline h_bool is_sparse_versioned_##name(h_versioned_##name *map)                   \
+    {                                                                                          \
+        return map->n_buckets >= HASHMAP_RESEED_MIN_BUCKETS &&                                 \
+               (h_u64)map->buckets_used * 100 <                                                \
+                   (h_u64)map->n_buckets * HASHMAP_RESEED_LOAD_PCT;                            \
+    }                                                                                          \
+                                                                                               \
+    /* As make_room_* in HASHMAP_INIT: a sparse version is reseeded once per size, any */      \
+    /* other doubles, and a sparse version already reseeded at this size gets MAP_FULL. */     \
+    static h_result make_room_versioned_##name(h_versioned_##name *map)                        \
+    {                                                                                          \
+        if (!is_sparse_versioned_##name(map))                                                  \
+        {                                                                                      \
+            return rehash_versioned_##name(map, map->n_buckets * 2);                           \
+        }                                                                                      \
+        if (map->reseeded_size == map->n_buckets)                                              \
+        {                                                                                      \
+            return MAP_FULL;                                                                   \
+        }                                                                                      \
+        h_u64 prev_seed = map->seed;                                                           \
+        map->seed = h_random_seed();                                                           \
+        map->reseeded_size = map->n_buckets;                                                   \
+        h_result res = rehash_versioned_##name(map, map->n_buckets);                           \
+        if (res != NO_ERROR)                                                                   \
+        {                                                                                      \
+            map->seed = prev_seed;                                                             \
+        }                                                                                      \
+        return res;                                                                            \
+    }                                                                                          \
+                                                                                               \
+    /* The fit is checked before anything moves, and make_room_versioned_* runs at most */     \
+    /* once, so MAP_FULL leaves the version as it was. */                                      \
+    static h_result h_put_##name(h_versioned_##name *map, h_key_type_##name key,               \
+                                 h_val_type_##name val)                                        \
+    {                                                                                          \
+        if (map->buckets_used >= map->n_buckets)                                               \
+        {                                                                                      \
+            h_result res = rehash_versioned_##name(map, map->n_buckets * 2);                   \
+            if (res != NO_ERROR)                                                               \
+            {                                                                                  \
+                return res;                                                                    \
+            }                                                                                  \
+        }                                                                                      \
+        h_u64 hash = map->hash_func(&key);                                                     \
+        h_result res = check_place_versioned_##name(map, hash, &key);                          \
+        if (res == MAP_FULL)                                                                   \
+        {                                                                                      \
+            res = make_room_versioned_##name(map);                                             \
+            if (res != NO_ERROR)                                                               \
+            {                                                                                  \
+                return res;                                                                    \
+            }                                                                                  \
+            res = check_place_versioned_##name(map, hash, &key);                               \
+        }                                                                                      \
+        if (res != NO_ERROR)                                                                   \
+        {                                                                                      \
+            return res;                                                                        \
+        }                                                                                      \
+        place_versioned_##name(map, hash, &key, &val);                                         \
+        return NO_ERROR;                                                                       \
+    }                                                                                          \
+                                                                                               \
+    /* Backward-shift deletion, copying each chunk the shift writes to if it is shared */      \
+    static h_result h_remove_##name(h_versioned_##name *map, h_key_type_##name key,            \
+                                    h_val_type_##name *o_val = 0)                              \
+    {                                                                                          \
+        h_u64 index = 0;                                                                       \
+        h_result res = find_versioned_index_##name(map, map->hash_func(&key), &key, &index);   \
+        if (res != NO_ERROR)                                                                   \
+        {                                                                                      \
+            return res;                                                                        \
+        }                                                                                      \
+        const h_u32 mask = H_COW_CHUNK_BUCKETS - 1;                                            \
+        h_cow_chunk_##name *chunk = writable_chunk_##name(map, index);                         \
+        if (o_val)                                                                             \
+        {                                                                                      \
+            *o_val = std::move(*h_val_slot(chunk->vals.get(), index & mask));                  \
+        }                                                                                      \
+        h_destroy(&chunk->keys.get()[index & mask]);                                           \
+        h_destroy(h_val_slot(chunk->vals.get(), index & mask));                                \
+        h_u64 array_size = bucket_array_size(map->n_buckets);                                  \
+        for (; index + 1 < array_size; index++)                                                \
+        {                                                                                      \
+            h_cow_chunk_##name *next = chunk_at_##name(map, index + 1);                        \
+            h_u32 next_slot = (index + 1) & mask;                                              \
+            if (!next->fulls[next_slot] || h_rank_psl(next->psls[next_slot]) == 0)             \
+            {                                                                                  \
+                break;                                                                         \
+            }                                                                                  \
+            next = writable_chunk_##name(map, index + 1);                                      \
+            chunk = writable_chunk_##name(map, index);                                         \
+            chunk->psls[index & mask] = next->psls[next_slot] - H_RANK_PSL_ONE;                \
+            h_relocate(&chunk->keys.get()[index & mask], &next->keys.get()[next_slot]);        \
+            h_relocate(h_val_slot(chunk->vals.get(), index & mask),                            \
+                       h_val_slot(next->vals.get(), next_slot));                               \
+        }                                                                                      \
+        chunk = writable_chunk_##name(map, index);                                             \
+        chunk->fulls[index & mask] = 0;                                                        \
+        chunk->psls[index & mask] = 0;                                                         \
+        map->buckets_used--;                                                                   \
+        return NO_ERROR;                                                                       \
+    }                                                                                          \
+                                                                                               \
+    /* Copies map's buckets chunk by chunk into a new versioned map of the same size and */    \
+    /* seed; the layout is the same, so nothing is rehashed. */                                \
+    static h_versioned_##name h_versioned_from_##name(h_map_##name *map)                       \
+    {                                                                                          \
+        if (is_inline_##name(map))                                                             \
+        {                                                                                      \
+            h_versioned_##name ret = h_init_versioned_##name(map->n_buckets);                  \
+            h_key_type_##name *keys = map->inline_keys.get();                                  \
+            for (h_u32 i = 0; i < map->buckets_used; i++)                                      \
+            {                                                                                  \
+                h_put_##name(&ret, keys[i], *val_at_##name(map, i));                           \
+            }                                                                                  \
+            return ret;                                                                        \
+        }                                                                                      \
+        h_versioned_##name ret = h_init_versioned_##name(map->n_buckets);                      \
+        ret.seed = map->seed;                                                                  \
+        h_u32 array_size = bucket_array_size(map->n_buckets);                                  \
+        for (h_u32 i = 0; i < array_size; i++)                                                 \
+        {                                                                                      \
+            if (map->fulls[i])                                                                 \
+            {                                                                                  \
+                h_cow_chunk_##name *chunk = chunk_at_##name(&ret, i);                          \
+                h_u32 slot = i & (H_COW_CHUNK_BUCKETS - 1);                                    \
+                chunk->fulls[slot] = H_TRUE;                                                   \
+                chunk->psls[slot] = map->psls[i];                                              \
+                h_copy_construct(&chunk->keys.get()[slot], &map->keys[i]);                     \
+                h_copy_construct(h_val_slot(chunk->vals.get(), slot),                          \
+                                 h_val_slot(map->vals, i));                                    \
+            }                                                                                  \
+        }                                                                                      \
+        ret.buckets_used = map->buckets_used;                                                  \
+        return ret;                                                                            \
+    }                                                                                          \
+                                                                                               \
+    /* Drops this version's references; chunks still shared with other versions live on */     \
+    static inline h_bool h_free_##name(h_versioned_##name *map)                                \
+    {                                                                                          \
+        if (map->table)                                                                        \
+        {                                                                                      \
+            release_table_##name(map->table);                                                  \
+            map->table = NULL;                                                                 \
+        }                                                                                      \
+        map->buckets_used = 0;                                                                 \
+        return H_SUCCESS;                                                                      \
+    }
+
+#endif
@@ -0,0 +1,379 @@
+#ifndef HASHMAP_WAL_H
+#define HASHMAP_WAL_H
+
+#include "hashmap.h"
+
+#if defined(_WIN32)
+#include <io.h>
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#define h_wal_fsync(file) _commit(_fileno(file))
+#else
+#include <unistd.h>
+#define h_wal_fsync(file) fsync(fileno(file))
+#endif
+
+#define H_WAL_PUT 1
+#define H_WAL_REMOVE 2
+#define H_WAL_DEFAULT_GROUP_SIZE 256
+
+// Log records are { u8 op, key, val (puts only), u32 checksum }, with keys and values
+// written as raw bytes. The checksum covers everything before it, so recovery can tell a
+// torn final record (a crash mid-write) from the end of the log.
+static inline h_u32 h_wal_checksum(const unsigned char *bytes, h_u64 len)
+{
+    h_u32 hash = 2166136261u;
+    for (h_u64 i = 0; i < len; i++)
+    {
+        hash = (hash ^ bytes[i]) * 16777619u;
+    }
+    return hash;
+}
+
+// Cuts the file at path down to size bytes; 0 on success
+static inline int h_wal_truncate(const char *path, h_u64 size)
+{
+#if defined(_WIN32)
+    FILE *file = fopen(path, "r+b");
+    if (!file)
+    {
+        return -1;
+    }
+    int ret = _chsize_s(_fileno(file), (__int64)size);
+    fclose(file);
+    return ret;
+#else
+    return truncate(path, (off_t)size);
+#endif
+}
+
+// Moves from over to, replacing to in one step, so either file is whole at every point
+static inline int h_wal_replace(const char *from, const char *to)
+{
+#if defined(_WIN32)
+    return MoveFileExA(from, to, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) ? 0 : -1;
+#else
+    return rename(from, to);
+#endif
+}
+
+// Write-ahead log around a HASHMAP_INIT map with trivially copyable keys and values.
+// Mutations made through h_wal_put_* / h_wal_remove_* are applied to the map straight away
+// and their records are buffered; a group of group_size records shares one write and one
+// fsync. An operation is durable once h_wal_commit_* has returned (or the group it was in
+// filled up), so callers acknowledge writes after committing rather than per operation.
+#define HASHMAP_WAL(name)                                                                     \
+    static_assert(std::is_trivially_copyable<h_key_type_##name>::value &&                     \
+                      std::is_trivially_copyable<h_val_type_##name>::value,                   \
+                  "WAL records store keys and values as raw bytes");                          \
+    static_assert(H_STORES_VALUES(h_val_type_##name), "WAL records always carry a value");    \
+                                                                                              \
+    static const h_u32 h_wal_put_size_##name =                                                \
+        1 + sizeof(h_key_type_##name) + sizeof(h_val_type_##name) + sizeof(h_u32);            \
+    static const h_u32 h_wal_remove_size_##name =                                             \
+        1 + sizeof(h_key_type_##name) + sizeof(h_u32);                                        \
+                                                                                              \
+    struct h_wal_##name                                                                       \
+    {                                                                                         \
+        h_map_##name *map;                                                                    \
+        FILE *file;                                                                           \
+        char *path;                                                                           \
+        unsigned char *buffer;                                                                \
+        h_u32 buffer_used;                                                                    \
+        h_u32 pending;                                                                        \
+        h_u32 group_size;                                                                     \
+    };                                                                                        \
+                                                                                              \
+    /* Appends to the log at path, creating it if needed. Recover into map first. If the */   \
+    /* log can't be opened or its buffers allocated, the log returned has no file and */      \
+    /* every operation on it returns NULL_PTR. */                                             \
+    static h_wal_##name h_wal_open_##name(h_map_##name *map, const char *path,                \
+                                          h_u32 group_size = H_WAL_DEFAULT_GROUP_SIZE)        \
+    {                                                                                         \
+        h_wal_##name ret = {};                                                                \
+        ret.map = map;                                                                        \
+        ret.group_size = group_size ? group_size : 1;                                         \
+        ret.file = fopen(path, "ab");                                                         \
+        ret.path = (char *)malloc(strlen(path) + 1);                                          \
+        ret.buffer = (unsigned char *)malloc((h_u64)h_wal_put_size_##name * ret.group_size);  \
+        if (!ret.file || !ret.path || !ret.buffer)                                            \
+        {                                                                                     \
+            if (ret.file)                                                                     \
+            {                                                                                 \
+                fclose(ret.file);                                                             \
+            }                                                                                 \
+            free(ret.path);                                                                   \
+            free(ret.buffer);                                                                 \
+            ret.file = NULL;                                                                  \
+            ret.path = NULL;                                                                  \
+            ret.buffer = NULL;                                                                \
+            return ret;                                                                       \
+        }                                                                                     \
+        strcpy(ret.path, path);                                                               \
+        return ret;                                                                           \
+    }                                                                                         \
+                                                                                              \
+    /* Writes and fsyncs every buffered record. */                                            \
+    static h_result h_wal_commit_##name(h_wal_##name *wal)                                    \
+    {                                                                                         \
+        if (!wal->file)                                                                       \
+        {                                                                                     \
+            return NULL_PTR;                                                                  \
+        }                                                                                     \
+        if (!wal->pending)                                                                    \
+        {                                                                                     \
+            return NO_ERROR;                                                                  \
+        }                                                                                     \
+        if (fwrite(wal->buffer, 1, wal->buffer_used, wal->file) != wal->buffer_used ||        \
+            fflush(wal->file) != 0 || h_wal_fsync(wal->file) != 0)                            \
+        {                                                                                     \
+            return UNKNOWN_ERROR;                                                             \
+        }                                                                                     \
+        wal->buffer_used = 0;                                                                 \
+        wal->pending = 0;                                                                     \
+        return NO_ERROR;                                                                      \
+    }                                                                                         \
+                                                                                              \
+    static h_result append_record_##name(h_wal_##name *wal, unsigned char op,                 \
+                                         h_key_type_##name *key, h_val_type_##name *val)      \
+    {                                                                                         \
+        if (!wal->file)                                                                       \
+        {                                                                                     \
+            return NULL_PTR;                                                                  \
+        }                                                                                     \
+        if (wal->pending >= wal->group_size)                                                  \
+        {                                                                                     \
+            /* The last group failed to commit; retry before buffering any more */            \
+            h_result res = h_wal_commit_##name(wal);                                          \
+            if (res != NO_ERROR)                                                              \
+            {                                                                                 \
+                return res;                                                                   \
+            }                                                                                 \
+        }                                                                                     \
+        unsigned char *record = wal->buffer + wal->buffer_used;                               \
+        h_u32 size = 1 + sizeof(h_key_type_##name);                                           \
+        record[0] = op;                                                                       \
+        memcpy(record + 1, key, sizeof(h_key_type_##name));                                   \
+        if (val)                                                                              \
+        {                                                                                     \
+            memcpy(record + size, val, sizeof(h_val_type_##name));                            \
+            size += sizeof(h_val_type_##name);                                                \
+        }                                                                                     \
+        h_u32 checksum = h_wal_checksum(record, size);                                        \
+        memcpy(record + size, &checksum, sizeof(h_u32));                                      \
+        wal->buffer_used += size + sizeof(h_u32);                                             \
+        if (++wal->pending >= wal->group_size)                                                \
+        {                                                                                     \
+            return h_wal_commit_##name(wal);                                                  \
+        }                                                                                     \
+        return NO_ERROR;                                                                      \
+    }                                                                                         \
+                                                                                              \
+    /* Same results as h_put_*; only puts that changed the map are logged. */                 \
+    static h_result h_wal_put_##name(h_wal_##name *wal, h_key_type_##name key,                \
+                                     h_val_type_##name val)                                   \
+    {                                                                                         \
+        h_result res = h_put_##name(wal->map, key, val);                                      \
+        if (res != NO_ERROR)                                                                  \
+        {                                                                                     \
+            return res;                                                                       \
+        }                                                                                     \
+        return append_record_##name(wal, H_WAL_PUT, &key, &val);                              \
+    }                                                                                         \
+                                                                                              \
+    static h_result h_wal_remove_##name(h_wal_##name *wal, h_key_type_##name key)             \
+    {                                                                                         \
+        h_result res = h_remove_##name(wal->map, key);                                        \
+        if (res != NO_ERROR)                                                                  \
+        {                                                                                     \
+            return res;                                                                       \
+        }                                                                                     \
+        return append_record_##name(wal, H_WAL_REMOVE, &key, NULL);                           \
+    }                                                                                         \
+                                                                                              \
+    /* Replaces the log with one put per live entry, written to a temporary file that is */   \
+    /* synced and then renamed over the log. The old log is never removed first, so a */      \
+    /* crash or a failed rename leaves one log or the other intact at path. */                \
+    static h_result h_wal_checkpoint_##name(h_wal_##name *wal)                                \
+    {                                                                                         \
+        h_result res = h_wal_commit_##name(wal);                                              \
+        if (res != NO_ERROR)                                                                  \
+        {                                                                                     \
+            return res;                                                                       \
+        }                                                                                     \
+        h_u64 path_len = strlen(wal->path);                                                   \
+        char *temp_path = (char *)malloc(path_len + 5);                                       \
+        if (!temp_path)                                                                       \
+        {                                                                                     \
+            return MAP_FULL;                                                                  \
+        }                                                                                     \
+        memcpy(temp_path, wal->path, path_len);                                               \
+        memcpy(temp_path + path_len, ".tmp", 5);                                              \
+        FILE *main_file = wal->file;                                                          \
+        wal->file = fopen(temp_path, "wb");                                                   \
+        if (!wal->file)                                                                       \
+        {                                                                                     \
+            wal->file = main_file;                                                            \
+            free(temp_path);                                                                  \
+            return NULL_PTR;                                                                  \
+        }                                                                                     \
+        h_map_##name *map = wal->map;                                                         \
+        h_u32 array_size = map->fulls ? bucket_array_size(map->n_buckets) : 0;                \
+        for (h_u32 i = 0; i < array_size && res == NO_ERROR; i++)                             \
+        {                                                                                     \
+            if (map->fulls[i])                                                                \
+            {                                                                                 \
+                res = append_record_##name(wal, H_WAL_PUT, &map->keys[i],                     \
+                                           val_at_##name(map, i));                            \
+            }                                                                                 \
+        }                                                                                     \
+        if (is_inline_##name(map))                                                            \
+        {                                                                                     \
+            for (h_u32 i = 0; i < map->buckets_used && res == NO_ERROR; i++)                  \
+            {                                                                                 \
+                res = append_record_##name(wal, H_WAL_PUT, &map->inline_keys.get()[i],        \
+                                           val_at_##name(map, i));                            \
+            }                                                                                 \
+        }                                                                                     \
+        if (res == NO_ERROR)                                                                  \
+        {                                                                                     \
+            res = h_wal_commit_##name(wal);                                                   \
+        }                                                                                     \
+        /* An empty map commits nothing, so sync here too */                                  \
+        if (res == NO_ERROR && (fflush(wal->file) != 0 || h_wal_fsync(wal->file) != 0))       \
+        {                                                                                     \
+            res = UNKNOWN_ERROR;                                                              \
+        }                                                                                     \
+        fclose(wal->file);                                                                    \
+        fclose(main_file);                                                                    \
+        if (res == NO_ERROR && h_wal_replace(temp_path, wal->path) != 0)                      \
+        {                                                                                     \
+            res = UNKNOWN_ERROR;                                                              \
+        }                                                                                     \
+        if (res != NO_ERROR)                                                                  \
+        {                                                                                     \
+            remove(temp_path);                                                                \
+        }                                                                                     \
+        free(temp_path);                                                                      \
+        wal->file = fopen(wal->path, "ab");                                                   \
+        return res;                                                                           \
+    }                                                                                         \
+                                                                                              \
+    /* Commits anything still buffered and closes the log. The map is left alone. */          \
+    static h_result h_wal_close_##name(h_wal_##name *wal)                                     \
+    {                                                                                         \
+        h_result res = h_wal_commit_##name(wal);                                              \
+        if (wal->file)                                                                        \
+        {                                                                                     \
+            fclose(wal->file);                                                                \
+        }                                                                                     \
+        free(wal->buffer);                                                                    \
+        free(wal->path);                                                                      \
+        *wal = {};                                                                            \
+        return res;                                                                           \
+    }                                                                                         \
+                                                                                              \
+    /* Replays the log at path into map. The whole file is read in one go and the map, */     \
+    /* unless fixed capacity, is reserved for every put it holds before replaying. Replay */  \
+    /* stops at the first torn or corrupt record, which can only be the tail of a crashed */  \
+    /* group, and the log is cut back to there so later commits aren't appended after it; */  \
+    /* o_records receives the number of records applied. A missing log is an empty one. A */  \
+    /* put the map refuses (other than SAME_KEY) also stops the replay and its error is */    \
+    /* returned, with o_records counting the records before it; MAP_FULL can also mean the */ \
+    /* log couldn't be read in. */                                                            \
+    static h_result h_wal_recover_##name(h_map_##name *map, const char *path,                 \
+                                         h_u64 *o_records = 0)                                \
+    {                                                                                         \
+        FILE *file = fopen(path, "rb");                                                       \
+        if (o_records)                                                                        \
+        {                                                                                     \
+            *o_records = 0;                                                                   \
+        }                                                                                     \
+        if (!file)                                                                            \
+        {                                                                                     \
+            return NO_ERROR;                                                                  \
+        }                                                                                     \
+        fseek(file, 0, SEEK_END);                                                             \
+        h_u64 size = (h_u64)ftell(file);                                                      \
+        fseek(file, 0, SEEK_SET);                                                             \
+        unsigned char *data = (unsigned char *)malloc(size ? size : 1);                       \
+        if (!data)                                                                            \
+        {                                                                                     \
+            fclose(file);                                                                     \
+            return MAP_FULL;                                                                  \
+        }                                                                                     \
+        size = fread(data, 1, size, file);                                                    \
+        fclose(file);                                                                         \
+                                                                                              \
+        /* First pass validates records and counts puts, so the map grows at most once */     \
+        h_u64 valid_end = 0;                                                                  \
+        h_u64 n_puts = 0;                                                                     \
+        while (valid_end < size)                                                              \
+        {                                                                                     \
+            unsigned char op = data[valid_end];                                               \
+            h_u64 record_size = op == H_WAL_PUT      ? h_wal_put_size_##name                  \
+                                : op == H_WAL_REMOVE ? h_wal_remove_size_##name               \
+                                                     : 0;                                     \
+            if (!record_size || valid_end + record_size > size)                               \
+            {                                                                                 \
+                break;                                                                        \
+            }                                                                                 \
+            h_u32 checksum = 0;                                                               \
+            h_u64 body_size = record_size - sizeof(h_u32);                                    \
+            memcpy(&checksum, data + valid_end + body_size, sizeof(h_u32));                   \
+            if (checksum != h_wal_checksum(data + valid_end, body_size))                      \
+            {                                                                                 \
+                break;                                                                        \
+            }                                                                                 \
+            n_puts += op == H_WAL_PUT;                                                        \
+            valid_end += record_size;                                                         \
+        }                                                                                     \
+        if (valid_end < size && h_wal_truncate(path, valid_end) != 0)                         \
+        {                                                                                     \
+            free(data);                                                                       \
+            return UNKNOWN_ERROR;                                                             \
+        }                                                                                     \
+        if (!map->fixed_capacity)                                                             \
+        {                                                                                     \
+            h_reserve_##name(map, (h_u32)(map->buckets_used + n_puts));                       \
+        }                                                                                     \
+                                                                                              \
+        h_u64 records = 0;                                                                    \
+        h_result res = NO_ERROR;                                                              \
+        for (h_u64 offset = 0; offset < valid_end; records++)                                 \
+        {                                                                                     \
+            h_key_type_##name key;                                                            \
+            memcpy(&key, data + offset + 1, sizeof(h_key_type_##name));                       \
+            if (data[offset] == H_WAL_PUT)                                                    \
+            {                                                                                 \
+                h_val_type_##name val;                                                        \
+                memcpy(&val, data + offset + 1 + sizeof(h_key_type_##name),                   \
+                       sizeof(h_val_type_##name));                                            \
+                res = h_put_##name(map, key, val);                                            \
+                if (res == SAME_KEY)                                                          \
+                {                                                                             \
+                    res = NO_ERROR;                                                           \
+                }                                                                             \
+                if (res != NO_ERROR)                                                          \
+                {                                                                             \
+                    break;                                                                    \
+                }                                                                             \
+                offset += h_wal_put_size_##name;                                              \
+            }                                                                                 \
+            else                                                                              \
+            {                                                                                 \
+                h_remove_##name(map, key);                                                    \
+                offset += h_wal_remove_size_##name;                                           \
+            }                                                                                 \
+        }                                                                                     \
+        free(data);                                                                           \
+        if (o_records)                                                                        \
+        {                                                                                     \
+            *o_records = records;                                                             \
+        }                                                                                     \
+        return res;                                                                           \
+    }
+
+#endif
@@ -12,43 +12,65 @@ struct len_string
     char *str;
 };
 
+// Lengths are compared first, so keys of different lengths never touch their bytes
 inline b32 operator==(const len_string &a, const len_string &b)
 {
-    if (a.string_len == b.string_len)
-    {
-        if (streq(a.str, b.str, a.string_len))
-        {
-            return true;
-        }
-    }
-    return false;
+    return a.string_len == b.string_len && streq(a.str, b.str, a.string_len);
 }
 
-// TODO optimize
 inline b32 operator!=(const len_string &a, const len_string &b)
 {
     return !(a == b);
 }
 
+// b's length is only known by scanning it, and streq mustn't read past its terminator
 inline b32 operator==(const len_string &a, char *b)
 {
-    if (streq(a.str, b, a.string_len))
-    {
-        u32 b_len = strlen(b);
-        if (a.string_len == b_len)
-        {
-            return true;
-        }
-    }
-    return false;
+    return strlen(b) == a.string_len && streq(a.str, b, a.string_len);
 }
 
-// TODO optimize
 inline b32 operator!=(const len_string &a, char *b)
 {
     return !(a == b);
 }
 
+// Non-owning pointer + length, e.g. into a network buffer. Lets string keyed maps be
+// probed without l_string() allocating a key.
+struct len_string_view
+{
+    u32 string_len;
+    char *str;
+};
+
+flocal inline len_string_view l_string_view(char *str, u32 len)
+{
+    len_string_view view = {};
+    view.string_len = len;
+    view.str = str;
+    return view;
+}
+
+flocal inline len_string_view l_string_view(const len_string &s)
+{
+    return l_string_view(s.str, s.string_len);
+}
+
+inline b32 operator==(const len_string &a, const len_string_view &b)
+{
+    return a.string_len == b.string_len && streq(a.str, b.str, a.string_len);
+}
+
+// djb2 over exactly len bytes, so a view hashes the same as the len_string it matches
+flocal inline u64 l_string_hash(const char *str, u32 len)
+{
+    u64 hash = 5381;
+    LOOP(i, len)
+    {
+        hash = ((hash << 5) + hash) + (u8)str[i];
+    }
+    return hash;
+}
+
 flocal inline void free_l_string(len_string *str)
 {
     str->buffer_len = 0;
@@ -72,44 +94,47 @@ flocal inline void reallocate_len_string(len_string *l, u32 new_size)
     l->buffer_len = new_size;
 }
 
-flocal inline void append_to_len_string(len_string *l, char *str, u32 len)
+// Grows by at least half the buffer at a time, so repeated appends don't realloc each call
+flocal inline void append_to_len_string(len_string *l, const char *str, u32 len)
 {
-    u32 in_str_len = len;
-    if (in_str_len + l->string_len > l->buffer_len)
-    {
-        reallocate_len_string(l, in_str_len + l->string_len + 1);
-    }
-    for (int i = 0; i < in_str_len; i++)
+    u32 needed = l->string_len + len + 1;
+    if (needed > l->buffer_len)
     {
-        l->str[l->string_len + i] = str[i];
+        u32 grown = l->buffer_len + l->buffer_len / 2;
+        reallocate_len_string(l, needed > grown ? needed : grown);
     }
-    l->string_len += in_str_len;
+    memcpy(l->str + l->string_len, str, len);
+    l->string_len += len;
     l->str[l->string_len] = 0;
 }
 
+flocal inline void append_to_len_string(len_string *l, char *str, u32 len)
+{
+    append_to_len_string(l, (const char *)str, len);
+}
+
 flocal inline void append_to_len_string(len_string *l, const char *str)
 {
-    u32 in_str_len = strlen(str);
-    if (in_str_len + l->string_len + 1 > l->buffer_len)
-    {
-        reallocate_len_string(l, in_str_len + l->string_len + 2);
-    }
-    for (int i = 0; i < in_str_len; i++)
-    {
-        l->str[l->string_len + i] = str[i];
-    }
-    l->string_len += in_str_len;
-    l->str[l->string_len] = 0;
+    append_to_len_string(l, str, (u32)strlen(str));
 }
 
-flocal inline len_string l_string(const char *str)
+// Copies exactly len bytes plus a terminator in one allocation
+flocal inline len_string l_string(const char *str, u32 len)
 {
-    u32 buffer_len = strlen(str) + 1;
-    len_string ret = l_string(buffer_len);
-    append_to_len_string(&ret, str);
+    len_string ret = {};
+    ret.buffer_len = len + 1;
+    ret.string_len = len;
+    ret.str = (char *)malloc(ret.buffer_len);
+    memcpy(ret.str, str, len);
+    ret.str[len] = 0;
     return ret;
 }
 
+flocal inline len_string l_string(const char *str)
+{
+    return l_string(str, (u32)strlen(str));
+}
+
 // flocal inline len_string l_string(std::string str)
 // {
 //     u32 buffer_len = str.length() + 2;
@@ -130,19 +155,15 @@ flocal inline len_string l_string(const char *str)
 //     return ret;
 // }
 
+// Uses s.string_len rather than scanning for the terminator, so embedded zeros are kept
 flocal inline len_string l_string(len_string s)
 {
-    len_string ret = l_string(s.buffer_len);
-    append_to_len_string(&ret, s.str);
-    return ret;
+    return l_string((const char *)s.str, s.string_len);
 }
 
 flocal inline len_string l_string(char *str, u32 len)
 {
-    u32 buffer_len = len + 1;
-    len_string ret = l_string(buffer_len);
-    append_to_len_string(&ret, str, len);
-    return ret;
+    return l_string((const char *)str, len);
 }
 
 flocal inline void sub_str_to_null_terminated(char *s, u32 length, char **out)